@@ -32,7 +32,9 @@ Maintainer: Miguel Luis, Gregory Cristian and Wael Guibene
 
 /* Includes ------------------------------------------------------------------*/
 #include <time.h>
+#include <assert.h>
 #include "rtc.h"
+#include "halt.h"
 #include "timeServer.h"
 //#include "low_power.h"
 
@@ -53,46 +55,74 @@ Maintainer: Miguel Luis, Gregory Cristian and Wael Guibene
   } while(0);
 
 
+/*!
+ * Maximum number of timers that can be running at the same time
+ *
+ * Worst case today is 18 timers: 8 in the firmware (cmd.c 1, seg.c 1, lrw.c 3,
+ * rtc.c 2 including the one rtc_delay_ms keeps on the stack) and 10 in
+ * LoRaMac-node (4 in LoRaMac.c, 3 in LoRaMacClassB.c, 3 in the SX1276 driver).
+ * Update TIMER_WORST_CASE when adding timers, TimerHeapPush halts if the heap
+ * fills up.
+ */
+#define TIMER_WORST_CASE 18
+
+#ifndef TIMER_QUEUE_SIZE
+#define TIMER_QUEUE_SIZE 32
+#endif
+static_assert( TIMER_QUEUE_SIZE >= TIMER_WORST_CASE, "TIMER_QUEUE_SIZE too small" );
 
 /*!
- * Timers list head pointer
+ * Longest supported timeout in ticks. Timestamps are absolute RTC tick values
+ * that wrap around, so two timestamps can only be ordered if they are less
+ * than half of the tick range apart (about 24 days).
  */
-static TimerEvent_t *TimerListHead = NULL;
+#define TIMER_MAX_TICKS ( ( uint32_t )INT32_MAX )
 
 /*!
- * \brief Adds or replace the head timer of the list.
- *
- * \remark The list is automatically sorted. The list head always contains the
- *         next timer to expire.
- *
- * \param [IN]  obj Timer object to be become the new head
- * \param [IN]  remainingTime Remaining time of the previous head to be replaced
+ * True if timestamp a expires before timestamp b (wrap around safe)
+ */
+#define TIMER_BEFORE( a, b ) ( ( int32_t )( ( a ) - ( b ) ) < 0 )
+
+/*!
+ * Running timers, organized as a binary min-heap ordered by the absolute RTC
+ * tick value at which they expire. The root always contains the next timer to
+ * expire. Since timestamps are absolute, nothing needs to be rebased when the
+ * alarm fires and starting or stopping a timer takes O(log n).
  */
-static void TimerInsertNewHeadTimer( TimerEvent_t *obj );
+static TimerEvent_t *TimerHeap[TIMER_QUEUE_SIZE];
+static uint8_t TimerCount = 0;
 
 /*!
- * \brief Adds a timer to the list.
+ * Timer whose callback is being executed, NULL outside of callbacks
+ */
+static TimerEvent_t *TimerRunning = NULL;
+
+/*!
+ * \brief Adds a timer to the heap
  *
- * \remark The list is automatically sorted. The list head always contains the
- *         next timer to expire.
+ * \param [IN]  obj Timer object to be added to the heap
+ */
+static void TimerHeapPush( TimerEvent_t *obj );
+
+/*!
+ * \brief Removes the timer at the given position from the heap
  *
- * \param [IN]  obj Timer object to be added to the list
- * \param [IN]  remainingTime Remaining time of the running head after which the object may be added
+ * \param [IN]  index Position of the timer in the heap
  */
-static void TimerInsertTimer( TimerEvent_t *obj );
+static void TimerHeapRemove( uint8_t index );
 
 /*!
- * \brief Sets a timeout with the duration "timestamp"
+ * \brief Sets the RTC alarm for the timer at the root of the heap
  *
- * \param [IN] timestamp Delay duration
+ * \param [IN] obj Timer object at the root of the heap
  */
 static void TimerSetTimeout( TimerEvent_t *obj );
 
 /*!
- * \brief Check if the Object to be added is not already in the list
+ * \brief Check if the Object to be added is already in the heap
  *
- * \param [IN] timestamp Delay duration
- * \retval true (the object is already in the list) or false
+ * \param [IN] obj Timer object
+ * \retval true (the object is already in the heap) or false
  */
 static bool TimerExists( TimerEvent_t *obj );
 
@@ -104,7 +134,7 @@ void TimerInit( TimerEvent_t *obj, void ( *callback )( void *context ) )
   obj->IsNext2Expire = false;
   obj->Callback = callback;
   obj->Context = NULL;
-  obj->Next = NULL;
+  obj->HeapIndex = 0;
 }
 
 void TimerSetContext( TimerEvent_t *obj, void* context )
@@ -114,40 +144,31 @@ void TimerSetContext( TimerEvent_t *obj, void* context )
 
 void TimerStart( TimerEvent_t *obj )
 {
-  uint32_t elapsedTime = 0;
-
   BACKUP_PRIMASK();
 
   DISABLE_IRQ( );
 
-
   if( ( obj == NULL ) || ( TimerExists( obj ) == true ) )
   {
     RESTORE_PRIMASK( );
     return;
   }
-  obj->Timestamp = obj->ReloadValue;
+
+  TimerEvent_t* head = ( TimerCount != 0 ) ? TimerHeap[0] : NULL;
+
+  obj->Timestamp = rtc_get_timer_value( ) + obj->ReloadValue;
   obj->IsStarted = true;
   obj->IsNext2Expire = false;
 
-  if( TimerListHead == NULL )
-  {
-    rtc_set_timer_context( );
-    TimerInsertNewHeadTimer( obj ); // insert a timeout at now+obj->Timestamp
-  }
-  else
-  {
-    elapsedTime = rtc_get_timer_elapsed_time( );
-    obj->Timestamp += elapsedTime;
+  TimerHeapPush( obj );
 
-    if( obj->Timestamp < TimerListHead->Timestamp )
-    {
-      TimerInsertNewHeadTimer( obj);
-    }
-    else
+  if( TimerHeap[0] == obj ) // The new timer expires first
+  {
+    if( head != NULL )
     {
-      TimerInsertTimer( obj);
+      head->IsNext2Expire = false;
     }
+    TimerSetTimeout( obj );
   }
   RESTORE_PRIMASK( );
 }
@@ -162,55 +183,53 @@ bool TimerIsStarted( TimerEvent_t *obj )
 void TimerIrqHandler( void )
 {
   TimerEvent_t* cur;
-  TimerEvent_t* next;
-
-
 
-  uint32_t old =  rtc_get_timer_context( );
-  uint32_t now =  rtc_set_timer_context( );
-  uint32_t DeltaContext = now - old; //intentionnal wrap around
-
-  /* Update timeStamp based upon new Time Reference*/
-  /* because delta context should never exceed 2^32*/
-  if ( TimerListHead != NULL )
+  /* The alarm may fire before the root timer is due. It is set early by the
+   * Stop mode wake-up time if Stop mode is allowed when it is set, and the MCU
+   * only sleeps if a Stop lock is taken afterwards. Wait for the last few
+   * ticks, set the alarm again if the timer is due later than that. */
+  if( TimerCount != 0 )
   {
-    for (cur=TimerListHead; cur->Next != NULL; cur= cur->Next)
+    uint32_t now = rtc_get_timer_value( );
+    if( TIMER_BEFORE( now, TimerHeap[0]->Timestamp ) )
     {
-      next =cur->Next;
-      if (next->Timestamp > DeltaContext)
-      {
-        next->Timestamp -= DeltaContext;
-      }
-      else
+      if( TimerHeap[0]->Timestamp - now > rtc_get_min_timeout( ) )
       {
-        next->Timestamp = 0 ;
+        TimerSetTimeout( TimerHeap[0] );
+        return;
       }
+      while( TIMER_BEFORE( rtc_get_timer_value( ), TimerHeap[0]->Timestamp ) );
     }
   }
 
   /* execute imediately the alarm callback */
-  if ( TimerListHead != NULL )
+  if( TimerCount != 0 )
   {
-    cur = TimerListHead;
-    TimerListHead = TimerListHead->Next;
+    cur = TimerHeap[0];
+    TimerHeapRemove( 0 );
     cur->IsStarted = false;
+    cur->IsNext2Expire = false;
+    TimerRunning = cur;
     exec_cb( cur->Callback, cur->Context );
+    TimerRunning = NULL;
   }
 
-
-  // remove all the expired object from the list
-  while( ( TimerListHead != NULL ) && ( TimerListHead->Timestamp < rtc_get_timer_elapsed_time(  )  ))
+  // remove all the expired object from the heap
+  while( ( TimerCount != 0 ) && TIMER_BEFORE( TimerHeap[0]->Timestamp, rtc_get_timer_value( ) ) )
   {
-   cur = TimerListHead;
-   TimerListHead = TimerListHead->Next;
-   cur->IsStarted = false;
-   exec_cb( cur->Callback, cur->Context );
+    cur = TimerHeap[0];
+    TimerHeapRemove( 0 );
+    cur->IsStarted = false;
+    cur->IsNext2Expire = false;
+    TimerRunning = cur;
+    exec_cb( cur->Callback, cur->Context );
+    TimerRunning = NULL;
   }
 
-  /* start the next TimerListHead if it exists AND NOT running */
-  if( ( TimerListHead != NULL ) && ( TimerListHead->IsNext2Expire == false ) )
+  /* start the next timer if it exists AND NOT running */
+  if( ( TimerCount != 0 ) && ( TimerHeap[0]->IsNext2Expire == false ) )
   {
-    TimerSetTimeout( TimerListHead );
+    TimerSetTimeout( TimerHeap[0] );
   }
 }
 
@@ -220,70 +239,32 @@ void TimerStop( TimerEvent_t *obj )
 
   DISABLE_IRQ( );
 
-  TimerEvent_t* prev = TimerListHead;
-  TimerEvent_t* cur = TimerListHead;
-
-  // List is empty or the Obj to stop does not exist
-  if( ( TimerListHead == NULL ) || ( obj == NULL ) )
+  // Heap is empty or the Obj to stop does not exist
+  if( ( obj == NULL ) || ( TimerExists( obj ) == false ) )
   {
+    if( obj != NULL )
+    {
+      obj->IsStarted = false;
+    }
     RESTORE_PRIMASK( );
     return;
   }
 
+  bool running = obj->IsNext2Expire;
+
   obj->IsStarted = false;
+  obj->IsNext2Expire = false;
+  TimerHeapRemove( obj->HeapIndex );
 
-  if( TimerListHead == obj ) // Stop the Head
+  if( running == true ) // The alarm is set for the stopped timer
   {
-    if( TimerListHead->IsNext2Expire == true ) // The head is already running
+    if( TimerCount != 0 )
     {
-
-      TimerListHead->IsNext2Expire = false;
-      if( TimerListHead->Next != NULL )
-      {
-        TimerListHead = TimerListHead->Next;
-        TimerSetTimeout( TimerListHead );
-      }
-      else
-      {
-        rtc_stop_alarm( );
-        TimerListHead = NULL;
-      }
+      TimerSetTimeout( TimerHeap[0] );
     }
-    else // Stop the head before it is started
-    {
-      if( TimerListHead->Next != NULL )
-      {
-        TimerListHead = TimerListHead->Next;
-      }
-      else
-      {
-        TimerListHead = NULL;
-      }
-    }
-  }
-  else // Stop an object within the list
-  {
-    while( cur != NULL )
+    else
     {
-      if( cur == obj )
-      {
-        if( cur->Next != NULL )
-        {
-          cur = cur->Next;
-          prev->Next = cur;
-        }
-        else
-        {
-          cur = NULL;
-          prev->Next = cur;
-        }
-        break;
-      }
-      else
-      {
-        prev = cur;
-        cur = cur->Next;
-      }
+      rtc_stop_alarm( );
     }
   }
 
@@ -312,10 +293,39 @@ void TimerSetValue( TimerEvent_t *obj, uint32_t value )
     ticks = minValue;
   }
 
+  if( ticks > TIMER_MAX_TICKS )
+  {
+    ticks = TIMER_MAX_TICKS;
+  }
+
   obj->Timestamp = ticks;
   obj->ReloadValue = ticks;
 }
 
+TimerTime_t TimerGetTimeToNextEvent( void )
+{
+  TimerTime_t rv = UINT32_MAX;
+
+  BACKUP_PRIMASK();
+
+  DISABLE_IRQ( );
+
+  if( TimerCount != 0 )
+  {
+    uint32_t now = rtc_get_timer_value( );
+    rv = TIMER_BEFORE( now, TimerHeap[0]->Timestamp ) ?
+      rtc_tick2ms( TimerHeap[0]->Timestamp - now ) : 0;
+  }
+
+  RESTORE_PRIMASK( );
+  return rv;
+}
+
+TimerEvent_t *TimerGetRunning( void )
+{
+  return TimerRunning;
+}
+
 TimerTime_t TimerGetCurrentTime( void )
 {
   uint32_t now = rtc_get_timer_value( );
@@ -336,29 +346,26 @@ TimerTime_t TimerGetElapsedTime( TimerTime_t past )
 
 static bool TimerExists( TimerEvent_t *obj )
 {
-  TimerEvent_t* cur = TimerListHead;
-
-  while( cur != NULL )
-  {
-    if( cur == obj )
-    {
-      return true;
-    }
-    cur = cur->Next;
-  }
-  return false;
+  return ( obj->HeapIndex < TimerCount ) && ( TimerHeap[obj->HeapIndex] == obj );
 }
+
 static void TimerSetTimeout( TimerEvent_t *obj )
 {
-  int32_t minTicks= rtc_get_min_timeout( );
+  uint32_t minTicks = rtc_get_min_timeout( );
   obj->IsNext2Expire = true;
 
-  // In case deadline too soon
-  if(obj->Timestamp  < (rtc_get_timer_elapsed_time(  ) + minTicks) )
+  // The RTC alarm is set relative to the timer context
+  uint32_t now = rtc_set_timer_context( );
+
+  // In case deadline too soon, only the alarm is postponed. The timer keeps
+  // its deadline, which the heap is ordered by, and TimerIrqHandler runs it as
+  // soon as the alarm fires.
+  uint32_t ticks = obj->Timestamp - now;
+  if( TIMER_BEFORE( obj->Timestamp, now + minTicks ) )
   {
-    obj->Timestamp = rtc_get_timer_elapsed_time(  ) + minTicks;
+    ticks = minTicks;
   }
-  rtc_set_alarm( obj->Timestamp );
+  rtc_set_alarm( ticks );
 }
 
 TimerTime_t TimerTempCompensation( TimerTime_t period, float temperature )
@@ -367,41 +374,79 @@ TimerTime_t TimerTempCompensation( TimerTime_t period, float temperature )
 }
 
 
-static void TimerInsertTimer( TimerEvent_t *obj)
+static void TimerHeapSet( uint8_t index, TimerEvent_t *obj )
 {
-  TimerEvent_t* cur = TimerListHead;
-  TimerEvent_t* next = TimerListHead->Next;
+  TimerHeap[index] = obj;
+  obj->HeapIndex = index;
+}
 
-  while (cur->Next != NULL )
+static void TimerHeapUp( uint8_t index )
+{
+  TimerEvent_t *obj = TimerHeap[index];
+
+  while( index > 0 )
   {
-    if( obj->Timestamp  > next->Timestamp )
+    uint8_t parent = ( index - 1 ) / 2;
+    if( !TIMER_BEFORE( obj->Timestamp, TimerHeap[parent]->Timestamp ) )
     {
-        cur = next;
-        next = next->Next;
+      break;
     }
-    else
-    {
-        cur->Next = obj;
-        obj->Next = next;
-        return;
+    TimerHeapSet( index, TimerHeap[parent] );
+    index = parent;
+  }
+  TimerHeapSet( index, obj );
+}
 
+static void TimerHeapDown( uint8_t index )
+{
+  TimerEvent_t *obj = TimerHeap[index];
+
+  for( ;; )
+  {
+    uint8_t child = 2 * index + 1;
+    if( child >= TimerCount )
+    {
+      break;
+    }
+    if( ( child + 1 < TimerCount ) &&
+        TIMER_BEFORE( TimerHeap[child + 1]->Timestamp, TimerHeap[child]->Timestamp ) )
+    {
+      child++;
     }
+    if( !TIMER_BEFORE( TimerHeap[child]->Timestamp, obj->Timestamp ) )
+    {
+      break;
+    }
+    TimerHeapSet( index, TimerHeap[child] );
+    index = child;
   }
-  cur->Next = obj;
-  obj->Next = NULL;
+  TimerHeapSet( index, obj );
 }
 
-static void TimerInsertNewHeadTimer( TimerEvent_t *obj )
+static void TimerHeapPush( TimerEvent_t *obj )
 {
-  TimerEvent_t* cur = TimerListHead;
+  if( TimerCount >= TIMER_QUEUE_SIZE )
+  {
+    halt( "Too many timers running, increase TIMER_QUEUE_SIZE" );
+  }
 
-  if( cur != NULL )
+  TimerHeapSet( TimerCount, obj );
+  TimerCount++;
+  TimerHeapUp( obj->HeapIndex );
+}
+
+static void TimerHeapRemove( uint8_t index )
+{
+  TimerEvent_t *last = TimerHeap[--TimerCount];
+  TimerHeap[TimerCount] = NULL;
+
+  if( index == TimerCount )
   {
-    cur->IsNext2Expire = false;
+    return;
   }
 
-  obj->Next = cur;
-  TimerListHead = obj;
-  TimerSetTimeout( TimerListHead );
+  TimerHeapSet( index, last );
+  TimerHeapUp( index );
+  TimerHeapDown( last->HeapIndex );
 }
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
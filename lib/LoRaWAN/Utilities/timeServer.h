@@ -50,13 +50,13 @@ Maintainer: Miguel Luis and Gregory Cristian
  */
 typedef struct TimerEvent_s
 {
-    uint32_t Timestamp;                  //! Expiring timer value in ticks from TimerContext
+    uint32_t Timestamp;                  //! Absolute RTC tick value at which the timer expires
     uint32_t ReloadValue;                //! Reload Value when Timer is restarted
     bool IsStarted;                      //! Is the timer currently running
-    bool IsNext2Expire;                  //! Is the next timer to expire
+    bool IsNext2Expire;                  //! Is the RTC alarm set for this timer
+    uint8_t HeapIndex;                   //! Position in the timer heap while running
     void ( *Callback )( void* context ); //! Timer IRQ callback function
     void *Context;                       //! User defined data object pointer to pass back
-    struct TimerEvent_s *Next;           //! Pointer to the next Timer object.
 }TimerEvent_t;
 
 
@@ -132,6 +132,23 @@ void TimerReset( TimerEvent_t *obj );
  */
 void TimerSetValue( TimerEvent_t *obj, uint32_t value );
 
+/*!
+ * \brief Return the time until the next running timer expires
+ *
+ * \retval time in ms, UINT32_MAX if no timer is running
+ */
+TimerTime_t TimerGetTimeToNextEvent( void );
+
+/*!
+ * \brief Return the timer whose callback is currently being executed
+ *
+ * \note The Timestamp field of the returned object holds the RTC tick value
+ *       at which the timer was scheduled to expire
+ *
+ * \retval timer object, NULL if not called from a timer callback
+ */
+TimerEvent_t *TimerGetRunning( void );
+
 /*!
  * \brief Read the current time
  *
@@ -38,16 +38,17 @@ Maintainer: Miguel Luis and Gregory Cristian
 /* BACKUP_PRIMASK MUST be implemented at the begining of the funtion
    that implement a critical section
    PRIMASK is saved on STACK and recovered at the end of the funtion
-   That way RESTORE_PRIMASK ensures critical sections are maintained even in nested calls...*/
+   That way RESTORE_PRIMASK ensures critical sections are maintained even in nested calls...
+   The macros map to the functions from irq.h so that the critical sections
+   show up in the interrupt-masking profile (IRQ_PROFILE). */
 #define BACKUP_PRIMASK()  uint32_t primask_bit= __get_PRIMASK()
-#define DISABLE_IRQ() __disable_irq()
-#define ENABLE_IRQ() __enable_irq()
-#define RESTORE_PRIMASK() __set_PRIMASK(primask_bit)
+#define DISABLE_IRQ() ((void)disable_irq())
+#define ENABLE_IRQ() enable_irq()
+#define RESTORE_PRIMASK() reenable_irq(primask_bit)
 
 
-#define CRITICAL_SECTION_BEGIN( )     uint32_t primask_bit= __get_PRIMASK();\
-                                    __disable_irq()
-#define CRITICAL_SECTION_END( )   __set_PRIMASK(primask_bit)
+#define CRITICAL_SECTION_BEGIN( )     uint32_t primask_bit= disable_irq()
+#define CRITICAL_SECTION_END( )   reenable_irq(primask_bit)
 
 #define LOG(...)     do{ atci_printf(__VA_ARGS__); }while(0);
 
@@ -67,6 +67,7 @@ class EventType(Enum):
     MODULE  = 0
     JOIN    = 1
     NETWORK = 2
+    SEGMENT = 3
 
 @unique
 class ModuleEventSubtype(Enum):
@@ -86,7 +87,12 @@ class NetworkEventSubtype(Enum):
     ANSWER         = 1
     RETRANSMISSION = 2
 
-EventSubtype = Union[ModuleEventSubtype, JoinEventSubtype, NetworkEventSubtype]
+@unique
+class SegmentEventSubtype(Enum):
+    FAILED = 0
+    DONE   = 1
+
+EventSubtype = Union[ModuleEventSubtype, JoinEventSubtype, NetworkEventSubtype, SegmentEventSubtype]
 
 
 UARTConfig = namedtuple('UARTConfig', 'baudrate data_bits stop_bits parity flow_control')
@@ -3411,6 +3417,161 @@ class OpenLoRaModem(MurataModem):
 
     lock_keys = lockkeys
 
+    def segtx(self, port: int, data: bytes, confirmed = False, group: int = 0, timeout: Optional[float] = None, hex = False, chunk: int = 128):
+        '''Send a large payload in fragments over multiple uplinks.
+
+        The data is uploaded into the modem's segmented transfer buffer in
+        chunks of up to `chunk` bytes and then sent to the given port in
+        fragments sized for the current data rate. If `group` is non-zero, the
+        modem sends a parity fragment after each group of `group` data
+        fragments, which allows the receiver to recover one lost fragment per
+        group. Use SegmentReassembler on the receiving side to put the data
+        back together.
+
+        If `timeout` is not None, the method blocks until the modem has
+        submitted all fragments and raises an exception if the transfer fails.
+        '''
+        assert self.modem.port is not None
+        with self.modem.lock:
+            self.modem.AT('$SEGBUF=0')
+            for i in range(0, len(data), chunk):
+                part = data[i:i + chunk]
+                self.modem.AT(f'$SEGBUF {len(part)}', wait=False, flush=False)
+                if hex:
+                    self.modem.port.write(binascii.hexlify(part))
+                else:
+                    self.modem.port.write(part)
+                self.modem.flush()
+                self.modem.read_inline_response()
+
+            with self.modem.events as events:
+                self.modem.AT(f'$SEGTX {port},{1 if confirmed else 0},{group}')
+                if timeout is not None:
+                    status = events.wait_for('event=3', timeout=timeout)[0]
+                    if status != SegmentEventSubtype.DONE.value:
+                        raise ModemError('Segmented transfer failed', status)
+
+    @property
+    def segtx_progress(self) -> Tuple[bool, int, int]:
+        '''Return the state of the segmented transfer.
+
+        The value is a tuple (<active>,<sent>,<total>) where sent is the number
+        of data fragments sent so far and total is the number of data fragments
+        in the transfer.
+        '''
+        active, sent, total = map(int, assert_response(self.modem.AT('$SEGTX?')).split(','))
+        return active == 1, sent, total
+
+
+class SegmentReassembler:
+    '''Reference reassembler for segmented transfers (AT$SEGTX).
+
+    Feed the payload of each uplink received on the transfer's port to the
+    method feed. The method returns the reassembled data once all data
+    fragments have been received, or recovered from parity fragments, and None
+    otherwise.
+
+    Each fragment starts with a four-byte header:
+
+      byte 0: transfer id (bits 7-4), parity group size (bits 3-0)
+      byte 1: data fragment index, or parity group index
+      byte 2: parity flag (bit 7), total length bits 11-8 (bits 3-0)
+      byte 3: total length bits 7-0
+
+    All data fragments except for the last one have the same size. A parity
+    fragment is the XOR of the data fragments in its group, padded with zeroes
+    to the fragment size.
+    '''
+    HEADER_SIZE = 4
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.id: Optional[int] = None
+        self.length = 0
+        self.group = 0
+        self.size: Optional[int] = None
+        self.data: dict[int, bytes] = {}
+        self.parity: dict[int, bytes] = {}
+
+    @property
+    def count(self) -> Optional[int]:
+        if self.size is None:
+            return None
+        return (self.length + self.size - 1) // self.size
+
+    def _fragment_length(self, index: int) -> int:
+        assert self.size is not None
+        return min(self.size, self.length - index * self.size)
+
+    def _infer_size(self):
+        # Parity fragments and all data fragments except for the last one are
+        # full-sized. A single data fragment is ambiguous (it may be the short
+        # last one) unless it carries all the data, so wait for a parity
+        # fragment or a second data fragment before fixing the fragment size.
+        if self.size is not None:
+            return
+        if self.parity:
+            self.size = len(next(iter(self.parity.values())))
+        elif len(self.data) > 1:
+            self.size = max(map(len, self.data.values()))
+        elif 0 in self.data and len(self.data[0]) == self.length:
+            self.size = self.length
+
+    def _recover(self):
+        if self.size is None or not self.group:
+            return
+
+        for g, parity in self.parity.items():
+            members = range(g * self.group, min((g + 1) * self.group, self.count))
+            missing = [i for i in members if i not in self.data]
+            if len(missing) != 1:
+                continue
+
+            buf = bytearray(parity)
+            for i in members:
+                if i in self.data:
+                    for j, b in enumerate(self.data[i]):
+                        buf[j] ^= b
+
+            i = missing[0]
+            self.data[i] = bytes(buf[:self._fragment_length(i)])
+
+    def feed(self, payload: bytes) -> Optional[bytes]:
+        if len(payload) < self.HEADER_SIZE:
+            raise ValueError('Fragment too short')
+
+        id     = payload[0] >> 4
+        group  = payload[0] & 0x0f
+        index  = payload[1]
+        parity = (payload[2] & 0x80) != 0
+        length = ((payload[2] & 0x0f) << 8) | payload[3]
+        body   = payload[self.HEADER_SIZE:]
+
+        if id != self.id or length != self.length or group != self.group:
+            self.reset()
+            self.id = id
+            self.length = length
+            self.group = group
+
+        if parity:
+            self.parity[index] = body
+        else:
+            self.data[index] = body
+
+        self._infer_size()
+        self._recover()
+
+        count = self.count
+        if count is None:
+            return None
+
+        if all(i in self.data for i in range(count)):
+            return b''.join(self.data[i] for i in range(count))[:self.length]
+
+        return None
+
 
 def uartconfig_to_str(uart):
     if uart.parity == 0:
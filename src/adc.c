@@ -23,9 +23,9 @@
 #define VDDA_TEMP_CAL ((uint32_t)3000)
 
 #define COMPUTE_TEMPERATURE(TS_ADC_DATA, VDDA_APPLI) \
-    (((((((int32_t)((TS_ADC_DATA * VDDA_APPLI) / VDDA_TEMP_CAL) - \
-    (int32_t)*TEMP30_CAL_ADDR)) * (int32_t)(110 - 30)) << 8) / \
-    (int32_t)(*TEMP110_CAL_ADDR - *TEMP30_CAL_ADDR)) + (30 << 8))
+    (((((int32_t)((TS_ADC_DATA * VDDA_APPLI) / VDDA_TEMP_CAL) - \
+    (int32_t)*TEMP30_CAL_ADDR) * (int32_t)(110 - 30) * 256) / \
+    (int32_t)(*TEMP110_CAL_ADDR - *TEMP30_CAL_ADDR)) + 30 * 256)
 
 
 static ADC_HandleTypeDef adc = {
@@ -173,7 +173,7 @@ uint16_t adc_get_battery_level(void)
 }
 
 
-uint16_t adc_get_temperature_level(void)
+int16_t adc_get_temperature_level(void)
 {
     uint32_t v = adc_get_battery_level();
     uint16_t t = adc_get_value(ADC_CHANNEL_TEMPSENSOR);
@@ -183,10 +183,7 @@ uint16_t adc_get_temperature_level(void)
 
 float adc_get_temperature_celsius(void)
 {
-    uint16_t t = adc_get_temperature_level();
-    uint16_t i = t >> 8;
-    uint16_t f = ((t - (i << 8)) * 100) >> 8;
-    float v = (float)i + (float)f / 100.f;
+    float v = adc_get_temperature_level() / 256.0f;
     log_debug("adc_get_temperature_celsius: %f", v);
     return v;
 }
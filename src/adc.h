@@ -22,9 +22,9 @@ void adc_deinit(void);
 uint16_t adc_get_value(uint32_t channel);
 
 //! @brief Get the current temperature
-//! @retval value temperature in degreeCelcius( q7.8 )
+//! @retval value temperature in degreeCelcius( signed q7.8 )
 
-uint16_t adc_get_temperature_level(void);
+int16_t adc_get_temperature_level(void);
 
 //! @brief Get the current temperature in celsius
 //! @retval value temperature
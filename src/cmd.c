@@ -15,6 +15,14 @@
 #include "halt.h"
 #include "utils.h"
 #include "sx1276-board.h"
+#include "rfstats.h"
+#include "rxlog.h"
+#include "sched.h"
+#include "nbtrans.h"
+#include "seg.h"
+#include "eeprom.h"
+#include "kv.h"
+#include "irq.h"
 
 // These are global variables exported by radio.c that store the RSSI and SNR of
 // the most recent received packet.
@@ -1124,6 +1132,108 @@ static void ctx(atci_param_t *param)
 }
 
 
+static void append_segment(atci_data_status_t status, atci_param_t *param)
+{
+    TimerStop(&payload_timer);
+
+    // Unlike AT+UTX, do not accept incomplete data on timeout. A truncated
+    // chunk would silently corrupt the reassembled blob.
+    if (status != ATCI_DATA_OK)
+        abort(ERR_PARAM);
+
+    if (seg_append(param->txt, param->length) != 0)
+        abort(ERR_PAYLOAD_LONG);
+
+    OK_();
+}
+
+
+// Append data to the segmented transfer buffer
+//
+// AT$SEGBUF <length> reads the given number of bytes (in the format selected
+// with AT+DFORMAT) and appends them to the buffer. AT$SEGBUF? returns the
+// number of bytes in the buffer. AT$SEGBUF=0 clears the buffer.
+static void segbuf(atci_param_t *param)
+{
+    uint32_t size;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+    if (!atci_param_get_uint(param, &size)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (seg_active()) abort(ERR_BUSY);
+    if (size > SEGMENT_BUFFER_SIZE - seg_length()) abort(ERR_PAYLOAD_LONG);
+
+    TimerInit(&payload_timer, payload_timeout);
+    TimerSetValue(&payload_timer, sysconf.uart_timeout);
+    TimerStart(&payload_timer);
+
+    if (!atci_set_read_next_data(size,
+        sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, append_segment))
+        abort(ERR_PAYLOAD_LONG);
+}
+
+
+static void get_segbuf(void)
+{
+    OK("%d", seg_length());
+}
+
+
+static void set_segbuf(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    seg_clear();
+    OK_();
+}
+
+
+// Send the contents of the segmented transfer buffer
+//
+// AT$SEGTX <port>,<confirmed>[,<group>] starts the transfer. If group is
+// present and non-zero, a parity fragment is sent after each group of that
+// many data fragments. The modem emits +EVENT=3,1 once all fragments have been
+// submitted and +EVENT=3,0 if the transfer fails. AT$SEGTX? returns the number
+// of data fragments sent and the total number of data fragments.
+static void segtx(atci_param_t *param)
+{
+    uint32_t confirmed, group = 0;
+    int p;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+    if ((p = parse_port(param)) < 0) abort(ERR_PARAM);
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+    if (!atci_param_get_uint(param, &confirmed)) abort(ERR_PARAM);
+    if (confirmed > 1) abort(ERR_PARAM);
+
+    if (param->offset < param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+        if (!atci_param_get_uint(param, &group)) abort(ERR_PARAM);
+        if (group > SEG_MAX_GROUP) abort(ERR_PARAM);
+    }
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (seg_length() == 0) abort(ERR_PARAM);
+
+    abort_on_error(seg_start(p, confirmed, group));
+    OK_();
+}
+
+
+static void get_segtx(void)
+{
+    unsigned int sent, total;
+    seg_progress(&sent, &total);
+    OK("%d,%d,%d", seg_active(), sent, total);
+}
+
+
 static void get_mcast(void)
 {
     McChannelParams_t *c;
@@ -1631,6 +1741,82 @@ static void set_rtynum(atci_param_t *param)
 }
 
 
+static void get_nbtrans(void)
+{
+    OK("%d", sysconf.adaptive_nbtrans);
+}
+
+
+static void set_nbtrans(atci_param_t *param)
+{
+    int enabled = parse_enabled(param);
+    if (enabled == -1) abort(ERR_PARAM);
+
+    // Start from a clean slate so that outcomes recorded before the change do
+    // not influence the controller.
+    if (enabled != sysconf.adaptive_nbtrans) nbtrans_reset();
+
+    sysconf.adaptive_nbtrans = enabled;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_drain(void)
+{
+    OK("%d", sysconf.drain_downlinks);
+}
+
+
+static void set_drain(atci_param_t *param)
+{
+    int enabled = parse_enabled(param);
+    if (enabled == -1) abort(ERR_PARAM);
+
+    sysconf.drain_downlinks = enabled;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_fast_wake(void)
+{
+    OK("%d", sysconf.fast_wake);
+}
+
+
+static void set_fast_wake(atci_param_t *param)
+{
+    int enabled = parse_enabled(param);
+    if (enabled == -1) abort(ERR_PARAM);
+
+    sysconf.fast_wake = enabled;
+    sysconf_modified = true;
+    if (!enabled) system_clock_boost();
+    OK_();
+}
+
+
+static void get_clkscale(void)
+{
+    OK("%d", sysconf.clock_scaling);
+}
+
+
+static void set_clkscale(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v >= SYSTEM_CLOCK_SCALING_POLICIES) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.clock_scaling = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
 static void get_netid(void)
 {
     MibRequestConfirm_t r = { .Type = MIB_NET_ID };
@@ -1668,6 +1854,25 @@ static void dbg(atci_param_t *param)
 
     OK_();
 }
+
+
+static void get_eefault(void)
+{
+    OK("%ld,%lu", eeprom_get_fault(), eeprom_get_programmed());
+}
+
+
+static void set_eefault(atci_param_t *param)
+{
+    uint32_t words;
+
+    if (!atci_param_get_uint(param, &words)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+    if (words > INT32_MAX) abort(ERR_PARAM);
+
+    eeprom_inject_fault(words);
+    OK_();
+}
 #endif
 
 static void do_halt(atci_param_t *param)
@@ -2124,13 +2329,27 @@ void process_uart_wakeup(void)
 #endif
 
 
+static int kv_error(int rc)
+{
+    switch (rc) {
+        case KV_ERR_PARAM: return ERR_PARAM;
+        case KV_ERR_SPACE: return ERR_PAYLOAD_LONG;
+        default:           return ERR_FLASH_ERROR;
+    }
+}
+
+
 // Manage data stored in NVM user registers
 //
 // To read the value in NVM register 0 use the syntaxt AT$NVM 0. To write the
-// value 223 to NVM register 0, use the syntax AT$NVM 0,223.
+// value 223 to NVM register 0, use the syntax AT$NVM 0,223. The registers are
+// kept in the key-value store (see AT$KV) under keys 0 to 63. Registers that
+// have never been written read as 0. The store is sized to hold all 64
+// registers.
 static void nvm_userdata(atci_param_t *param)
 {
     uint32_t addr, value;
+    int rc;
 
     if (param == NULL) abort(ERR_PARAM);
 
@@ -2143,15 +2362,440 @@ static void nvm_userdata(atci_param_t *param)
         if (!atci_param_get_uint(param, &value)) abort(ERR_PARAM);
         if (value >= UINT8_MAX) abort(ERR_PARAM);
 
-        user_nvm.values[addr] = value;
-        nvm_update_user_data();
+        rc = nvm_set_user_data(addr, value);
+        if (rc != 0) abort(kv_error(rc));
+        OK_();
+    } else {
+        OK("%d", nvm_get_user_data(addr));
+    }
+}
+
+
+// Manage values in the key-value store
+//
+// AT$KV <key> returns the value stored under the key (0-254) in hex, AT$KV
+// <key>,<hex> stores a value of up to KV_MAX_VALUE bytes under the key.
+// AT$KV? lists the keys that hold a value in the form <key>:<length>,...
+static void kv_value(atci_param_t *param)
+{
+    uint8_t buf[KV_MAX_VALUE];
+    uint32_t key;
+    size_t len;
+    int rc;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+
+    if (!atci_param_get_uint(param, &key)) abort(ERR_PARAM);
+    if (key > KV_MAX_KEY) abort(ERR_PARAM);
+
+    if (param->offset < param->length) {
+        if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+        if (param->length - param->offset > KV_MAX_VALUE * 2) abort(ERR_PAYLOAD_LONG);
+        len = atci_param_get_buffer_from_hex(param, buf, sizeof(buf), 0);
+        if (len == 0 || param->offset != param->length) abort(ERR_PARAM);
+
+        rc = kv_set(key, buf, len);
+        if (rc != 0) abort(kv_error(rc));
         OK_();
     } else {
-        OK("%d", user_nvm.values[addr]);
+        rc = kv_get(key, buf, sizeof(buf));
+        if (rc < 0) abort(ERR_PARAM);
+
+        atci_print("+OK=");
+        atci_print_buffer_as_hex(buf, rc);
+        EOL();
+    }
+}
+
+
+static void get_kv(void)
+{
+    uint8_t dummy;
+
+    atci_print("+OK=");
+    for (int key = kv_next(-1), first = 1; key >= 0; key = kv_next(key), first = 0)
+        atci_printf(first ? "%d:%d" : ",%d:%d", key, kv_get(key, &dummy, 0));
+    EOL();
+}
+
+
+// Remove a value from the key-value store with AT$KVDEL <key>
+static void kv_del(atci_param_t *param)
+{
+    uint32_t key;
+    int rc;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+
+    if (!atci_param_get_uint(param, &key)) abort(ERR_PARAM);
+    if (key > KV_MAX_KEY) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    rc = kv_delete(key);
+    if (rc != 0) abort(kv_error(rc));
+    OK_();
+}
+
+
+// Radio statistics
+//
+// AT$RFSTATS 0,<channel> and AT$RFSTATS 1,<datarate> return the counters for
+// the given channel or data rate in the form
+// <uplinks>,<retransmissions>,<acked>,<unacked>,<airtime_ms>. AT$RFSTATS 2 and
+// AT$RFSTATS 3 return the RSSI and SNR histograms of received downlinks. Use
+// AT$RFSTATS=0 to reset all statistics.
+static void rfstats(atci_param_t *param)
+{
+    uint32_t type, index;
+    const rfstats_counters_t *c;
+    const uint16_t *hist;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+    if (!atci_param_get_uint(param, &type)) abort(ERR_PARAM);
+
+    switch (type) {
+        case 0:
+        case 1:
+            if (!atci_param_is_comma(param)) abort(ERR_PARAM_NO);
+            if (!atci_param_get_uint(param, &index)) abort(ERR_PARAM);
+            if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+            c = type == 0 ? rfstats_channel(index) : rfstats_datarate(index);
+            if (c == NULL) abort(ERR_PARAM);
+
+            OK("%u,%u,%u,%u,%lu", c->uplinks, c->retransmissions, c->acked,
+                c->unacked, c->airtime);
+            break;
+
+        case 2:
+        case 3:
+            if (param->offset != param->length) abort(ERR_PARAM_NO);
+            hist = type == 2 ? rfstats_rssi_histogram() : rfstats_snr_histogram();
+
+            atci_print("+OK=");
+            for (int i = 0; i < RFSTATS_HIST_BINS; i++)
+                atci_printf(i ? ",%u" : "%u", hist[i]);
+            EOL();
+            break;
+
+        default:
+            abort(ERR_PARAM);
     }
 }
 
 
+static void reset_rfstats(atci_param_t *param)
+{
+    if (parse_enabled(param) != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    rfstats_reset();
+    OK_();
+}
+
+
+// RX window timing log
+//
+// AT$RXLOG? returns the number of receive windows in the log. AT$RXLOG <n>
+// returns the n-th most recent window (zero being the most recent one) in the
+// form <window>,<scheduled>,<started>,<late>,<symb_timeout>,<sf>,<result>.
+// The scheduled and actual RX start times are in RTC ticks (1/1024 s), <late>
+// is their difference. The window is 1 for RX1, 2 for RX2, 3 for continuous
+// reception, and 0 otherwise. The result is 0 while the window is open, 1 if
+// no preamble was detected, and 2 if it was. Use AT$RXLOG=0 to clear the log.
+static void rxlog(atci_param_t *param)
+{
+    uint32_t index;
+    rxlog_entry_t e;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+    if (!atci_param_get_uint(param, &index)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (!rxlog_get(index, &e)) abort(ERR_PARAM);
+
+    OK("%u,%lu,%lu,%ld,%u,%u,%u", e.window, e.scheduled, e.started,
+        (int32_t)(e.started - e.scheduled), e.symb_timeout, e.datarate,
+        e.result);
+}
+
+
+static void get_rxlog(void)
+{
+    OK("%u", rxlog_count());
+}
+
+
+static void reset_rxlog(atci_param_t *param)
+{
+    if (parse_enabled(param) != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    rxlog_reset();
+    OK_();
+}
+
+
+// Power accounting
+//
+// AT$POWER? returns the time spent in Run, Sleep, and Stop mode in seconds
+// followed by the average MCU current in microamperes estimated from the
+// current model configured at build time. AT$POWER 0 and AT$POWER 1 return how
+// long each module held the Stop and the Sleep lock, respectively, in the form
+// <module>:<seconds>,... AT$POWER 2 returns the wake-up statistics in the form
+// <wakeups>,<fast>,<boosts>,<latency_us>,<fast_latency_us> with the average
+// wake-to-work latency of normal and fast (AT$FASTWAKE) wake-ups from Stop
+// mode. AT$POWER 3 compares the clock scaling policies (AT$CLKSCALE) in the
+// form <policy>:<seconds>:<current_uA>,... where <seconds> is the Sleep time
+// spent with the policy and <current_uA> is the average current estimated as
+// if all Sleep time had used the policy. AT$POWER 4 returns the statistics of
+// short delays (e.g., radio and EEPROM waits) in the form
+// <delays>,<seconds>,<asleep_seconds>,<saved_uC> where <asleep_seconds> is the
+// part of the delays spent sleeping instead of polling and <saved_uC> is the
+// charge saved that way in microcoulombs (a lower bound). Use AT$POWER=0 to
+// restart the accounting.
+static void print_seconds(const char *fmt, uint64_t ticks)
+{
+    uint64_t ms = ticks * 1000 / 1024;
+    atci_printf(fmt, (uint32_t)(ms / 1000), (uint32_t)(ms % 1000));
+}
+
+
+static uint32_t average_us(uint64_t total_ns, uint32_t count)
+{
+    return count ? (total_ns / count + 500) / 1000 : 0;
+}
+
+
+static void power(atci_param_t *param)
+{
+    uint32_t type;
+    system_power_stats_t s;
+    system_wake_stats_t w;
+    const uint64_t *held;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+    if (!atci_param_get_uint(param, &type)) abort(ERR_PARAM);
+    if (type > 4) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (type == 4) {
+        rtc_delay_stats_t d;
+        rtc_get_delay_stats(&d);
+        atci_printf("+OK=%lu", d.count);
+        print_seconds(",%lu.%03lu", d.total);
+        print_seconds(",%lu.%03lu", d.asleep);
+        atci_printf(",%lu", system_saved_charge(d.asleep));
+        EOL();
+        return;
+    }
+
+    if (type == 2) {
+        system_get_wake_stats(&w);
+        OK("%lu,%lu,%lu,%lu,%lu", w.wakeups, w.fast, w.boosts,
+            average_us(w.latency[0], w.wakeups - w.fast),
+            average_us(w.latency[1], w.fast));
+        return;
+    }
+
+    system_get_power_stats(&s);
+
+    if (type == 3) {
+        atci_print("+OK=");
+        for (unsigned int i = 0; i < SYSTEM_CLOCK_SCALING_POLICIES; i++) {
+            uint32_t current = system_policy_current(&s, i);
+            atci_printf(i ? ",%u:" : "%u:", i);
+            print_seconds("%lu.%03lu", s.sleep[i]);
+            atci_printf(":%lu.%02lu", current / 100, current % 100);
+        }
+        EOL();
+        return;
+    }
+
+    held = type == 0 ? s.stop_lock : s.sleep_lock;
+
+    atci_print("+OK=");
+    for (unsigned int i = 0; i < SYSTEM_MODULE_COUNT; i++) {
+        atci_printf(i ? ",%s:" : "%s:", system_module_name(i));
+        print_seconds("%lu.%03lu", held[i]);
+    }
+    EOL();
+}
+
+
+static void get_power(void)
+{
+    system_power_stats_t s;
+
+    system_get_power_stats(&s);
+    uint32_t current = system_average_current(&s);
+
+    atci_print("+OK=");
+    print_seconds("%lu.%03lu", s.mode[SYSTEM_POWER_RUN]);
+    print_seconds(",%lu.%03lu", s.mode[SYSTEM_POWER_SLEEP]);
+    print_seconds(",%lu.%03lu", s.mode[SYSTEM_POWER_STOP]);
+    atci_printf(",%lu.%02lu", current / 100, current % 100);
+    EOL();
+}
+
+
+static void reset_power(atci_param_t *param)
+{
+    if (parse_enabled(param) != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    system_reset_power_stats();
+    rtc_reset_delay_stats();
+    OK_();
+}
+
+
+// LSE drift compensation
+//
+// AT$DRIFT? returns <temperature>,<ppm> where <temperature> is the most recent
+// MCU temperature sample in tenths of a degree Celsius (measured on demand
+// outside of class B) and <ppm> is the LSE frequency error LoRaMac compensates
+// class B timing for at that temperature (see RTC_TEMP_PERIOD in the Makefile).
+static void get_drift(void)
+{
+    float t = rtc_get_temperature();
+    int32_t ppm = (int32_t)TimerTempCompensation(1000000, t) - 1000000;
+    OK("%ld,%ld", (int32_t)(t * 10), ppm);
+}
+
+
+// Main loop task profiling
+//
+// AT$TASKS? returns <task>:<runs>:<max_us>,... for all main loop tasks, where
+// <runs> is the number of times the task has been run by the scheduler and
+// <max_us> is its longest run time in microseconds. Use AT$TASKS=0 to reset.
+static void get_tasks(void)
+{
+    sched_stats_t s;
+
+    atci_print("+OK=");
+    for (unsigned int i = 0; sched_get_stats(i, &s); i++)
+        atci_printf(i ? ",%s:%lu:%lu" : "%s:%lu:%lu", sched_task_name(i), s.runs, s.max_us);
+    EOL();
+}
+
+
+static void reset_tasks(atci_param_t *param)
+{
+    if (parse_enabled(param) != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sched_reset_stats();
+    OK_();
+}
+
+
+#if IRQ_PROFILE != 0
+
+// Interrupt masking profile
+//
+// AT$IRQPROF? returns <file>:<line>:<count>:<max_us>,... for the call sites
+// with the longest interrupt-masked sections, longest first. <file> and <line>
+// identify the disable_irq call that started the section, <count> is the
+// number of sections measured, and <max_us> is the longest one in
+// microseconds. Use AT$IRQPROF=0 to reset.
+static void get_irqprof(void)
+{
+    irq_profile_site_t s[IRQ_PROFILE_SITES];
+    unsigned int n = irq_profile_get(s, IRQ_PROFILE_SITES);
+
+    atci_print("+OK=");
+    for (unsigned int i = 0; i < n; i++) {
+        const char *file = strrchr(s[i].file, '/');
+        atci_printf(i ? ",%s:%u:%lu:%lu" : "%s:%u:%lu:%lu", file ? file + 1 : s[i].file,
+            s[i].line, s[i].count, s[i].max_us);
+    }
+    EOL();
+}
+
+
+static void reset_irqprof(atci_param_t *param)
+{
+    if (parse_enabled(param) != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    irq_profile_reset();
+    OK_();
+}
+
+#endif
+
+
+static void get_nvmstats(void)
+{
+    OK("%lu,%lu,%lu,%lu,%lu", nvm_commit_stats.commits, nvm_commit_stats.writes,
+        nvm_commit_stats.coalesced, nvm_commit_stats.deferred,
+        nvm_commit_stats.forced);
+}
+
+
+static void reset_nvmstats(atci_param_t *param)
+{
+    if (parse_enabled(param) != 0) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    memset(&nvm_commit_stats, 0, sizeof(nvm_commit_stats));
+    OK_();
+}
+
+
+// Average number of program/erase cycles each word of the part has seen so far
+static uint32_t wear_cycles(const nvm_wear_t *w)
+{
+    uint32_t words = (w->size + 3) / 4;
+    return words ? w->words / words : 0;
+}
+
+
+static unsigned int wear_remaining(const nvm_wear_t *w)
+{
+    uint32_t cycles = wear_cycles(w);
+    if (cycles >= EEPROM_ENDURANCE) return 0;
+    return 100 - (uint64_t)cycles * 100 / EEPROM_ENDURANCE;
+}
+
+
+// EEPROM wear accounting
+//
+// AT$NVMWEAR <index> returns <label>,<size>,<words>,<cycles>,<remaining> for
+// the NVM part with the given index, where <words> is the number of EEPROM
+// words programmed in the part so far, <cycles> is the resulting average
+// number of program cycles per word, and <remaining> is the estimated
+// remaining endurance in percent. AT$NVMWEAR? returns <label>:<remaining> for
+// all parts. The estimate assumes writes spread evenly over the part.
+static void nvmwear(atci_param_t *param)
+{
+    uint32_t index;
+    nvm_wear_t w;
+
+    if (param == NULL) abort(ERR_PARAM_NO);
+    if (!atci_param_get_uint(param, &index)) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    if (!nvm_get_wear(index, &w)) abort(ERR_PARAM);
+
+    OK("%s,%lu,%lu,%lu,%u", w.label, w.size, w.words, wear_cycles(&w),
+        wear_remaining(&w));
+}
+
+
+static void get_nvmwear(void)
+{
+    nvm_wear_t w;
+
+    atci_print("+OK=");
+    for (unsigned int i = 0; nvm_get_wear(i, &w); i++)
+        atci_printf(i ? ",%s:%u" : "%s:%u", w.label, wear_remaining(&w));
+    EOL();
+}
+
+
 static void lock_keys(atci_param_t *param)
 {
     (void)param;
@@ -2212,6 +2856,7 @@ static const atci_command_t cmds[] = {
     {"$VER",         NULL,         NULL,             get_version,      NULL, "Firmware version and build time"},
 #if defined(DEBUG)
     {"$DBG",         dbg,          NULL,             NULL,             NULL, ""},
+    {"$EEFAULT",     NULL,         set_eefault,      get_eefault,      NULL, ""},
 #endif
     {"$HALT",        do_halt,      NULL,             NULL,             NULL, "Halt the modem"},
     {"$JOINEUI",     NULL,         set_joineui,      get_joineui,      NULL, "Configure JoinEUI"},
@@ -2232,7 +2877,25 @@ static const atci_command_t cmds[] = {
     {"$CW",          cw,           NULL,             NULL,             NULL, "Start continuous carrier wave transmission"},
     {"$CM",          cm,           NULL,             NULL,             NULL, "Start continuous modulated FSK transmission"},
     {"$NVM",         nvm_userdata, NULL,             NULL,             NULL, "Manage data in NVM user registers"},
+    {"$KV",          kv_value,     NULL,             get_kv,           NULL, "Get or set a value in the NVM key-value store"},
+    {"$KVDEL",       kv_del,       NULL,             NULL,             NULL, "Delete a value from the NVM key-value store"},
     {"$LOCKKEYS",    lock_keys,    NULL,             NULL,             NULL, "Prevent read access to security keys from ATCI"},
+    {"$NBTRANS",     NULL,         set_nbtrans,      get_nbtrans,      NULL, "Adapt number of uplink transmissions to link quality"},
+    {"$DRAIN",       NULL,         set_drain,        get_drain,        NULL, "Send empty uplinks to fetch pending downlinks"},
+    {"$SEGBUF",      segbuf,       set_segbuf,       get_segbuf,       NULL, "Append data to segmented transfer buffer"},
+    {"$SEGTX",       segtx,        NULL,             get_segtx,        NULL, "Send buffer in fragments over multiple uplinks"},
+    {"$RFSTATS",     rfstats,      reset_rfstats,    NULL,             NULL, "Per-channel and per-data rate radio statistics"},
+    {"$FASTWAKE",    NULL,         set_fast_wake,    get_fast_wake,    NULL, "Run from HSI16 after Stop until CPU-heavy work is pending"},
+    {"$CLKSCALE",    NULL,         set_clkscale,     get_clkscale,     NULL, "Clock scaling policy while Stop mode is prevented"},
+    {"$POWER",       power,        reset_power,      get_power,        NULL, "Time spent in power modes and held by Sleep/Stop locks"},
+    {"$DRIFT",       NULL,         NULL,             get_drift,        NULL, "Last temperature sample and estimated LSE drift"},
+    {"$TASKS",       NULL,         reset_tasks,      get_tasks,        NULL, "Main loop task run counts and maximum run times"},
+#if IRQ_PROFILE != 0
+    {"$IRQPROF",     NULL,         reset_irqprof,    get_irqprof,      NULL, "Call sites with the longest interrupt-masked sections"},
+#endif
+    {"$RXLOG",       rxlog,        reset_rxlog,      get_rxlog,        NULL, "Scheduled and actual start of recent RX windows"},
+    {"$NVMSTATS",    NULL,         reset_nvmstats,   get_nvmstats,     NULL, "NVM commit scheduler statistics"},
+    {"$NVMWEAR",     nvmwear,      NULL,             get_nvmwear,      NULL, "EEPROM wear and estimated endurance per NVM part"},
 #if MKR1310 == 1
     {"$DISUART", disable_uart, NULL, NULL, NULL, "Disable UART"},
 #endif    
@@ -8,6 +8,7 @@ enum cmd_event {
     CMD_EVENT_MODULE  = 0,
     CMD_EVENT_JOIN    = 1,
     CMD_EVENT_NETWORK = 2,
+    CMD_EVENT_SEGMENT = 3,
     CMD_EVENT_CERT    = 9
 };
 
@@ -33,6 +34,12 @@ enum cmd_event_net {
 };
 
 
+enum cmd_event_segment {
+    CMD_SEGMENT_FAILED = 0,
+    CMD_SEGMENT_DONE   = 1
+};
+
+
 enum cmd_event_cert {
     CMD_CERT_CW_ENDED = 0,
     CMD_CERT_CM_ENDED = 1
@@ -1,5 +1,6 @@
 #include "usart.h"
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_usart.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_rcc.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include "cbuf.h"
 #include "irq.h"
@@ -15,12 +16,14 @@
 #  define PORT       USART1
 #  define IRQn       USART1_IRQn
 #  define CLK_ENABLE __USART1_CLK_ENABLE
+#  define CLK_SOURCE LL_RCC_USART1_CLKSOURCE_HSI
 #  define PIN        GPIO_PIN_9
 #  define ALTERNATE  GPIO_AF4_USART1
 #elif DEBUG_PORT == 2
 #  define PORT       USART2
 #  define IRQn       USART2_IRQn
 #  define CLK_ENABLE __USART2_CLK_ENABLE
+#  define CLK_SOURCE LL_RCC_USART2_CLKSOURCE_HSI
 #  define PIN        GPIO_PIN_2
 #  define ALTERNATE  GPIO_AF4_USART2
 #else
@@ -44,6 +47,10 @@ void usart_init(void)
 
     CLK_ENABLE();
 
+    // Clock the port from HSI16 so that the baud rate does not change when the
+    // system clock runs from HSI16 after a fast wake-up (see system_idle)
+    LL_RCC_SetUSARTClockSource(CLK_SOURCE);
+
     LL_USART_InitTypeDef params = {
         .BaudRate            = 115200,
         .DataWidth           = LL_USART_DATAWIDTH_8B,
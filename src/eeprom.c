@@ -2,16 +2,90 @@
 #include <string.h>
 #include <LoRaWAN/Utilities/timeServer.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal_flash.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include "irq.h"
+#include "system.h"
+#include "sched.h"
 
 #define _EEPROM_BASE DATA_EEPROM_BASE
 #define _EEPROM_END  DATA_EEPROM_BANK2_END
 #define _EEPROM_IS_BUSY() ((FLASH->SR & FLASH_SR_BSY) != 0UL)
 
+// The flash interrupt only starts programming the next word. It runs below the
+// radio DIO and RTC interrupts so that it never delays RX window timing.
+#define _EEPROM_IRQ_PRIORITY 3
+
+#define _EEPROM_SR_ERRORS (FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_SIZERR | \
+    FLASH_SR_OPTVERR | FLASH_SR_RDERR | FLASH_SR_NOTZEROERR | FLASH_SR_FWWERR)
+
 static bool _eeprom_is_busy(TimerTime_t timeout);
 static void _eeprom_unlock(void);
 static void _eeprom_lock(void);
+static bool _eeprom_program(uint32_t address, size_t *i, uint8_t *buffer, size_t length);
 static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t length);
+static void _eeprom_async_next(void);
+static void _eeprom_async_complete(void);
+static bool _eeprom_async_wait(void);
+
+#ifdef DEBUG
+static volatile int32_t _fault_after = -1;
+static volatile uint32_t _programmed;
+
+// Returns true if the word must not be programmed because a power loss is
+// being simulated. Otherwise counts the word as programmed.
+static bool _eeprom_faulted(void)
+{
+    if (_fault_after == 0)
+    {
+        return true;
+    }
+
+    if (_fault_after > 0)
+    {
+        _fault_after--;
+    }
+
+    _programmed++;
+    return false;
+}
+
+void eeprom_inject_fault(int32_t words)
+{
+    _fault_after = words;
+}
+
+int32_t eeprom_get_fault(void)
+{
+    return _fault_after;
+}
+
+uint32_t eeprom_get_programmed(void)
+{
+    return _programmed;
+}
+#else
+#define _eeprom_faulted() false
+#endif
+
+typedef enum
+{
+    _ASYNC_IDLE,         // No asynchronous write in progress
+    _ASYNC_PROGRAMMING,  // The flash interrupt is programming words
+    _ASYNC_PROGRAMMED,   // All words programmed, waiting for eeprom_process
+    _ASYNC_COMPLETING    // Verifying the data and invoking the callback
+} _async_state_t;
+
+static struct
+{
+    volatile _async_state_t state;
+    uint32_t address;
+    uint8_t *buffer;
+    size_t length;
+    size_t i;
+    eeprom_callback_t callback;
+} _async;
+
+static volatile eeprom_counter_t _counter;
 
 bool eeprom_write(uint32_t address, const void *buffer, size_t length)
 {
@@ -25,6 +99,12 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
         return false;
     }
 
+    // Let any asynchronous write in progress finish first
+    if (!_eeprom_async_wait())
+    {
+        return false;
+    }
+
     if (_eeprom_is_busy(50))
     {
         return false;
@@ -52,6 +132,87 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
     return true;
 }
 
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length, eeprom_callback_t callback)
+{
+    address += _EEPROM_BASE;
+
+    if ((address + length) > (_EEPROM_END + 1))
+    {
+        return false;
+    }
+
+    uint32_t masked = disable_irq();
+
+    if (_async.state != _ASYNC_IDLE || _EEPROM_IS_BUSY())
+    {
+        reenable_irq(masked);
+        return false;
+    }
+
+    _async.state = _ASYNC_PROGRAMMING;
+    _async.address = address;
+    _async.buffer = (uint8_t *) buffer;
+    _async.length = length;
+    _async.i = 0;
+    _async.callback = callback;
+
+    // Keep the MCU out of Stop mode until the write has completed. The
+    // low-power sleep mode is fine, the end of programming interrupt wakes the
+    // MCU up.
+    system_stop_lock |= SYSTEM_MODULE_NVM;
+
+    _eeprom_unlock();
+    FLASH->SR = FLASH_SR_EOP | _EEPROM_SR_ERRORS;
+    FLASH->PECR |= FLASH_PECR_EOPIE | FLASH_PECR_ERRIE;
+
+    HAL_NVIC_SetPriority(FLASH_IRQn, _EEPROM_IRQ_PRIORITY, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+    _eeprom_async_next();
+
+    reenable_irq(masked);
+    return true;
+}
+
+bool eeprom_is_writing(void)
+{
+    return _async.state != _ASYNC_IDLE;
+}
+
+void eeprom_process(void)
+{
+    if (_async.state == _ASYNC_PROGRAMMED)
+    {
+        _eeprom_async_complete();
+    }
+}
+
+void FLASH_IRQHandler(void)
+{
+    uint32_t sr = FLASH->SR;
+
+    FLASH->SR = FLASH_SR_EOP | (sr & _EEPROM_SR_ERRORS);
+
+    if (_async.state != _ASYNC_PROGRAMMING)
+    {
+        return;
+    }
+
+    if (sr & _EEPROM_SR_ERRORS)
+    {
+        // Abort the write. The verification in _eeprom_async_complete will
+        // report the failure to the callback.
+        _async.i = _async.length;
+    }
+
+    _eeprom_async_next();
+}
+
+void eeprom_set_counter(eeprom_counter_t counter)
+{
+    _counter = counter;
+}
+
 const void *eeprom_mmap(uint32_t address, size_t length)
 {
     // Add EEPROM base offset to address
@@ -129,7 +290,114 @@ static void _eeprom_lock(void)
     reenable_irq(masked);
 }
 
+// Must be invoked with interrupts disabled or from the flash interrupt handler.
+// Starts programming the next word that differs from the buffer and returns.
+// Once all the words have been programmed, hands the rest of the write over to
+// eeprom_process in the main loop.
+static void _eeprom_async_next(void)
+{
+    while (_async.i < _async.length)
+    {
+        if (_eeprom_program(_async.address, &_async.i, _async.buffer, _async.length))
+        {
+            return;
+        }
+    }
+
+    FLASH->PECR &= ~(FLASH_PECR_EOPIE | FLASH_PECR_ERRIE);
+    _eeprom_lock();
+
+    _async.state = _ASYNC_PROGRAMMED;
+    sched_post(SCHED_EVENT_NVM);
+}
+
+// Verifies the data written asynchronously and invokes the callback. Runs from
+// the main loop, or from eeprom_write if it has to wait for the write.
+static void _eeprom_async_complete(void)
+{
+    uint32_t masked = disable_irq();
+
+    if (_async.state != _ASYNC_PROGRAMMED)
+    {
+        reenable_irq(masked);
+        return;
+    }
+
+    _async.state = _ASYNC_COMPLETING;
+    reenable_irq(masked);
+
+    bool ok = memcmp(_async.buffer, (void *) _async.address, _async.length) == 0;
+    eeprom_callback_t callback = _async.callback;
+
+    _async.state = _ASYNC_IDLE;
+    system_stop_lock &= ~SYSTEM_MODULE_NVM;
+
+    // Make sure the subsystems waiting for the write to complete get a chance
+    // to run.
+    system_sleep_lock |= SYSTEM_MODULE_NVM;
+    sched_post(SCHED_EVENT_NVM);
+
+    if (callback != NULL)
+    {
+        callback(ok);
+    }
+}
+
+// Waits for an asynchronous write in progress, including any write started by
+// its callback. The flash interrupt cannot run with interrupts masked or from
+// within another handler, so the remaining words are programmed here in that
+// case. Returns false if the write cannot complete because this function
+// interrupted its completion in the main loop.
+static bool _eeprom_async_wait(void)
+{
+    bool poll = __get_PRIMASK() || __get_IPSR();
+
+    while (_async.state != _ASYNC_IDLE)
+    {
+        switch (_async.state)
+        {
+            case _ASYNC_PROGRAMMING:
+                if (poll && !_EEPROM_IS_BUSY())
+                {
+                    uint32_t masked = disable_irq();
+                    FLASH_IRQHandler();
+                    HAL_NVIC_ClearPendingIRQ(FLASH_IRQn);
+                    reenable_irq(masked);
+                }
+                break;
+
+            case _ASYNC_PROGRAMMED:
+                _eeprom_async_complete();
+                break;
+
+            case _ASYNC_COMPLETING:
+                if (__get_IPSR())
+                {
+                    return false;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return true;
+}
+
 static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t length)
+{
+    bool write = _eeprom_program(address, i, buffer, length);
+
+    while (_EEPROM_IS_BUSY())
+    {
+        continue;
+    }
+
+    return write;
+}
+
+static bool _eeprom_program(uint32_t address, size_t *i, uint8_t *buffer, size_t length)
 {
     uint32_t addr = address + *i;
 
@@ -157,7 +425,7 @@ static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t l
     {
         uint32_t value = ((uint32_t) buffer[*i + 3]) << 24 | ((uint32_t) buffer[*i + 2]) << 16 | ((uint32_t) buffer[*i + 1]) << 8 | buffer[*i];
 
-        if (*((uint32_t *) addr) != value)
+        if (*((uint32_t *) addr) != value && !_eeprom_faulted())
         {
             *((uint32_t *) addr) = value;
 
@@ -170,7 +438,7 @@ static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t l
     {
         uint16_t value = ((uint16_t) buffer[*i + 1]) << 8 | (uint16_t) buffer[*i];
 
-        if (*((uint16_t *) addr) != value)
+        if (*((uint16_t *) addr) != value && !_eeprom_faulted())
         {
             *((uint16_t *) addr) = value;
 
@@ -183,7 +451,7 @@ static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t l
     {
         uint8_t value = buffer[*i];
 
-        if (*((uint8_t *) addr) != value)
+        if (*((uint8_t *) addr) != value && !_eeprom_faulted())
         {
             *((uint8_t *) addr) = value;
 
@@ -193,9 +461,9 @@ static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t l
         *i += 1;
     }
 
-    while (_EEPROM_IS_BUSY())
+    if (write && _counter != NULL)
     {
-        continue;
+        _counter(addr - _EEPROM_BASE);
     }
 
     return write;
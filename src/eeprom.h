@@ -5,7 +5,21 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// The number of program/erase cycles each data EEPROM word is guaranteed to
+// endure (STM32L072 datasheet, up to 85 °C)
+#define EEPROM_ENDURANCE 100000
+
 //! @brief Write buffer to EEPROM area and verify it
+//!
+//! Waits for an asynchronous write in progress to complete first and invokes
+//! its callback if eeprom_process has not done so yet. When invoked with
+//! interrupts masked or from an interrupt handler, the flash interrupt cannot
+//! make progress, so the remaining words of that write are programmed
+//! synchronously instead. Keep such calls rare: each word takes about 3 ms to
+//! program and interrupts stay masked meanwhile. Fails if invoked from an
+//! interrupt handler that interrupted eeprom_process while it was completing
+//! the write.
+//!
 //! @param[in] address EEPROM start address (starts at 0)
 //! @param[in] buffer Pointer to source buffer
 //! @param[in] length Number of bytes to be written
@@ -14,6 +28,43 @@
 
 bool eeprom_write(uint32_t address, const void *buffer, size_t length);
 
+//! @brief Callback invoked upon completion of an asynchronous write
+//! @param[in] ok true if the data has been written and verified
+
+typedef void (*eeprom_callback_t)(bool ok);
+
+//! @brief Write buffer to EEPROM area in the background
+//!
+//! Words are programmed one by one from the flash end of programming
+//! interrupt, so the main loop keeps running while the EEPROM is being
+//! written. Words that already hold the right value are skipped. Stop mode is
+//! prevented until the write completes. Once all words have been programmed,
+//! SCHED_EVENT_NVM is posted and eeprom_process verifies the data and invokes
+//! the callback from the main loop. The buffer must remain valid until then. The data is verified against the buffer as
+//! it is at the end of the write, so a word that changes after it has been
+//! programmed fails the verification, while a word that changes before it
+//! has been programmed is written with its new value.
+//!
+//! @param[in] address EEPROM start address (starts at 0)
+//! @param[in] buffer Pointer to source buffer
+//! @param[in] length Number of bytes to be written
+//! @param[in] callback Completion callback (may be NULL)
+//! @return true If the write has been started
+//! @return false If another write is in progress or on invalid arguments
+
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length, eeprom_callback_t callback);
+
+//! @brief Return true while an asynchronous write is in progress
+
+bool eeprom_is_writing(void);
+
+//! @brief Complete an asynchronous write whose words have all been programmed
+//!
+//! Invoked from the main loop on SCHED_EVENT_NVM. Keeps the verification and
+//! the callback out of the flash interrupt handler.
+
+void eeprom_process(void);
+
 //! @brief Read buffer from EEPROM area
 //! @param[in] address EEPROM start address (starts at 0)
 //! @param[out] buffer Pointer to destination buffer
@@ -38,4 +89,45 @@ const void *eeprom_mmap(uint32_t address, size_t length);
 
 size_t eeprom_get_size(void);
 
+//! @brief Callback invoked for each EEPROM word that is being programmed
+//! @param[in] address EEPROM address of the word (starts at 0)
+
+typedef void (*eeprom_counter_t)(uint32_t address);
+
+//! @brief Register a callback for EEPROM wear accounting
+//!
+//! The callback is invoked for every word that is actually programmed, i.e.,
+//! words that already hold the right value are not reported. It may be invoked
+//! from the flash interrupt handler.
+//!
+//! @param[in] counter The callback, NULL to disable
+
+void eeprom_set_counter(eeprom_counter_t counter);
+
+#ifdef DEBUG
+
+//! @brief Simulate a power loss in the middle of EEPROM programming
+//!
+//! Once the given number of words has been programmed, all further programming
+//! operations are silently dropped, as if the device lost power. Writes then
+//! fail verification. Reset the device to observe how NVM data recovers.
+//!
+//! @param[in] words Number of words to program before the power loss, a
+//!                  negative value disables the fault
+
+void eeprom_inject_fault(int32_t words);
+
+//! @brief Return the number of words left before the simulated power loss
+//! @return Number of words, a negative value if no fault has been injected
+
+int32_t eeprom_get_fault(void);
+
+//! @brief Return the number of words programmed since reset
+//!
+//! Words skipped because they already held the right value are not counted.
+
+uint32_t eeprom_get_programmed(void);
+
+#endif
+
 #endif // _EEPROM_H
@@ -0,0 +1,116 @@
+#include "irq.h"
+
+#if IRQ_PROFILE != 0
+
+#include <stdbool.h>
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include "system.h"
+
+// The begin/end functions are always invoked with interrupts masked. The
+// functions invoked from the main loop mask interrupts with the CMSIS
+// intrinsics directly, since disable_irq would recurse into the profiler.
+
+static struct {
+    const char *file;
+    unsigned int line;
+    uint32_t start;
+    bool open;
+} section;
+
+static irq_profile_site_t site[IRQ_PROFILE_SITES];
+
+
+void irq_profile_begin(const char *file, unsigned int line)
+{
+    section.file = file;
+    section.line = line;
+    section.start = system_cycles();
+    section.open = true;
+}
+
+
+void irq_profile_restart(void)
+{
+    if (section.open) section.start = system_cycles();
+}
+
+
+// The section is converted to microseconds with the clock frequency at its end.
+// SysTick stops in Stop mode and the counter wraps after 2^24 cycles, i.e.,
+// sections longer than about half a second at 32 MHz are not measured
+// correctly. Sections that long would break the radio timing anyway.
+void irq_profile_end(void)
+{
+    if (!section.open) return;
+    section.open = false;
+
+    uint32_t cycles = (system_cycles() - section.start) & SysTick_LOAD_RELOAD_Msk;
+    uint32_t us = cycles / (SystemCoreClock / 1000000);
+
+    // Sites are added in order and only removed all at once, so the first
+    // free slot ends the search. If the table is full, the new site replaces
+    // the one with the shortest section, unless it is shorter still.
+    unsigned int i, victim = 0;
+    for (i = 0; i < IRQ_PROFILE_SITES; i++) {
+        if (site[i].file == NULL) break;
+        if (site[i].file == section.file && site[i].line == section.line) break;
+        if (site[i].max_us < site[victim].max_us) victim = i;
+    }
+
+    if (i == IRQ_PROFILE_SITES) {
+        if (us <= site[victim].max_us) return;
+        i = victim;
+        site[i].file = NULL;
+    }
+
+    irq_profile_site_t *s = &site[i];
+    if (s->file == NULL) {
+        s->file = section.file;
+        s->line = section.line;
+        s->count = 0;
+        s->max_us = 0;
+    }
+
+    s->count++;
+    if (us > s->max_us) s->max_us = us;
+}
+
+
+unsigned int irq_profile_get(irq_profile_site_t *sites, unsigned int max)
+{
+    irq_profile_site_t copy[IRQ_PROFILE_SITES];
+    unsigned int n = 0;
+
+    uint32_t mask = __get_PRIMASK();
+    __disable_irq();
+    memcpy(copy, site, sizeof(copy));
+    __set_PRIMASK(mask);
+
+    // Insertion sort by max_us in descending order
+    for (unsigned int i = 0; i < IRQ_PROFILE_SITES && copy[i].file != NULL; i++) {
+        irq_profile_site_t tmp = copy[i];
+        unsigned int j = i;
+        while (j > 0 && copy[j - 1].max_us < tmp.max_us) {
+            copy[j] = copy[j - 1];
+            j--;
+        }
+        copy[j] = tmp;
+        n++;
+    }
+
+    if (n > max) n = max;
+    memcpy(sites, copy, n * sizeof(copy[0]));
+    return n;
+}
+
+
+void irq_profile_reset(void)
+{
+    uint32_t mask = __get_PRIMASK();
+    __disable_irq();
+    memset(site, 0, sizeof(site));
+    __set_PRIMASK(mask);
+}
+
+#endif // IRQ_PROFILE
@@ -1,8 +1,86 @@
 #ifndef __IRQ_H__
 #define __IRQ_H__
 
+#include <stdint.h>
 #include <stm/include/cmsis_compiler.h>
 
+// When the firmware is built with IRQ_PROFILE=1, the functions below measure
+// how long interrupts stay masked. Only the outermost section is measured, from
+// the disable_irq call that masked interrupts to the reenable_irq or enable_irq
+// call that unmasked them. The longest sections are kept per call site (the
+// location of the disable_irq call), see irq_profile_get.
+
+#ifndef IRQ_PROFILE
+#define IRQ_PROFILE 0
+#endif
+
+#define IRQ_PROFILE_SITES 16
+
+typedef struct irq_profile_site
+{
+    const char *file;  // Source file of the disable_irq call
+    uint16_t line;     // Line number of the disable_irq call
+    uint32_t count;    // Number of sections measured
+    uint32_t max_us;   // Longest section in microseconds
+} irq_profile_site_t;
+
+
+#if IRQ_PROFILE != 0
+
+void irq_profile_begin(const char *file, unsigned int line);
+void irq_profile_end(void);
+
+//! @brief Restart the measurement of the current section
+//!
+//! Invoked after waking up from a low-power mode entered with interrupts
+//! masked and after the system clock has been restored. Neither the time spent
+//! sleeping nor the clock restore, during which SysTick runs at a different
+//! frequency than the one the section is converted with, is counted.
+
+void irq_profile_restart(void);
+
+//! @brief Copy the call sites with the longest sections
+//! @param[out] sites Destination buffer, sorted by max_us in descending order
+//! @param[in] max Maximum number of entries to copy
+//! @return Number of entries copied
+
+unsigned int irq_profile_get(irq_profile_site_t *sites, unsigned int max);
+
+//! @brief Forget all call sites
+
+void irq_profile_reset(void);
+
+
+#define disable_irq() irq_profile_disable(__FILE__, __LINE__)
+
+__STATIC_FORCEINLINE uint32_t irq_profile_disable(const char *file, unsigned int line)
+{
+    uint32_t mask = __get_PRIMASK();
+    __disable_irq();
+    if (!mask) irq_profile_begin(file, line);
+    return mask;
+}
+
+
+__STATIC_FORCEINLINE void reenable_irq(uint32_t mask)
+{
+    if (!mask) irq_profile_end();
+    __set_PRIMASK(mask);
+}
+
+
+__STATIC_FORCEINLINE void enable_irq(void)
+{
+    if (__get_PRIMASK()) irq_profile_end();
+    __enable_irq();
+}
+
+#else
+
+__STATIC_FORCEINLINE void irq_profile_restart(void)
+{
+}
+
 
 __STATIC_FORCEINLINE uint32_t disable_irq(void)
 {
@@ -23,5 +101,7 @@ __STATIC_FORCEINLINE void enable_irq(void)
     __enable_irq();
 }
 
+#endif // IRQ_PROFILE
+
 
-#endif // __IRQ_H__
\ No newline at end of file
+#endif // __IRQ_H__
@@ -0,0 +1,129 @@
+#include "journal.h"
+#include <string.h>
+#include <LoRaWAN/Utilities/utilities.h>
+#include "log.h"
+#include "nvm.h"
+#include "part.h"
+#include "utils.h"
+
+// Each record carries the uplink frame counter, which doubles as the record
+// sequence number since it only ever grows within a session, and a CRC32
+// calculated over the counter and the checksum of the Crypto checkpoint the
+// record belongs to. Writing a new checkpoint thus implicitly invalidates all
+// older records without having to erase the journal.
+typedef struct record {
+    uint32_t fcnt_up;
+    uint32_t crc32;
+} record_t;
+
+
+static struct {
+    uint32_t base;      // Crc32 of the Crypto checkpoint in NVM
+    unsigned int next;  // Index of the slot to be written next
+    unsigned int used;  // Number of records written since the checkpoint
+} journal;
+
+
+static unsigned int slots(void)
+{
+    if (nvm_parts.fcnt.dsc == NULL) return 0;
+    return nvm_parts.fcnt.dsc->size / sizeof(record_t);
+}
+
+
+static uint32_t record_crc(uint32_t fcnt_up, uint32_t base)
+{
+    uint32_t buf[2] = { fcnt_up, base };
+    return Crc32((uint8_t *)buf, sizeof(buf));
+}
+
+
+static const LoRaMacCryptoNvmData_t *checkpoint(void)
+{
+    size_t size;
+    const LoRaMacCryptoNvmData_t *p = part_mirror_mmap(&size, &nvm_parts.crypto);
+    if (p == NULL || size < sizeof(*p)) return NULL;
+    return p;
+}
+
+
+void journal_restore(LoRaMacCryptoNvmData_t *crypto)
+{
+    size_t size;
+    uint32_t newest;
+    int found = -1;
+
+    memset(&journal, 0, sizeof(journal));
+    if (slots() == 0) return;
+
+    // Records can only be applied on top of a valid checkpoint
+    if (!check_block_crc(crypto, sizeof(*crypto))) return;
+    journal.base = crypto->Crc32;
+
+    const record_t *r = part_mmap(&size, &nvm_parts.fcnt);
+    if (r == NULL) return;
+
+    newest = crypto->FCntList.FCntUp;
+    for (unsigned int i = 0; i < slots(); i++) {
+        if (r[i].crc32 != record_crc(r[i].fcnt_up, journal.base)) continue;
+        journal.used++;
+        if (r[i].fcnt_up > newest) {
+            newest = r[i].fcnt_up;
+            found = i;
+        }
+    }
+
+    if (found < 0) return;
+    journal.next = (found + 1) % slots();
+
+    log_debug("journal: Restoring FCntUp %ld (checkpoint %ld)", newest,
+        crypto->FCntList.FCntUp);
+    crypto->FCntList.FCntUp = newest;
+    update_block_crc(crypto, sizeof(*crypto));
+}
+
+
+bool journal_append(const LoRaMacCryptoNvmData_t *crypto)
+{
+    LoRaMacCryptoNvmData_t tmp;
+    record_t rec;
+
+    if (slots() == 0) return false;
+
+    const LoRaMacCryptoNvmData_t *cp = checkpoint();
+    if (cp == NULL || !check_block_crc(cp, sizeof(*cp))) return false;
+
+    // The checkpoint has been rewritten by someone else, e.g., factory reset.
+    if (cp->Crc32 != journal.base) {
+        journal.base = cp->Crc32;
+        journal.used = 0;
+    }
+
+    if (journal.used >= slots()) return false;
+
+    // The journal can only be used if nothing but the uplink frame counter
+    // changed since the checkpoint.
+    memcpy(&tmp, crypto, sizeof(tmp));
+    tmp.FCntList.FCntUp = cp->FCntList.FCntUp;
+    tmp.Crc32 = cp->Crc32;
+    if (memcmp(&tmp, cp, sizeof(tmp))) return false;
+
+    if (crypto->FCntList.FCntUp <= cp->FCntList.FCntUp) return false;
+
+    rec.fcnt_up = crypto->FCntList.FCntUp;
+    rec.crc32 = record_crc(rec.fcnt_up, journal.base);
+
+    if (!part_write(&nvm_parts.fcnt, journal.next * sizeof(rec), &rec, sizeof(rec)))
+        return false;
+
+    journal.next = (journal.next + 1) % slots();
+    journal.used++;
+    return true;
+}
+
+
+void journal_checkpoint(const LoRaMacCryptoNvmData_t *crypto)
+{
+    journal.base = crypto->Crc32;
+    journal.used = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdbool.h>
+#include <loramac-node/src/mac/LoRaMac.h>
+
+// The uplink frame counter changes with every uplink. Instead of rewriting the
+// Crypto partition each time, which would wear out the same EEPROM words
+// within weeks on a device that transmits frequently, the counter is appended
+// to a small ring journal in a dedicated partition. The Crypto partition only
+// serves as a checkpoint and is rewritten once the journal fills up or when
+// anything else in the Crypto state changes.
+
+//! @brief Apply the newest journaled frame counter to restored Crypto state
+//!
+//! Invoke on boot after the Crypto state has been read from its partition. If
+//! the journal contains a newer uplink frame counter for the checkpoint, the
+//! counter is copied into @p crypto and the checksum is updated.
+
+void journal_restore(LoRaMacCryptoNvmData_t *crypto);
+
+//! @brief Try to persist Crypto state by appending to the journal
+//!
+//! This only succeeds if the uplink frame counter is the only value that
+//! differs from the checkpoint and if there is a free slot in the journal.
+//!
+//! @retval true The state has been persisted in the journal
+//! @retval false The caller must write the full Crypto state to its partition
+//!               and then invoke journal_checkpoint
+
+bool journal_append(const LoRaMacCryptoNvmData_t *crypto);
+
+//! @brief Start a new journal epoch after a full Crypto state write
+
+void journal_checkpoint(const LoRaMacCryptoNvmData_t *crypto);
+
+#endif // _JOURNAL_H
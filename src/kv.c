@@ -0,0 +1,347 @@
+#include "kv.h"
+#include <assert.h>
+#include <string.h>
+#include <LoRaWAN/Utilities/utilities.h>
+#include "log.h"
+#include "nvm.h"
+#include "part.h"
+
+// The partition is split into two segments of equal size. Each segment starts
+// with a header carrying a sequence number and its checksum, followed by
+// byte-packed records. The valid segment with the newer sequence number
+// (compared modulo 2^32) is active and new records are appended to it. Once it fills up, the live records
+// are copied into the other segment, the rest of that segment is erased, and
+// only then is its header with the incremented sequence number written. A
+// power loss during compaction thus leaves the active segment intact.
+typedef struct segment_header {
+    uint32_t seq;
+    uint32_t crc32;
+} segment_header_t;
+
+static_assert(KV_CAPACITY(100) == 48 - sizeof(segment_header_t), "KV_CAPACITY does not match the segment layout");
+
+// Each record consists of a four-byte header (key, length, and a 16-bit
+// checksum in little endian) followed by the value. A record with zero length
+// marks the key as deleted. The checksum is the lower half of the CRC32 over
+// the key, the length, and the value. The first record that is erased or fails
+// the checksum, e.g., because it has been torn by a power loss, marks the end
+// of the segment. The next append simply overwrites it.
+#define REC_HDR KV_RECORD_SIZE(0)
+#define REC_KEY 0
+#define REC_LEN 1
+#define REC_CRC 2
+
+#define ERASED 0xff
+
+// An erased header passes the checksum test since the CRC32 of four 0xff bytes
+// is 0xffffffff. The all-ones sequence number is therefore never written and a
+// header carrying it is considered invalid.
+#define ERASED_SEQ 0xffffffff
+
+
+static struct {
+    size_t size;          // Size of a segment, zero if the store is unavailable
+    unsigned int active;  // Index of the active segment
+    uint32_t seq;         // Sequence number of the active segment
+    size_t end;           // Offset of the first free byte in the active segment
+} kv;
+
+
+static uint16_t record_crc(uint8_t key, uint8_t len, const uint8_t *value)
+{
+    uint8_t hdr[2] = { key, len };
+    uint32_t s = Crc32Update(Crc32Init(), hdr, sizeof(hdr));
+    if (len) s = Crc32Update(s, (uint8_t *)value, len);
+    return Crc32Finalize(s) & 0xffff;
+}
+
+
+static size_t segment_size(size_t part_size)
+{
+    return part_size / 2 & ~(PART_ALIGNMENT - 1);
+}
+
+
+static const uint8_t *segment(unsigned int i)
+{
+    size_t size;
+    const uint8_t *p = part_mmap(&size, &nvm_parts.kv);
+    if (p == NULL) return NULL;
+    return p + i * kv.size;
+}
+
+
+static bool header_valid(const segment_header_t *h)
+{
+    if (h->seq == ERASED_SEQ) return false;
+    return h->crc32 == Crc32((uint8_t *)&h->seq, sizeof(h->seq));
+}
+
+
+static bool header_erased(const segment_header_t *h)
+{
+    return h->seq == ERASED_SEQ && h->crc32 == 0xffffffff;
+}
+
+
+static uint32_t next_seq(uint32_t seq)
+{
+    return ++seq == ERASED_SEQ ? 0 : seq;
+}
+
+
+// Return the length of the record at offset off in the segment seg, or zero if
+// there is no valid record at the offset
+static size_t record_size(const uint8_t *seg, size_t off)
+{
+    const uint8_t *r = seg + off;
+
+    if (off + REC_HDR > kv.size) return 0;
+    if (r[REC_KEY] == ERASED) return 0;
+    if (off + REC_HDR + r[REC_LEN] > kv.size) return 0;
+
+    uint16_t crc = r[REC_CRC] | (r[REC_CRC + 1] << 8);
+    if (crc != record_crc(r[REC_KEY], r[REC_LEN], r + REC_HDR)) return 0;
+    return REC_HDR + r[REC_LEN];
+}
+
+
+static size_t scan(const uint8_t *seg)
+{
+    size_t off = sizeof(segment_header_t), n;
+    while ((n = record_size(seg, off)) != 0) off += n;
+    return off;
+}
+
+
+// Find the newest record for the key in the active segment. Deletion records
+// are returned too.
+static const uint8_t *lookup(uint8_t key)
+{
+    const uint8_t *seg, *found = NULL;
+
+    if (kv.size == 0 || (seg = segment(kv.active)) == NULL) return NULL;
+
+    for (size_t off = sizeof(segment_header_t); off < kv.end; off += REC_HDR + seg[off + REC_LEN]) {
+        if (seg[off + REC_KEY] == key) found = seg + off;
+    }
+    return found;
+}
+
+
+// Erase everything in segment i from the offset start on. Only the words that
+// are not erased yet are written.
+static bool erase_segment(unsigned int i, size_t start)
+{
+    uint8_t buf[16];
+    uint32_t base = i * kv.size;
+
+    memset(buf, ERASED, sizeof(buf));
+    for (size_t off = start, n; off < kv.size; off += n) {
+        n = kv.size - off < sizeof(buf) ? kv.size - off : sizeof(buf);
+        if (!part_sync(&nvm_parts.kv, base + off, buf, n)) return false;
+    }
+    return true;
+}
+
+
+// Erase everything in segment i past the offset end and then write its header.
+static bool commit_segment(unsigned int i, size_t end, uint32_t seq)
+{
+    segment_header_t h;
+    uint32_t base = i * kv.size;
+
+    if (!erase_segment(i, end)) return false;
+
+    h.seq = seq;
+    h.crc32 = Crc32((uint8_t *)&h.seq, sizeof(h.seq));
+    return part_write(&nvm_parts.kv, base, &h, sizeof(h));
+}
+
+
+// Copy the newest record of each key that still holds a value, except for the
+// key skip, into the inactive segment and make it the active segment
+static bool compact(int skip)
+{
+    uint8_t buf[REC_HDR + KV_MAX_VALUE];
+    unsigned int dst = kv.active ^ 1;
+    size_t end = sizeof(segment_header_t);
+    const uint8_t *r;
+
+    log_debug("kv: Compacting (%d B used)", kv.end);
+
+    for (int key = kv_next(-1); key >= 0; key = kv_next(key)) {
+        if (key == skip) continue;
+        r = lookup(key);
+        size_t n = REC_HDR + r[REC_LEN];
+        memcpy(buf, r, n);
+        if (!part_sync(&nvm_parts.kv, dst * kv.size + end, buf, n)) return false;
+        end += n;
+    }
+
+    if (!commit_segment(dst, end, next_seq(kv.seq))) return false;
+
+    kv.active = dst;
+    kv.seq = next_seq(kv.seq);
+    kv.end = end;
+    return true;
+}
+
+
+// The number of bytes the active segment would occupy after compaction
+static size_t live_size(int skip)
+{
+    size_t n = sizeof(segment_header_t);
+    for (int key = kv_next(-1); key >= 0; key = kv_next(key)) {
+        if (key != skip) n += REC_HDR + lookup(key)[REC_LEN];
+    }
+    return n;
+}
+
+
+static int append(uint8_t key, const void *value, size_t length)
+{
+    uint8_t buf[REC_HDR + KV_MAX_VALUE];
+    size_t n = REC_HDR + length;
+
+    if (kv.size == 0) return KV_ERR_IO;
+
+    if (kv.end + n > kv.size) {
+        int skip = -1;
+
+        // Compaction normally keeps the current value of the key so that a
+        // power loss before the new record is written leaves the old value in
+        // place. If the store is too full for that, drop the current value
+        // during compaction. Do not wear the EEPROM with a compaction that
+        // would not help at all.
+        if (live_size(-1) + n > kv.size) {
+            if (live_size(key) + n > kv.size) return KV_ERR_SPACE;
+            skip = key;
+        }
+
+        if (!compact(skip)) return KV_ERR_IO;
+        if (skip >= 0 && length == 0) return 0;
+    }
+
+    uint16_t crc = record_crc(key, length, value);
+    buf[REC_KEY] = key;
+    buf[REC_LEN] = length;
+    buf[REC_CRC] = crc & 0xff;
+    buf[REC_CRC + 1] = crc >> 8;
+    if (length) memcpy(buf + REC_HDR, value, length);
+
+    if (!part_write(&nvm_parts.kv, kv.active * kv.size + kv.end, buf, n))
+        return KV_ERR_IO;
+
+    kv.end += n;
+    return 0;
+}
+
+
+void kv_init(void)
+{
+    const segment_header_t *h[2];
+    bool valid[2];
+
+    memset(&kv, 0, sizeof(kv));
+    if (nvm_parts.kv.dsc == NULL) return;
+
+    kv.size = segment_size(nvm_parts.kv.dsc->size);
+    if (kv.size <= sizeof(segment_header_t) + REC_HDR) goto fail;
+
+    for (int i = 0; i < 2; i++) {
+        if ((h[i] = (const segment_header_t *)segment(i)) == NULL) goto fail;
+        valid[i] = header_valid(h[i]);
+    }
+
+    if (!valid[0] && !valid[1]) {
+        // Earlier firmware mistook an erased header for a valid one and
+        // appended records to segment 0 without ever writing its header. Keep
+        // such records, there are none in a partition that is really blank.
+        size_t end = sizeof(segment_header_t);
+        if (header_erased(h[0])) end = scan(segment(0));
+
+        log_debug("kv: Formatting key-value store");
+        if (!commit_segment(0, end, 1)) goto fail;
+        kv.active = 0;
+        kv.seq = 1;
+    } else {
+        kv.active = !valid[0] || (valid[1] && (int32_t)(h[1]->seq - h[0]->seq) > 0);
+        kv.seq = h[kv.active]->seq;
+    }
+
+    kv.end = scan(segment(kv.active));
+    return;
+
+fail:
+    log_error("kv: Could not initialize key-value store");
+    kv.size = 0;
+}
+
+
+int kv_get(uint8_t key, void *buffer, size_t size)
+{
+    const uint8_t *r = lookup(key);
+    if (r == NULL || r[REC_LEN] == 0) return -1;
+
+    memcpy(buffer, r + REC_HDR, size < r[REC_LEN] ? size : r[REC_LEN]);
+    return r[REC_LEN];
+}
+
+
+int kv_set(uint8_t key, const void *value, size_t length)
+{
+    if (key > KV_MAX_KEY || length == 0 || length > KV_MAX_VALUE)
+        return KV_ERR_PARAM;
+
+    const uint8_t *r = lookup(key);
+    if (r && r[REC_LEN] == length && !memcmp(r + REC_HDR, value, length))
+        return 0;
+
+    return append(key, value, length);
+}
+
+
+int kv_delete(uint8_t key)
+{
+    if (key > KV_MAX_KEY) return KV_ERR_PARAM;
+
+    const uint8_t *r = lookup(key);
+    if (r == NULL || r[REC_LEN] == 0) return 0;
+
+    return append(key, NULL, 0);
+}
+
+
+int kv_next(int key)
+{
+    const uint8_t *seg;
+    int next = -1;
+
+    if (kv.size == 0 || (seg = segment(kv.active)) == NULL) return -1;
+
+    for (size_t off = sizeof(segment_header_t); off < kv.end; off += REC_HDR + seg[off + REC_LEN]) {
+        int k = seg[off + REC_KEY];
+        if (k <= key || (next >= 0 && k >= next)) continue;
+        const uint8_t *r = lookup(k);
+        if (r[REC_LEN] != 0) next = k;
+    }
+    return next;
+}
+
+
+size_t kv_free(void)
+{
+    return kv.size ? kv.size - kv.end : 0;
+}
+
+
+bool kv_pack(void)
+{
+    if (kv.size == 0) return false;
+
+    // Compaction into segment 0 leaves segment 1 intact until segment 0 has
+    // become active. Erasing segment 1 starts with its header.
+    if (kv.active == 1 && !compact(-1)) return false;
+    return erase_segment(1, 0);
+}
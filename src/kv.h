@@ -0,0 +1,83 @@
+#ifndef _KV_H
+#define _KV_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A small append-only key-value store kept in the "kv" NVM partition. Values
+// are variable-length byte strings identified by a one-byte key. Each set or
+// delete appends a record protected by its own checksum. The newest record for
+// a key wins. Records superseded by newer ones are only reclaimed once the
+// partition fills up, by copying the live records into the other half of the
+// partition (see kv.c).
+
+#define KV_MAX_KEY   254  // Key 255 is reserved (erased EEPROM)
+#define KV_MAX_VALUE  64  // The maximum length of a single value in bytes
+
+// The number of bytes a record holding a value of the given length occupies
+#define KV_RECORD_SIZE(length) (4 + (length))
+
+// The number of bytes available to records in a store kept in a partition of
+// the given size. Each half of the partition starts with an 8-byte header.
+#define KV_CAPACITY(part_size) ((part_size) / 2 / 4 * 4 - 8)
+
+#define KV_ERR_PARAM  -1  // Invalid key or value length
+#define KV_ERR_SPACE  -2  // Not enough room even after compaction
+#define KV_ERR_IO     -3  // NVM read or write error
+
+//! @brief Load the key-value store from its NVM partition
+//!
+//! Invoke once the NVM partitions have been opened. An uninitialized or
+//! corrupted partition is formatted.
+
+void kv_init(void);
+
+//! @brief Read the value stored under a key
+//!
+//! Up to @p size bytes of the value are copied into @p buffer.
+//!
+//! @return The length of the value, or -1 if the key has no value
+
+int kv_get(uint8_t key, void *buffer, size_t size);
+
+//! @brief Store a value under a key, replacing the previous value
+//!
+//! Nothing is written if the key already holds the same value. The previous
+//! value survives a power loss during the update unless the store is too full
+//! to hold both values at the same time.
+//!
+//! @return Zero on success, a negative KV_ERR_* value on error
+
+int kv_set(uint8_t key, const void *value, size_t length);
+
+//! @brief Remove the value stored under a key
+//!
+//! @return Zero on success (also if the key had no value), a negative KV_ERR_*
+//!         value on error
+
+int kv_delete(uint8_t key);
+
+//! @brief Iterate over the keys that hold a value
+//!
+//! @param[in] key The previous key returned by the function, or -1 to start
+//! @return The smallest key greater than @p key that holds a value, or -1
+
+int kv_next(int key);
+
+//! @brief Return the number of bytes that can still be appended without
+//!        compaction
+
+size_t kv_free(void);
+
+//! @brief Move all records into the first half of the partition
+//!
+//! Changing the size of the partition moves its second half. Invoke before
+//! resizing the partition to make the first half active and erase the second
+//! one, so that the records survive the resize. Safe against power loss.
+//!
+//! @return true on success
+
+bool kv_pack(void);
+
+#endif // _KV_H
@@ -8,6 +8,7 @@
 #include "log.h"
 #include "irq.h"
 #include "system.h"
+#include "sched.h"
 
 
 #ifndef LPUART_BUFFER_SIZE
@@ -56,6 +57,7 @@ static void rx_callback(void)
         if (pos > 0) enqueue(&dma_buffer[0], pos);
     }
     old_pos = pos;
+    sched_post(SCHED_EVENT_UART);
 }
 
 
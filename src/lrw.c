@@ -21,6 +21,10 @@
 #include "irq.h"
 #include "nvm.h"
 #include "rtc.h"
+#include "rfstats.h"
+#include "nbtrans.h"
+#include "journal.h"
+#include "sched.h"
 
 #define MAX_BAT 254
 
@@ -29,6 +33,8 @@ unsigned int lrw_event_subtype;
 static McpsConfirm_t tx_params;
 static int joins_left = 0;
 static TimerEvent_t join_retry_timer;
+static TimerEvent_t drain_timer;
+static TimerEvent_t commit_timer;
 static uint8_t join_datarate;
 
 TimerTime_t lrw_dutycycle_deadline;
@@ -36,9 +42,14 @@ TimerTime_t lrw_dutycycle_deadline;
 
 enum lora_event {
     NO_EVENT = 0,
-    RETRANSMIT_JOIN = (1 << 0)
+    RETRANSMIT_JOIN = (1 << 0),
+    DRAIN_DOWNLINKS = (1 << 1)
 };
 
+// How long to wait before retrying an automatic empty uplink if LoRaMac is
+// still busy with the previous transaction (in milliseconds)
+#define DRAIN_BUSY_RETRY 1000
+
 static unsigned events;
 
 
@@ -101,6 +112,111 @@ static void process_notify(void)
     uint32_t mask = disable_irq();
     system_sleep_lock |= SYSTEM_MODULE_LORA;
     reenable_irq(mask);
+    sched_post(SCHED_EVENT_MAC);
+}
+
+
+static volatile uint16_t nvm_failed;
+static uint16_t nvm_saving;
+
+// State of the NVM commit scheduler. Groups with pending changes are collected
+// in nvm_flags. Once the scheduler decides to commit, all of them are moved
+// into nvm_pass and written back to back.
+static uint16_t nvm_pass;
+static TimerTime_t nvm_pending_since;  // Time of the oldest change not in nvm_pass
+static TimerTime_t nvm_changed_at;     // Time of the most recent change
+static bool nvm_deferred;              // The next pass has been postponed
+
+
+static void on_commit_timer(void *ctx)
+{
+    // Invoked in the ISR context, wake the main loop up to start the pass
+    (void)ctx;
+    system_sleep_lock |= SYSTEM_MODULE_NVM;
+    sched_post(SCHED_EVENT_NVM);
+}
+
+
+// Return 0 if a commit pass can start now, otherwise the number of
+// milliseconds to wait before checking again.
+static TimerTime_t commit_delay(void)
+{
+    TimerTime_t now = TimerGetCurrentTime();
+    TimerTime_t age = now - nvm_pending_since;
+    TimerTime_t idle = now - nvm_changed_at;
+    TimerTime_t wait = 0, next;
+
+    if (age >= NVM_MAX_DEFER) {
+        if (nvm_deferred) nvm_commit_stats.forced++;
+        return 0;
+    }
+
+    if (idle < NVM_COMMIT_DELAY) {
+        // Wait for the state to settle
+        wait = NVM_COMMIT_DELAY - idle;
+    } else {
+        // Programming the EEPROM delays interrupt handling. Don't start
+        // writing if the next timer, which could open an RX window or start a
+        // transmission, is about to fire. Check again once it has fired.
+        next = TimerGetTimeToNextEvent();
+        if (next < NVM_RX_MARGIN) {
+            if (!nvm_deferred) nvm_commit_stats.deferred++;
+            nvm_deferred = true;
+            wait = next + 1;
+        }
+    }
+
+    if (wait > NVM_MAX_DEFER - age) wait = NVM_MAX_DEFER - age;
+    return wait;
+}
+
+
+// Invoked from the main loop once a LoRaMac state group has been written. If
+// the write failed, e.g., because LoRaMac modified the group while it was being
+// written, schedule the group to be saved again.
+static void state_saved(bool ok)
+{
+    if (!ok) nvm_failed |= nvm_saving;
+}
+
+
+static bool save_group(const part_t *part, const void *data, size_t size, uint16_t flag)
+{
+    nvm_saving = flag;
+    nvm_commit_stats.writes++;
+
+    // RegionGroup2 is kept in a single copy (see nvm.c)
+    if (part == &nvm_parts.region2)
+        return part_sync_async(part, 0, data, size, state_saved);
+    return part_mirror_write_async(part, data, size, state_saved);
+}
+
+
+// MacGroup1 changes with every uplink, mostly because of AdrAckCounter and
+// LastTxDoneTime. Neither is worth rewriting the mirrored part for: the transmit
+// time is relative to the RTC which restarts on reboot, and a slightly stale
+// ADR acknowledgement counter only postpones the ADR backoff after a reboot.
+// The counter is allowed to fall behind by up to MAC1_MAX_ADR_ACK_DRIFT
+// uplinks before the part is written again.
+#define MAC1_MAX_ADR_ACK_DRIFT 16
+
+static bool mac1_changed(const LoRaMacNvmDataGroup1_t *group)
+{
+    size_t size;
+    LoRaMacNvmDataGroup1_t tmp;
+
+    const LoRaMacNvmDataGroup1_t *saved = part_mirror_mmap(&size, &nvm_parts.mac1);
+    if (saved == NULL || size < sizeof(*saved)) return true;
+
+    if (group->AdrAckCounter < saved->AdrAckCounter ||
+        group->AdrAckCounter - saved->AdrAckCounter >= MAC1_MAX_ADR_ACK_DRIFT)
+        return true;
+
+    memcpy(&tmp, group, sizeof(tmp));
+    tmp.AdrAckCounter = saved->AdrAckCounter;
+    tmp.LastTxDoneTime = saved->LastTxDoneTime;
+    tmp.Crc32 = saved->Crc32;
+    return memcmp(&tmp, saved, sizeof(tmp)) != 0;
 }
 
 
@@ -109,86 +225,134 @@ static void save_state(void)
     uint32_t mask;
     LoRaMacNvmData_t *s;
 
-    if (nvm_flags == LORAMAC_NVM_NOTIFY_FLAG_NONE) {
-        mask = disable_irq();
+    mask = disable_irq();
+    uint16_t failed = nvm_failed;
+    nvm_failed = 0;
+    nvm_flags |= failed;
+
+    // Let the system sleep if there is nothing to save, or while a previous
+    // write is in progress. The completion of the write wakes the main loop up
+    // again.
+    if (nvm_flags == LORAMAC_NVM_NOTIFY_FLAG_NONE || part_busy()) {
         system_sleep_lock &= ~SYSTEM_MODULE_NVM;
         reenable_irq(mask);
         return;
     }
 
-    mask = disable_irq();
     system_sleep_lock |= SYSTEM_MODULE_NVM;
     reenable_irq(mask);
 
+    if (failed) log_error("Error while writing LoRaMac state to NVM (0x%x)", failed);
+
+    if (nvm_pass == LORAMAC_NVM_NOTIFY_FLAG_NONE) {
+        if (LoRaMacIsBusy()) return;
+
+        TimerStop(&commit_timer);
+        TimerTime_t wait = commit_delay();
+        if (wait) {
+            mask = disable_irq();
+            TimerSetValue(&commit_timer, wait);
+            TimerStart(&commit_timer);
+            system_sleep_lock &= ~SYSTEM_MODULE_NVM;
+            reenable_irq(mask);
+            return;
+        }
+
+        nvm_pass = nvm_flags;
+        nvm_deferred = false;
+        nvm_commit_stats.commits++;
+    }
+
     s = lrw_get_state();
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_CRYPTO) {
+    if (nvm_pass & LORAMAC_NVM_NOTIFY_FLAG_CRYPTO) {
         if (LoRaMacIsBusy()) return;
 
-        log_debug("Saving Crypto state to NVM");
-        if (!part_write(&nvm_parts.crypto, 0, &s->Crypto, sizeof(s->Crypto)))
-            log_error("Error while writing Crypto state to NVM");
+        if (journal_append(&s->Crypto)) {
+            log_debug("Saved FCntUp to NVM journal");
+        } else {
+            log_debug("Saving Crypto state to NVM");
+            if (save_group(&nvm_parts.crypto, &s->Crypto, sizeof(s->Crypto), LORAMAC_NVM_NOTIFY_FLAG_CRYPTO))
+                journal_checkpoint(&s->Crypto);
+            else
+                log_error("Error while writing Crypto state to NVM");
+        }
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CRYPTO;
+        nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_CRYPTO;
         return;
     }
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1) {
+    if (nvm_pass & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1) {
         if (LoRaMacIsBusy()) return;
 
-        log_debug("Saving MacGroup1 state to NVM");
-        if (!part_write(&nvm_parts.mac1, 0, &s->MacGroup1, sizeof(s->MacGroup1)))
-            log_error("Error while writing MacGroup1 state to NVM");
+        if (mac1_changed(&s->MacGroup1)) {
+            log_debug("Saving MacGroup1 state to NVM");
+            if (!save_group(&nvm_parts.mac1, &s->MacGroup1, sizeof(s->MacGroup1), LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1))
+                log_error("Error while writing MacGroup1 state to NVM");
+            nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1;
+            nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1;
+            return;
+        }
+
+        // Nothing but the per-uplink counters changed, move on to the next
+        // group right away.
+        log_debug("Skipping MacGroup1 state, only uplink counters changed");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1;
-        return;
+        nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1;
     }
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2) {
+    if (nvm_pass & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2) {
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving MacGroup2 state to NVM");
-        if (!part_write(&nvm_parts.mac2, 0, &s->MacGroup2, sizeof(s->MacGroup2)))
+        if (!save_group(&nvm_parts.mac2, &s->MacGroup2, sizeof(s->MacGroup2), LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2))
             log_error("Error while writing MacGroup2 state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2;
+        nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2;
         return;
     }
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT) {
+    if (nvm_pass & LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT) {
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving SecureElement state to NVM");
-        if (!part_write(&nvm_parts.se, 0, &s->SecureElement, sizeof(s->SecureElement)))
+        if (!save_group(&nvm_parts.se, &s->SecureElement, sizeof(s->SecureElement), LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT))
             log_error("Error while writing SecureElement state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT;
+        nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT;
         return;
     }
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1) {
+    if (nvm_pass & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1) {
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving RegionGroup1 state to NVM");
-        if (!part_write(&nvm_parts.region1, 0, &s->RegionGroup1, sizeof(s->RegionGroup1)))
+        if (!save_group(&nvm_parts.region1, &s->RegionGroup1, sizeof(s->RegionGroup1), LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1))
             log_error("Error while writing RegionGroup1 state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1;
+        nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1;
         return;
     }
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2) {
+    if (nvm_pass & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2) {
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving RegionGroup2 state to NVM");
-        if (!part_write(&nvm_parts.region2, 0, &s->RegionGroup2, sizeof(s->RegionGroup2)))
+        if (!save_group(&nvm_parts.region2, &s->RegionGroup2, sizeof(s->RegionGroup2), LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2))
             log_error("Error while writing RegionGroup2 state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2;
+        nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2;
         return;
     }
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_CLASS_B) {
+    if (nvm_pass & LORAMAC_NVM_NOTIFY_FLAG_CLASS_B) {
         if (LoRaMacIsBusy()) return;
 
         log_debug("Saving ClassB state to NVM");
-        if (!part_write(&nvm_parts.classb, 0, &s->ClassB, sizeof(s->ClassB)))
+        if (!save_group(&nvm_parts.classb, &s->ClassB, sizeof(s->ClassB), LORAMAC_NVM_NOTIFY_FLAG_CLASS_B))
             log_error("Error while writing ClassB state to NVM");
         nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CLASS_B;
+        nvm_pass &= ~LORAMAC_NVM_NOTIFY_FLAG_CLASS_B;
         return;
     }
 }
@@ -202,25 +366,28 @@ static void restore_state(void)
 
     memset(&s, 0, sizeof(s));
 
-    p = part_mmap(&size, &nvm_parts.crypto);
-    if (p && size >= sizeof(s.Crypto)) memcpy(&s.Crypto, p, sizeof(s.Crypto));
+    p = part_mirror_mmap(&size, &nvm_parts.crypto);
+    if (p && size >= sizeof(s.Crypto)) {
+        memcpy(&s.Crypto, p, sizeof(s.Crypto));
+        journal_restore(&s.Crypto);
+    }
 
-    p = part_mmap(&size, &nvm_parts.mac1);
+    p = part_mirror_mmap(&size, &nvm_parts.mac1);
     if (p && size >= sizeof(s.MacGroup1)) memcpy(&s.MacGroup1, p, sizeof(s.MacGroup1));
 
-    p = part_mmap(&size, &nvm_parts.mac2);
+    p = part_mirror_mmap(&size, &nvm_parts.mac2);
     if (p && size >= sizeof(s.MacGroup2)) memcpy(&s.MacGroup2, p, sizeof(s.MacGroup2));
 
-    p = part_mmap(&size, &nvm_parts.se);
+    p = part_mirror_mmap(&size, &nvm_parts.se);
     if (p && size >= sizeof(s.SecureElement)) memcpy(&s.SecureElement, p, sizeof(s.SecureElement));
 
-    p = part_mmap(&size, &nvm_parts.region1);
+    p = part_mirror_mmap(&size, &nvm_parts.region1);
     if (p && size >= sizeof(s.RegionGroup1)) memcpy(&s.RegionGroup1, p, sizeof(s.RegionGroup1));
 
     p = part_mmap(&size, &nvm_parts.region2);
     if (p && size >= sizeof(s.RegionGroup2)) memcpy(&s.RegionGroup2, p, sizeof(s.RegionGroup2));
 
-    p = part_mmap(&size, &nvm_parts.classb);
+    p = part_mirror_mmap(&size, &nvm_parts.classb);
     if (p && size >= sizeof(s.ClassB)) memcpy(&s.ClassB, p, sizeof(s.ClassB));
 
     MibRequestConfirm_t r = {
@@ -243,7 +410,7 @@ static void load_deveui(void)
 
     memset(dev_eui, '\0', sizeof(dev_eui));
 
-    const SecureElementNvmData_t *p = part_mmap(&size, &nvm_parts.se);
+    const SecureElementNvmData_t *p = part_mirror_mmap(&size, &nvm_parts.se);
     if (p == NULL) return;
     if (size < sizeof(SecureElementNvmData_t)) return;
 
@@ -273,7 +440,7 @@ static int restore_region(void)
     LoRaMacRegion_t region;
     uint32_t crc;
 
-    const LoRaMacNvmDataGroup2_t *p = part_mmap(&size, &nvm_parts.mac2);
+    const LoRaMacNvmDataGroup2_t *p = part_mirror_mmap(&size, &nvm_parts.mac2);
     if (p == NULL) goto out;
     if (size < sizeof(LoRaMacNvmDataGroup2_t)) goto out;
 
@@ -303,6 +470,15 @@ out:
 
 static void state_changed(uint16_t flags)
 {
+    TimerTime_t now = TimerGetCurrentTime();
+
+    // Changes to groups that already wait to be saved cost nothing extra
+    nvm_commit_stats.coalesced += __builtin_popcount(flags & nvm_flags);
+
+    if ((flags & ~nvm_pass) && !(nvm_flags & ~nvm_pass))
+        nvm_pending_since = now;
+    nvm_changed_at = now;
+
     nvm_flags |= flags;
 }
 
@@ -335,8 +511,17 @@ static void mcps_confirm(McpsConfirm_t *param)
     log_debug("mcps_confirm: McpsRequest: %d, Channel: %ld AckReceived: %d", param->McpsRequest, param->Channel, param->AckReceived);
     tx_params = *param;
 
-    if (param->McpsRequest == MCPS_CONFIRMED)
+    rfstats_uplink(param->Channel, param->Datarate, param->NbTrans,
+        param->TxTimeOnAir, param->McpsRequest == MCPS_CONFIRMED,
+        param->AckReceived == 1);
+
+    // Only confirmed uplinks tell whether the message got through. The network
+    // is not obliged to answer unconfirmed uplinks, so a missing downlink does
+    // not mean that the uplink was lost.
+    if (param->McpsRequest == MCPS_CONFIRMED) {
+        nbtrans_record(param->Datarate, param->NbTrans, param->AckReceived == 1);
         on_ack(param->AckReceived == 1);
+    }
 }
 
 
@@ -354,12 +539,20 @@ static void mcps_indication(McpsIndication_t *param)
         return;
     }
 
+    rfstats_downlink(param->Rssi, param->Snr);
+
     if (param->RxData) {
         recv(param->Port, param->Buffer, param->BufferSize);
     }
 
-    if (param->IsUplinkTxPending == true) {
-        // do nothing for now
+    // The network has more downlinks queued for us (FPending set) or needs an
+    // uplink to deliver a MAC command answer. If enabled, schedule an empty
+    // uplink so that a class A device can drain the queue right away.
+    if ((param->IsUplinkTxPending == true || param->FramePending) && sysconf.drain_downlinks) {
+        uint32_t mask = disable_irq();
+        events |= DRAIN_DOWNLINKS;
+        system_sleep_lock |= SYSTEM_MODULE_LORA;
+        reenable_irq(mask);
     }
 }
 
@@ -374,11 +567,15 @@ static int sync_device_class(void)
     rc = LoRaMacMibGetRequestConfirm(&r);
     if (rc != LORAMAC_STATUS_OK) return rc;
 
-    if (r.Param.Class == sysconf.device_class)
-        return LORAMAC_STATUS_OK;
+    if (r.Param.Class != sysconf.device_class) {
+        r.Param.Class = sysconf.device_class;
+        rc = LoRaMacMibSetRequestConfirm(&r);
+        if (rc != LORAMAC_STATUS_OK) return rc;
+    }
 
-    r.Param.Class = sysconf.device_class;
-    return LoRaMacMibSetRequestConfirm(&r);
+    // Only class B timing is corrected for the temperature
+    rtc_set_temperature_sampling(r.Param.Class == CLASS_B);
+    return LORAMAC_STATUS_OK;
 }
 
 
@@ -487,6 +684,68 @@ static void retransmit_join(void)
 }
 
 
+static void on_drain_timer(void *ctx)
+{
+    // Invoked in the ISR context, see on_join_timer below
+    (void)ctx;
+    system_sleep_lock |= SYSTEM_MODULE_LORA;
+    events |= DRAIN_DOWNLINKS;
+}
+
+
+static void drain_downlinks(void)
+{
+    McpsReq_t mr;
+    LoRaMacStatus_t rc;
+
+    if (!sysconf.drain_downlinks) return;
+
+    // We get here from mcps_indication which runs before LoRaMac finishes the
+    // current transaction. Try again a little later if the MAC is still busy.
+    if (LoRaMacIsBusy()) {
+        TimerSetValue(&drain_timer, DRAIN_BUSY_RETRY);
+        TimerStart(&drain_timer);
+        return;
+    }
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS_DATARATE };
+    LoRaMacMibGetRequestConfirm(&r);
+
+    // Send an empty unconfirmed uplink without port and payload. Any pending
+    // MAC command answers will be carried in FOpts.
+    memset(&mr, 0, sizeof(mr));
+    mr.Type = MCPS_UNCONFIRMED;
+    mr.Req.Unconfirmed.fPort = 0;
+    mr.Req.Unconfirmed.fBuffer = NULL;
+    mr.Req.Unconfirmed.fBufferSize = 0;
+    mr.Req.Unconfirmed.Datarate = r.Param.ChannelsDatarate;
+
+    log_debug("Sending empty uplink to fetch pending downlinks");
+    rc = lrw_mcps_request(&mr, 1);
+    switch (rc) {
+        case LORAMAC_STATUS_OK:
+            break;
+
+        case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+            // Try again once the duty cycle allows us to transmit
+            log_debug("Empty uplink postponed by %ld ms due to duty cycle",
+                mr.ReqReturn.DutyCycleWaitTime);
+            TimerSetValue(&drain_timer, mr.ReqReturn.DutyCycleWaitTime);
+            TimerStart(&drain_timer);
+            break;
+
+        case LORAMAC_STATUS_BUSY:
+            TimerSetValue(&drain_timer, DRAIN_BUSY_RETRY);
+            TimerStart(&drain_timer);
+            break;
+
+        default:
+            log_error("Could not send empty uplink (%d)", rc);
+            break;
+    }
+}
+
+
 static void on_join_timer(void *ctx)
 {
     // This handler is invoked in the ISR context within an interrupt generated
@@ -581,7 +840,7 @@ static LoRaMacPrimitives_t primitives = {
 
 static LoRaMacCallback_t callbacks = {
     .GetBatteryLevel     = get_battery_level,
-    .GetTemperatureLevel = adc_get_temperature_celsius,
+    .GetTemperatureLevel = rtc_get_temperature,
     .NvmDataChange       = state_changed,
     .MacProcessNotify    = process_notify
 };
@@ -654,6 +913,41 @@ static void log_network_info(void)
 }
 
 
+// The timing error of the receiver LoRaMac accounts for when it sizes RX
+// windows. Until the Stop mode wake-up latency has been calibrated, a generous
+// fixed margin is used. After that, the average latency is compensated for
+// when the RX window alarm is set and the margin only needs to cover the
+// wake-up jitter plus the RTC tick resolution. Smaller margins mean shorter
+// RX windows and less time with the receiver on.
+#define MAX_RX_ERROR 20  // ms
+#define MIN_RX_ERROR 4   // ms
+
+static uint32_t rx_error;
+
+static void update_rx_error(void)
+{
+    MibRequestConfirm_t r = { .Type = MIB_SYSTEM_MAX_RX_ERROR };
+    uint32_t error = MAX_RX_ERROR;
+
+    // Four times the mean absolute deviation covers all but the rarest
+    // outliers of a roughly normal distribution
+    int32_t jitter = rtc_get_mcu_wake_up_jitter();
+    if (jitter >= 0) {
+        error = MIN_RX_ERROR + rtc_tick2ms(4 * jitter);
+        if (error > MAX_RX_ERROR) error = MAX_RX_ERROR;
+    }
+
+    if (error == rx_error) return;
+
+    r.Param.SystemMaxRxError = error;
+    if (LoRaMacMibSetRequestConfirm(&r) == LORAMAC_STATUS_OK) {
+        log_debug("LoRaMac: Max RX timing error %ld ms (wake-up %d ticks)",
+            error, rtc_get_mcu_wake_up_time());
+        rx_error = error;
+    }
+}
+
+
 /* This function applies default settings according to the original Type ABZ
  * firmware. It is meant to be called after the MIB has been initialized from
  * the defaults built in LoRaMac-node and before settings are restored from NVM.
@@ -704,6 +998,8 @@ void lrw_init(void)
 
     memset(&tx_params, 0, sizeof(tx_params));
     TimerInit(&join_retry_timer, on_join_timer);
+    TimerInit(&drain_timer, on_drain_timer);
+    TimerInit(&commit_timer, on_commit_timer);
 
     LoRaMacRegion_t region = restore_region();
 
@@ -731,9 +1027,8 @@ void lrw_init(void)
     set_defaults();
     restore_state();
 
-    r.Type = MIB_SYSTEM_MAX_RX_ERROR;
-    r.Param.SystemMaxRxError = 20;
-    LoRaMacMibSetRequestConfirm(&r);
+    rx_error = 0;
+    update_rx_error();
 
     sync_device_class();
 
@@ -861,9 +1156,14 @@ int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
         mr.Req.Confirmed.Datarate = r.Param.ChannelsDatarate;
     }
 
-    rc = lrw_mcps_request(&mr, confirmed
+    int transmissions = confirmed
         ? sysconf.confirmed_retransmissions
-        : sysconf.unconfirmed_retransmissions);
+        : sysconf.unconfirmed_retransmissions;
+
+    if (sysconf.adaptive_nbtrans)
+        transmissions = nbtrans_get(r.Param.ChannelsDatarate, transmissions);
+
+    rc = lrw_mcps_request(&mr, transmissions);
     if (rc != LORAMAC_STATUS_OK)
         log_debug("Transmission failed: %d", rc);
 
@@ -877,10 +1177,16 @@ void lrw_process(void)
     unsigned ev = events;
     events = NO_EVENT;
 
+    // LoRaMac has notified us about pending work (process_notify), which may
+    // involve decryption and MIC computation
+    bool pending = system_sleep_lock & SYSTEM_MODULE_LORA;
     system_sleep_lock &= ~SYSTEM_MODULE_LORA;
     reenable_irq(mask);
 
+    if (pending || ev) system_clock_boost();
+
     if (ev & RETRANSMIT_JOIN) retransmit_join();
+    if (ev & DRAIN_DOWNLINKS) drain_downlinks();
 
     if (Radio.IrqProcess != NULL) Radio.IrqProcess();
     LoRaMacProcess();
@@ -1182,6 +1488,9 @@ static void update_duty_cycle_deadline(LoRaMacStatus_t rc, TimerTime_t time)
 // the duty cycle wait time returned by the function for the benefit of AT+BACKOFF
 LoRaMacStatus_t lrw_mlme_request(MlmeReq_t* req)
 {
+    system_clock_boost();
+    update_rx_error();
+
     LoRaMacStatus_t rc = LoRaMacMlmeRequest(req);
     update_duty_cycle_deadline(rc, req->ReqReturn.DutyCycleWaitTime);
     return rc;
@@ -1195,6 +1504,10 @@ LoRaMacStatus_t lrw_mcps_request(McpsReq_t* req, int transmissions)
         .Type = MIB_CHANNELS_NB_TRANS,
         .Param = { .ChannelsNbTrans = transmissions }
     };
+
+    system_clock_boost();
+    update_rx_error();
+
     rc = LoRaMacMibSetRequestConfirm(&r);
     if (rc != LORAMAC_STATUS_OK) {
         log_debug("Could not configure retransmissions: %d", rc);
@@ -1225,6 +1538,9 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui)
         // we have to, depending on the flags.
         nvm_init();
 
+        // Erasing the EEPROM does not undo its wear
+        nvm_preserve_wear();
+
         // Unless the application explicitly asks for the DevNonce to be also
         // reset, we preserve the original value to make sure that OTAA Join
         // continues working from this device after factory reset.
@@ -1242,7 +1558,7 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui)
 
             // Write the data structure initialized in the previous step into
             // the crypto part.
-            if (!part_write(&nvm_parts.crypto, 0, &c, sizeof(c)))
+            if (!part_mirror_write(&nvm_parts.crypto, &c, sizeof(c)))
                 log_error("Error while saving DevNonce to NVM during factory reset");
         } else {
             log_debug("Resetting DevNonce");
@@ -1268,7 +1584,7 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui)
 
             // Write the data structure initialized in the previous step into
             // the secure element part.
-            if (!part_write(&nvm_parts.se, 0, &s, sizeof(s)))
+            if (!part_mirror_write(&nvm_parts.se, &s, sizeof(s)))
                 log_error("Error while saving DevEUI to NVM during factory reset");
         } else {
             log_debug("Resetting DevEUI");
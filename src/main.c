@@ -16,13 +16,63 @@
 #include "eeprom.h"
 #include "halt.h"
 #include "nvm.h"
+#include "seg.h"
 #include "sx1276-board.h"
+#include "sched.h"
+#include "utils.h"
+
+
+// Main loop tasks in the order in which they run within an iteration. The
+// EEPROM task completes background writes first so that their callbacks have
+// run by the time the tasks waiting for them get to run. The MAC goes next to
+// give it a chance to timestamp incoming downlinks as quickly as
+// possible after waking up. The system configuration task also runs after
+// events that might have modified the configuration or completed an NVM write,
+// and on RTC alarms to check whether the EEPROM wear counters are due.
+static const sched_task_t tasks[] = {
+    {
+        .name   = "eeprom",
+        .events = SCHED_EVENT_NVM,
+        .run    = eeprom_process
+    }, {
+        .name   = "lrw",
+        .events = SCHED_EVENT_MAC | SCHED_EVENT_NVM,
+        .locks  = SYSTEM_MODULE_LORA | SYSTEM_MODULE_NVM,
+        .run    = lrw_process
+    }, {
+        .name   = "cmd",
+        .events = SCHED_EVENT_UART,
+        .locks  = SYSTEM_MODULE_ATCI,
+        .run    = cmd_process
+    }, {
+        .name   = "seg",
+        .events = SCHED_EVENT_MAC,
+        .locks  = SYSTEM_MODULE_LORA,
+        .run    = seg_process
+    }, {
+        .name   = "rtc",
+        .events = SCHED_EVENT_TIMER,
+        .run    = rtc_temperature_process
+    }, {
+        .name   = "sysconf",
+        .events = SCHED_EVENT_UART | SCHED_EVENT_MAC | SCHED_EVENT_TIMER | SCHED_EVENT_NVM,
+        .locks  = SYSTEM_MODULE_NVM,
+        .run    = sysconf_process
+#if MKR1310 == 1
+    }, {
+        .name   = "uartwake",
+        .events = SCHED_EVENT_WAKEUP,
+        .run    = process_uart_wakeup
+#endif
+    }
+};
 
 
 int main(void)
 {
     int busy;
     system_init();
+    sched_init(tasks, ARRAY_LEN(tasks));
 
 #ifdef DEBUG
     log_init(LOG_LEVEL_DUMP, LOG_TIMESTAMP_ABS);
@@ -60,12 +110,7 @@ int main(void)
     cmd_event(CMD_EVENT_MODULE, CMD_MODULE_BOOT);
 
     while (1) {
-        #if MKR1310 == 1
-        process_uart_wakeup();
-        #endif 
-        cmd_process();
-        lrw_process();
-        sysconf_process();
+        sched_run();
 
         disable_irq();
 
@@ -89,15 +134,14 @@ int main(void)
         busy = system_sleep_lock | (system_stop_lock & ~SYSTEM_MODULE_RADIO) | LoRaMacIsBusy();
         if (schedule_reset && !busy) {
             NVIC_SystemReset();
-        } else {
+        } else if (!sched_pending()) {
+            // Events posted by interrupt handlers after this point wake the
+            // MCU up from system_idle.
             system_idle();
+            sched_post(SCHED_EVENT_WAKEUP);
         }
 
         enable_irq();
-
-        // Invoke lrw_process as the first thing after waking up to give the MAC
-        // a chance to timestamp incoming downlink as quickly as possible.
-        lrw_process();
     }
 }
 
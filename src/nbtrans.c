@@ -0,0 +1,81 @@
+#include "nbtrans.h"
+#include <string.h>
+#include "log.h"
+#include "utils.h"
+
+// The maximum number of data rates across all LoRaWAN regions
+#define MAX_DATARATES 16
+
+// The number of most recent uplinks kept for each data rate
+#define WINDOW_SIZE 16
+
+// The minimum number of samples required before we start adjusting the number
+// of transmissions. Until then, the configured value is used.
+#define MIN_SAMPLES 4
+
+// Target probability of non-delivery in Q16 fixed point (1%)
+#define TARGET_LOSS ((1UL << 16) / 100)
+
+// Each sample stores the number of transmissions in the lower bits and the
+// delivery flag in the most significant bit.
+#define DELIVERED 0x80
+
+typedef struct window {
+    uint8_t sample[WINDOW_SIZE];
+    uint8_t next;
+    uint8_t count;
+} window_t;
+
+static window_t window[MAX_DATARATES];
+
+
+void nbtrans_record(unsigned int datarate, unsigned int transmissions, bool delivered)
+{
+    if (datarate >= ARRAY_LEN(window) || transmissions == 0) return;
+    if (transmissions > 15) transmissions = 15;
+
+    window_t *w = &window[datarate];
+    w->sample[w->next] = transmissions | (delivered ? DELIVERED : 0);
+    w->next = (w->next + 1) % WINDOW_SIZE;
+    if (w->count < WINDOW_SIZE) w->count++;
+}
+
+
+unsigned int nbtrans_get(unsigned int datarate, unsigned int max)
+{
+    uint32_t attempts = 0, successes = 0, loss, p;
+    unsigned int n;
+
+    if (max <= 1 || datarate >= ARRAY_LEN(window)) return max;
+
+    window_t *w = &window[datarate];
+    if (w->count < MIN_SAMPLES) return max;
+
+    // Each delivered uplink counts as one successful transmission out of the
+    // number of transmissions performed. Undelivered uplinks count as failed
+    // transmissions only.
+    for (int i = 0; i < w->count; i++) {
+        attempts += w->sample[i] & ~DELIVERED;
+        if (w->sample[i] & DELIVERED) successes++;
+    }
+
+    if (successes == 0) return max;
+
+    // The probability that a single transmission is lost, in Q16 fixed point
+    loss = ((attempts - successes) << 16) / attempts;
+
+    // Find the smallest number of transmissions n for which loss^n drops below
+    // the target.
+    p = loss;
+    for (n = 1; n < max && p > TARGET_LOSS; n++)
+        p = (p * loss) >> 16;
+
+    log_debug("nbtrans: DR%d loss=%ld/65536 transmissions=%d", datarate, loss, n);
+    return n;
+}
+
+
+void nbtrans_reset(void)
+{
+    memset(window, 0, sizeof(window));
+}
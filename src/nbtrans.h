@@ -0,0 +1,39 @@
+#ifndef _NBTRANS_H
+#define _NBTRANS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! @brief Record the outcome of an uplink message
+//!
+//! Only record confirmed uplinks, whose outcome is known (ACK received or
+//! not). Recording only the unconfirmed uplinks that happen to be answered by
+//! a downlink would make every sample a delivery and the estimated loss zero,
+//! so the number of transmissions could never grow again. With unconfirmed
+//! traffic only, there are no samples and nbtrans_get returns the configured
+//! maximum.
+//!
+//! @param[in] datarate Data rate of the uplink
+//! @param[in] transmissions Number of transmissions that were performed
+//! @param[in] delivered True if the uplink is known to have reached the network
+
+void nbtrans_record(unsigned int datarate, unsigned int transmissions, bool delivered);
+
+//! @brief Return the number of transmissions to use on the given data rate
+//!
+//! The value is derived from the per-transmission success rate observed over a
+//! sliding window of recent uplinks on the data rate. It is the smallest
+//! number of transmissions that delivers the message with 99% probability,
+//! bounded by @p max. If there are not enough samples yet, @p max is returned.
+//!
+//! @param[in] datarate Data rate of the next uplink
+//! @param[in] max Maximum number of transmissions (the configured value)
+//! @retval Number of transmissions (1 to @p max)
+
+unsigned int nbtrans_get(unsigned int datarate, unsigned int max);
+
+//! @brief Forget all recorded outcomes
+
+void nbtrans_reset(void);
+
+#endif // _NBTRANS_H
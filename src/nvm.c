@@ -1,18 +1,19 @@
 #include "nvm.h"
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
-#include <strings.h>
 #include <stm/include/stm32l072xx.h>
 #include <loramac-node/src/mac/LoRaMacTypes.h>
 #include <loramac-node/src/mac/LoRaMac.h>
+#include <LoRaWAN/Utilities/timeServer.h>
 #include "log.h"
 #include "part.h"
 #include "eeprom.h"
 #include "halt.h"
-#include "part.h"
+#include "kv.h"
 #include "utils.h"
 
-#define NUMBER_OF_PARTS 9
+#define NUMBER_OF_PARTS 10
 
 
 /* The following partition sizes have been derived from the in-memory size of
@@ -31,7 +32,16 @@
 #define REGION1_PART_SIZE   32
 #define REGION2_PART_SIZE 1310
 #define CLASSB_PART_SIZE    32
-#define USER_NVM_PART_SIZE  72
+#define KV_PART_SIZE      1524
+#define FCNT_PART_SIZE     128
+
+// The key-value store ends exactly where it did in layout version 3. The
+// frame counter journal thus stays in place during the migration, which could
+// not be restarted after a power loss if the journal were moved by a few bytes
+// over its old location (see part_migrate_block).
+
+// The size of the "user" part in layout versions 0 and 1 (see legacy_user_t)
+#define LEGACY_USER_PART_SIZE 72
 
 
 // Make sure each data structure fits into its fixed-size partition
@@ -43,23 +53,37 @@ static_assert(sizeof(SecureElementNvmData_t) <= SE_PART_SIZE, "SecureElement NVM
 static_assert(sizeof(RegionNvmDataGroup1_t) <= REGION1_PART_SIZE, "RegionGroup1 NVM data too long");
 static_assert(sizeof(RegionNvmDataGroup2_t) <= REGION2_PART_SIZE, "RegionGroup2 NVM data too long");
 static_assert(sizeof(LoRaMacClassBNvmData_t) <= CLASSB_PART_SIZE, "ClassB NVM data too long");
-static_assert(sizeof(user_nvm_t) <= USER_NVM_PART_SIZE, "User NVM data too long");
-
-
-// And also make sure that NVM data fits into the EEPROM twice. This is
-// useful in case we wanted to implement atomic writes or data mirroring.
+static_assert(NUMBER_OF_PARTS + 1 <= NVM_WEAR_SLOTS, "Not enough EEPROM wear counters");
+
+// The key-value store must hold all user data registers (AT$NVM) of a device
+// upgraded from layout version 1 plus at least one value of the maximum size.
+static_assert(USER_NVM_MAX_SIZE * KV_RECORD_SIZE(1) + KV_RECORD_SIZE(KV_MAX_VALUE) <= KV_CAPACITY(KV_PART_SIZE),
+    "Key-value store too small");
+
+
+// Most parts are mirrored, i.e., each holds two copies of its data structure
+// (see part_mirror_write). The frame counter journal and the key-value store
+// need no mirroring since each of their records is protected by its own
+// checksum. RegionGroup2 is by far the largest LoRaMac group, yet it only holds
+// the channel plan, which changes rarely and which the network can provision
+// again. It is kept in a single copy to make room for the key-value store. A
+// power loss while it is being written makes LoRaMac reject it on the next boot
+// (its checksum does not match) and fall back to the default channels, but the
+// session is kept. Make sure all of that fits into the EEPROM. The key-value
+// store gets whatever space is left.
 static_assert(
-    SYSCONF_PART_SIZE +
-    CRYPTO_PART_SIZE  +
-    MAC1_PART_SIZE    +
-    MAC2_PART_SIZE    +
-    SE_PART_SIZE      +
-    REGION1_PART_SIZE +
-    REGION2_PART_SIZE +
-    CLASSB_PART_SIZE  +
-    USER_NVM_PART_SIZE
-    <= (DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1 - PART_TABLE_SIZE(NUMBER_OF_PARTS)) / 2,
-    "NVM data does not fit into a single EEPROM bank");
+    PART_MIRROR_SIZE(SYSCONF_PART_SIZE) +
+    PART_MIRROR_SIZE(CRYPTO_PART_SIZE)  +
+    PART_MIRROR_SIZE(MAC1_PART_SIZE)    +
+    PART_MIRROR_SIZE(MAC2_PART_SIZE)    +
+    PART_MIRROR_SIZE(SE_PART_SIZE)      +
+    PART_MIRROR_SIZE(REGION1_PART_SIZE) +
+    PART_ALIGN(REGION2_PART_SIZE)       +
+    PART_MIRROR_SIZE(CLASSB_PART_SIZE)  +
+    KV_PART_SIZE                        +
+    FCNT_PART_SIZE
+    <= DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1 - PART_TABLE_SIZE(NUMBER_OF_PARTS),
+    "NVM data does not fit into the EEPROM");
 
 
 // We currently store all non-volatile state in the EEPROM, so there is only one
@@ -70,39 +94,275 @@ static_assert(
 static part_block_t nvm = {
     .size = DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1,
     .mmap = eeprom_mmap,
-    .write = eeprom_write
+    .write = eeprom_write,
+    .write_async = eeprom_write_async
 };
 
 struct nvm_parts nvm_parts;
 
-user_nvm_t user_nvm = { 0 };
-
-sysconf_t sysconf = {
-    .uart_baudrate = DEFAULT_UART_BAUDRATE,
-    .uart_timeout = 1000,
-    .default_port = 2,
-    .data_format = 0,
-    .sleep = 1,
-    .lock_keys = 0,
-    .device_class = CLASS_A,
-    .unconfirmed_retransmissions = 1,
-    .confirmed_retransmissions = 8
-};
+#define SYSCONF_DEFAULTS {                  \
+    .uart_baudrate = DEFAULT_UART_BAUDRATE, \
+    .uart_timeout = 1000,                   \
+    .default_port = 2,                      \
+    .data_format = 0,                       \
+    .sleep = 1,                             \
+    .lock_keys = 0,                         \
+    .adaptive_nbtrans = 0,                  \
+    .drain_downlinks = 0,                   \
+    .fast_wake = 0,                         \
+    .device_class = CLASS_A,                \
+    .unconfirmed_retransmissions = 1,       \
+    .confirmed_retransmissions = 8,         \
+    .clock_scaling = 0                      \
+}
+
+sysconf_t sysconf = SYSCONF_DEFAULTS;
 
 bool sysconf_modified;
 uint16_t nvm_flags;
+nvm_commit_stats_t nvm_commit_stats;
+
+
+// The current layout of the EEPROM. Bump NVM_LAYOUT_VERSION whenever the
+// format of the data stored in the parts changes in a way that requires
+// conversion on upgrade. Changes in part sizes alone are handled by
+// part_migrate_block automatically.
+//
+// 0: A single copy of the data in each part, no frame counter journal
+// 1: Mirrored (A/B) parts, frame counter journal
+// 2: Key-value store (kv) replaces the user data registers (user)
+// 3: EEPROM wear counters in sysconf
+// 4: Single copy of RegionGroup2 (region2), larger key-value store
+#define NVM_LAYOUT_VERSION 4
+
+// Up to layout version 2, the checksum of sysconf followed right after
+// confirmed_retransmissions, where the (equally aligned) wear counters are now
+#define LEGACY_SYSCONF_SIZE (offsetof(sysconf_t, nvm_wear) + sizeof(uint32_t))
+
+static const part_layout_t nvm_layout[NUMBER_OF_PARTS] = {
+    { "sysconf", PART_MIRROR_SIZE(SYSCONF_PART_SIZE)  },
+    { "crypto",  PART_MIRROR_SIZE(CRYPTO_PART_SIZE)   },
+    { "mac1",    PART_MIRROR_SIZE(MAC1_PART_SIZE)     },
+    { "mac2",    PART_MIRROR_SIZE(MAC2_PART_SIZE)     },
+    { "se",      PART_MIRROR_SIZE(SE_PART_SIZE)       },
+    { "region1", PART_MIRROR_SIZE(REGION1_PART_SIZE)  },
+    { "region2", REGION2_PART_SIZE                    },
+    { "classb",  PART_MIRROR_SIZE(CLASSB_PART_SIZE)   },
+    { "kv",      KV_PART_SIZE                         },
+    { "fcnt",    FCNT_PART_SIZE                       }
+};
+
+static part_t * const nvm_layout_parts[NUMBER_OF_PARTS] = {
+    &nvm_parts.sysconf,
+    &nvm_parts.crypto,
+    &nvm_parts.mac1,
+    &nvm_parts.mac2,
+    &nvm_parts.se,
+    &nvm_parts.region1,
+    &nvm_parts.region2,
+    &nvm_parts.classb,
+    &nvm_parts.kv,
+    &nvm_parts.fcnt
+};
+
+/* Version 0 layouts stored a single copy of the data at the beginning of each
+ * part. Such data ends up in the first copy of the corresponding mirrored part
+ * after migration. Give the copy a valid trailer so that part_mirror_mmap finds
+ * it. The data structure's own checksum is still checked by its consumer.
+ */
+static void adopt_unmirrored_parts(void)
+{
+    size_t size;
+    const part_t *part;
+
+    for (unsigned int i = 0; i < NUMBER_OF_PARTS; i++) {
+        part = nvm_layout_parts[i];
+        if (part == &nvm_parts.fcnt || part == &nvm_parts.kv || part == &nvm_parts.region2)
+            continue;
+        if (part_mirror_mmap(&size, part) != NULL) continue;
+
+        size = part->dsc->size / 2 - sizeof(part_trailer_t);
+        const void *p = part->block->mmap(part->dsc->start, size);
+        if (p == NULL || !part_mirror_write(part, p, size))
+            log_error("Error while converting part %s", part->dsc->label);
+    }
+}
+
+
+/* Layout versions 1 to 3 mirrored RegionGroup2 and, from version 2 on, kept
+ * the key-value store in a smaller part. The migration only preserves the
+ * beginning of each part. Make sure the data to be kept is found there: the
+ * newest copy of RegionGroup2 is written into the first copy, and the key-value
+ * records are moved into the first half of their part. Both steps are safe
+ * against power loss and are simply repeated on the next boot.
+ */
+static void prepare_migration(int version)
+{
+    size_t size;
+    const void *p;
+    part_t part;
+
+    if (version < 1 || version >= 4) return;
+
+    if (!part_find(&part, &nvm, "region2") && (p = part_mirror_mmap(&size, &part)) != NULL &&
+        p != part.block->mmap(part.dsc->start, size)) {
+        if (!part_mirror_write(&part, p, size))
+            log_error("Error while converting part region2");
+    }
+
+    if (version >= 2 && !part_find(&nvm_parts.kv, &nvm, "kv")) {
+        kv_init();
+        if (!kv_pack()) log_error("Error while converting part kv");
+    }
+}
+
+
+/* Layout versions 0 and 1 kept the AT$NVM registers in a fixed-size structure
+ * in the "user" part, as a single copy in version 0 and mirrored in version 1.
+ * Load the registers before the part gets dropped by the migration so that
+ * they can be converted into key-value records afterwards.
+ */
+#define LEGACY_USER_MAGIC 0xD15C9101
+
+typedef struct legacy_user {
+    uint32_t magic;
+    uint8_t  values[USER_NVM_MAX_SIZE];
+    uint32_t crc32;
+} legacy_user_t;
+
+static_assert(sizeof(legacy_user_t) == LEGACY_USER_PART_SIZE, "Unexpected legacy user data size");
+
+static legacy_user_t user_regs;
+
+
+static bool load_legacy_user(legacy_user_t *user, int version)
+{
+    part_t part;
+    size_t size;
+    const void *p;
+
+    if (part_find(&part, &nvm, "user")) return false;
+
+    if (version < 1) p = part.block->mmap(part.dsc->start, sizeof(*user));
+    else p = part_mirror_mmap(&size, &part);
+
+    if (p == NULL || !check_block_crc(p, sizeof(*user))) return false;
+    memcpy(user, p, sizeof(*user));
+    return user->magic == LEGACY_USER_MAGIC;
+}
+
+
+static void convert_legacy_user(const legacy_user_t *user)
+{
+    for (unsigned int i = 0; i < USER_NVM_MAX_SIZE; i++) {
+        if (user->values[i] == 0) continue;
+        if (kv_set(i, &user->values[i], 1) != 0)
+            log_error("Error while converting user data register %d", i);
+    }
+}
+
+
+// EEPROM wear accounting. Each word programmed by the EEPROM driver is
+// attributed to the part it belongs to (see count_word). The last counter
+// collects words outside of all parts, i.e., the part table. The part bounds
+// are kept in RAM since the part table itself may be in the middle of being
+// erased or rewritten.
+static struct {
+    uint32_t start;
+    uint32_t end;
+} wear_range[NUMBER_OF_PARTS];
+
+static volatile uint32_t wear[NUMBER_OF_PARTS + 1];
+static volatile bool wear_dirty;
+static TimerTime_t wear_saved_at;
+
+
+// Invoked for each programmed EEPROM word, possibly from an interrupt handler
+static void count_word(uint32_t address)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUMBER_OF_PARTS; i++) {
+        if (address >= wear_range[i].start && address < wear_range[i].end) break;
+    }
+    wear[i]++;
+
+    // Writing the counters to sysconf must not make them dirty again
+    if (i == NUMBER_OF_PARTS || nvm_layout_parts[i] != &nvm_parts.sysconf)
+        wear_dirty = true;
+}
+
+
+static void start_wear_accounting(void)
+{
+    for (unsigned int i = 0; i < NUMBER_OF_PARTS; i++) {
+        wear_range[i].start = nvm_layout_parts[i]->dsc->start;
+        wear_range[i].end = wear_range[i].start + nvm_layout_parts[i]->dsc->size;
+    }
+
+    // Only pick the persisted counters up on boot. Subsequent invocations
+    // (factory reset) keep counting where we are.
+    static bool counting = false;
+    if (counting) return;
+
+    for (unsigned int i = 0; i <= NUMBER_OF_PARTS; i++)
+        wear[i] = sysconf.nvm_wear[i];
+
+    eeprom_set_counter(count_word);
+    counting = true;
+}
+
+
+static void snapshot_wear(uint32_t *dst)
+{
+    for (unsigned int i = 0; i <= NUMBER_OF_PARTS; i++)
+        dst[i] = wear[i];
+
+    wear_dirty = false;
+    wear_saved_at = TimerGetCurrentTime();
+}
+
+
+bool nvm_get_wear(unsigned int index, nvm_wear_t *w)
+{
+    if (index > NUMBER_OF_PARTS) return false;
+
+    if (index < NUMBER_OF_PARTS) {
+        w->label = nvm_layout[index].label;
+        w->size = nvm_layout[index].size;
+    } else {
+        w->label = "table";
+        w->size = PART_TABLE_SIZE(NUMBER_OF_PARTS);
+    }
+    w->words = wear[index];
+    return true;
+}
+
+
+void nvm_preserve_wear(void)
+{
+    sysconf_t s = SYSCONF_DEFAULTS;
+
+    snapshot_wear(s.nvm_wear);
+    update_block_crc(&s, sizeof(s));
+    if (!part_mirror_write(&nvm_parts.sysconf, &s, sizeof(s)))
+        log_error("Error while saving EEPROM wear counters to NVM");
+}
 
 
 /*
  * Initialize system configuration NVM (EEPROM) partition. If necessary, the
- * function formats the EEPROM if the part is not found, or reformats the EEPROM
- * if the part is found but has an invalid size. If the part is found and has a
- * matching size, check the CRC32 checksum of the data before using it. If the
- * checkum does not match, defaults will be used instead.
+ * function formats the EEPROM if it contains no part table yet. If the parts
+ * found in the EEPROM do not match the current layout (nvm_layout), the parts
+ * are migrated to the current layout in place, preserving their contents. The
+ * EEPROM is only erased if the migration fails. Check the CRC32 checksum of the
+ * data before using it. If the checkum does not match, defaults will be used
+ * instead.
  */
 void nvm_init(void)
 {
     int erased = 0;
+    bool convert = false;
 
 start:
     memset(&nvm_parts, 0, sizeof(nvm_parts));
@@ -110,73 +370,46 @@ start:
     // Format the EEPROM if it does not contain a part table yet
     if (part_open_block(&nvm) != 0) {
         log_debug("Formatting EEPROM");
-        if (part_format_block(&nvm, NUMBER_OF_PARTS) != 0) halt("Could not format EEPROM");
+        if (part_format_block(&nvm, NUMBER_OF_PARTS, NVM_LAYOUT_VERSION) != 0)
+            halt("Could not format EEPROM");
         if (part_open_block(&nvm) != 0) halt("EEPROM I/O error");
     }
 
-    if ((part_find(&nvm_parts.sysconf, &nvm, "sysconf") &&
-        part_create(&nvm_parts.sysconf, &nvm, "sysconf", SYSCONF_PART_SIZE)) ||
-        nvm_parts.sysconf.dsc->size != SYSCONF_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.crypto, &nvm, "crypto") &&
-        part_create(&nvm_parts.crypto, &nvm, "crypto", CRYPTO_PART_SIZE)) ||
-        nvm_parts.crypto.dsc->size != CRYPTO_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.mac1, &nvm, "mac1") &&
-        part_create(&nvm_parts.mac1, &nvm, "mac1", MAC1_PART_SIZE)) ||
-        nvm_parts.mac1.dsc->size != MAC1_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.mac2, &nvm, "mac2") &&
-        part_create(&nvm_parts.mac2, &nvm, "mac2", MAC2_PART_SIZE)) ||
-        nvm_parts.mac2.dsc->size != MAC2_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.se, &nvm, "se") &&
-        part_create(&nvm_parts.se, &nvm, "se", SE_PART_SIZE)) ||
-        nvm_parts.se.dsc->size != SE_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.region1, &nvm, "region1") &&
-        part_create(&nvm_parts.region1, &nvm, "region1", REGION1_PART_SIZE)) ||
-        nvm_parts.region1.dsc->size != REGION1_PART_SIZE)
-        goto retry;
+    int version = part_block_version(&nvm);
+    if (version < 2 && !erased) convert = load_legacy_user(&user_regs, version);
+    if (!erased) prepare_migration(version);
 
-    if ((part_find(&nvm_parts.region2, &nvm, "region2") &&
-        part_create(&nvm_parts.region2, &nvm, "region2", REGION2_PART_SIZE)) ||
-        nvm_parts.region2.dsc->size != REGION2_PART_SIZE)
+    int rc = part_migrate_block(&nvm, nvm_layout, NUMBER_OF_PARTS, NUMBER_OF_PARTS,
+        NVM_LAYOUT_VERSION);
+    if (rc < 0) {
+        log_error("Error while migrating NVM layout: %d", rc);
         goto retry;
+    }
 
-    if ((part_find(&nvm_parts.classb, &nvm, "classb") &&
-        part_create(&nvm_parts.classb, &nvm, "classb", CLASSB_PART_SIZE)) ||
-        nvm_parts.classb.dsc->size != CLASSB_PART_SIZE)
-        goto retry;
+    for (unsigned int i = 0; i < NUMBER_OF_PARTS; i++) {
+        if (part_find(nvm_layout_parts[i], &nvm, nvm_layout[i].label))
+            goto retry;
+    }
 
-    if ((part_find(&nvm_parts.user, &nvm, "user") &&
-        part_create(&nvm_parts.user, &nvm, "user", USER_NVM_PART_SIZE)) ||
-        nvm_parts.user.dsc->size != USER_NVM_PART_SIZE)
-        goto retry;
+    if (rc > 0 && version < 1) adopt_unmirrored_parts();
 
     size_t size;
-    const uint8_t *p = part_mmap(&size, &nvm_parts.sysconf);
-    if (check_block_crc(p, sizeof(sysconf))) {
+    const uint8_t *p = part_mirror_mmap(&size, &nvm_parts.sysconf);
+    if (p && check_block_crc(p, sizeof(sysconf))) {
         log_debug("Restoring system configuration from NVM");
         memcpy(&sysconf, p, sizeof(sysconf));
+    } else if (p && version < 3 && check_block_crc(p, LEGACY_SYSCONF_SIZE)) {
+        log_debug("Converting system configuration");
+        memcpy(&sysconf, p, offsetof(sysconf_t, nvm_wear));
+        sysconf_modified = true;
     } else {
         log_debug("Invalid system configuration checksum, using defaults");
     }
 
-    p = part_mmap(&size, &nvm_parts.user);
-    if (check_block_crc(p, sizeof(user_nvm))) {
-        log_debug("Restoring user data from NVM");
-        memcpy(&user_nvm, p, sizeof(user_nvm));
-    } else {
-        log_debug("Invalid user data checksum, using defaults");
-        user_nvm.magic = USER_NVM_MAGIC;
-        bzero(user_nvm.values,USER_NVM_MAX_SIZE);
-    }
+    kv_init();
+    if (convert) convert_legacy_user(&user_regs);
+
+    start_wear_accounting();
 
     return;
 
@@ -191,6 +424,22 @@ retry:
 }
 
 
+uint8_t nvm_get_user_data(unsigned int index)
+{
+    uint8_t v;
+
+    if (index >= USER_NVM_MAX_SIZE) return 0;
+    return kv_get(index, &v, 1) < 0 ? 0 : v;
+}
+
+
+int nvm_set_user_data(unsigned int index, uint8_t value)
+{
+    if (index >= USER_NVM_MAX_SIZE) return KV_ERR_PARAM;
+    return value ? kv_set(index, &value, 1) : kv_delete(index);
+}
+
+
 int nvm_erase(void)
 {
     // Erase the contents of the block (and all its parts) and close it
@@ -202,25 +451,47 @@ int nvm_erase(void)
 }
 
 
+static volatile bool sysconf_failed;
+
+// Invoked from the main loop once sysconf has been written
+static void sysconf_written(bool ok)
+{
+    if (!ok) sysconf_failed = true;
+}
+
+
 void sysconf_process(void)
 {
+    bool retry = false;
+
+    if (sysconf_failed) {
+        // The write fails verification if sysconf was modified while it was
+        // being written. In that case, sysconf_modified is set again anyway.
+        log_error("Error while writing system configuration to NVM");
+        sysconf_failed = false;
+        sysconf_modified = true;
+        retry = true;
+    }
+
+    // Persist the EEPROM wear counters at most once per NVM_WEAR_PERIOD. Not
+    // TimerGetElapsedTime, which reports no time elapsed since 0, i.e., since
+    // a boot that did not save the counters.
+    if (wear_dirty && TimerGetCurrentTime() - wear_saved_at >= NVM_WEAR_PERIOD)
+        sysconf_modified = true;
+
     if (!sysconf_modified) return;
 
-    if (update_block_crc(&sysconf, sizeof(sysconf))) {
+    // Wait for the write in progress to complete. Its completion will wake the
+    // main loop up.
+    if (part_busy()) return;
+
+    snapshot_wear(sysconf.nvm_wear);
+
+    if (update_block_crc(&sysconf, sizeof(sysconf)) || retry) {
         log_debug("Saving system configuration to NVM");
-        if (!part_write(&nvm_parts.sysconf, 0, &sysconf, sizeof(sysconf)))
+        if (!part_mirror_write_async(&nvm_parts.sysconf, &sysconf, sizeof(sysconf), sysconf_written))
             log_error("Error while writing system configuration to NVM");
     }
 
     sysconf_modified = false;
 }
-
-
-void nvm_update_user_data(void)
-{
-    if (update_block_crc(&user_nvm, sizeof(user_nvm))) {
-        log_debug("Saving user data to NVM");
-        if (!part_write(&nvm_parts.user, 0, &user_nvm, sizeof(user_nvm)))
-            log_error("Error while writing user data to NVM");
-    }
-}
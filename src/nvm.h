@@ -3,6 +3,10 @@
 
 #include "part.h"
 
+// The number of EEPROM wear counters kept in sysconf: one per NVM part plus one
+// for the part table, with room to spare for parts added in the future
+#define NVM_WEAR_SLOTS 12
+
 
 /* The sysconf data structure is meant to be used for platform configuration
  * (UART parameters, etc.) and for configuration that cannot be stored
@@ -50,6 +54,30 @@ typedef struct sysconf
      */
     uint8_t lock_keys : 1;
 
+    /* When this flag is set to 1, the number of transmissions of each uplink
+     * message is adjusted based on the link quality observed on the current
+     * data rate. The link quality is estimated from confirmed uplinks. The
+     * configured number of retransmissions (AT+REP, AT+RTYNUM) then serves as
+     * the upper bound.
+     */
+    uint8_t adaptive_nbtrans : 1;
+
+    /* When this flag is set to 1, the modem automatically sends an empty
+     * uplink whenever the network indicates that it has more downlink data
+     * pending (FPending) or expects an uplink. This allows a class A device to
+     * drain the network server's queue without waiting for the next uplink
+     * from the application. Duty cycle restrictions are respected.
+     */
+    uint8_t drain_downlinks : 1;
+
+    /* When this flag is set to 1, the MCU keeps running from the HSI16
+     * oscillator after waking up from Stop mode and only switches to the PLL
+     * (32 MHz) once CPU-intensive work is pending, e.g., LoRaMac processing.
+     * Wake-ups that only move a few bytes between peripherals then avoid the
+     * PLL lock time and power. This flag occupies a previously unused bit.
+     */
+    uint8_t fast_wake : 1;
+
     /* The maximum number of retransmissions of unconfirmed uplink messages.
      * Receiving a downlink message from the network stops retransmissions.
      */
@@ -60,6 +88,20 @@ typedef struct sysconf
      */
     uint8_t confirmed_retransmissions;
 
+    /* The clock scaling policy applied while the MCU sleeps because Stop mode
+     * is prevented by a subsystem (see system_clock_scaling_t). The field
+     * occupies what used to be padding before nvm_wear.
+     */
+    uint8_t clock_scaling;
+
+    /* The number of EEPROM words programmed in each NVM part over the lifetime
+     * of the device (see nvm_get_wear). This is not configuration, but sysconf
+     * is the only place that survives factory reset in a form we can update.
+     * The counters are persisted periodically, so the most recent writes may
+     * be missing after a reset.
+     */
+    uint32_t nvm_wear[NVM_WEAR_SLOTS];
+
     uint32_t crc32;
 } sysconf_t;
 
@@ -73,25 +115,37 @@ struct nvm_parts {
     part_t region1;
     part_t region2;
     part_t classb;
-    part_t user;
+    part_t kv;
+    part_t fcnt;
 };
 
 
-#define USER_NVM_MAX_SIZE 64   // The maximum number of NVM user data registers
-#define USER_NVM_MAGIC    0xD15C9101
+// The number of NVM user data registers (AT$NVM). Register n is kept in the
+// key-value store under key n.
+#define USER_NVM_MAX_SIZE 64
+
+
+typedef struct nvm_commit_stats {
+    uint32_t commits;    // Commit passes started
+    uint32_t writes;     // LoRaMac state groups written
+    uint32_t coalesced;  // Changes merged into an already pending write
+    uint32_t deferred;   // Passes postponed because of upcoming radio activity
+    uint32_t forced;     // Postponed passes started once NVM_MAX_DEFER expired
+} nvm_commit_stats_t;
 
-typedef struct user_nvm_s {
-    uint32_t    magic;
-    uint8_t     values[USER_NVM_MAX_SIZE];
-    uint32_t    crc32;
-} user_nvm_t;
+
+typedef struct nvm_wear {
+    const char *label;  // Part label, "table" for the part table
+    uint32_t size;      // Part size in bytes
+    uint32_t words;     // Words programmed over the lifetime of the device
+} nvm_wear_t;
 
 
 extern struct nvm_parts nvm_parts;
 extern sysconf_t sysconf;
 extern bool sysconf_modified;
 extern uint16_t nvm_flags;
-extern user_nvm_t user_nvm;
+extern nvm_commit_stats_t nvm_commit_stats;
 
 void nvm_init(void);
 
@@ -99,6 +153,21 @@ int nvm_erase(void);
 
 void sysconf_process(void);
 
-void nvm_update_user_data(void);
+// Return the value of the NVM user data register with the given index. Unset
+// registers read as 0.
+uint8_t nvm_get_user_data(unsigned int index);
+
+// Set the NVM user data register with the given index, 0 clears the register.
+// Returns zero on success or a negative KV_ERR_* value on error.
+int nvm_set_user_data(unsigned int index, uint8_t value);
+
+// Return the EEPROM wear counter for the part with the given index. The last
+// index refers to the part table. Returns false if the index is out of range.
+bool nvm_get_wear(unsigned int index, nvm_wear_t *wear);
+
+// Write the current wear counters into the (freshly erased) sysconf part along
+// with default system configuration. Used by factory reset to carry the
+// counters over.
+void nvm_preserve_wear(void);
 
 #endif // _NVM_H_
@@ -1,13 +1,29 @@
 #include "part.h"
 #include <string.h>
+#include <LoRaWAN/Utilities/utilities.h>
 #include "log.h"
+#include "utils.h"
 
-#define PART_BLOCK_SIGNATURE ((uint32_t)0x1ABE11ED)
+// Partition tables without a layout version used a different signature. They
+// are still recognized, their version is reported as 0.
+#define PART_BLOCK_SIGNATURE_V0 ((uint32_t)0x1ABE11ED)
+#define PART_BLOCK_SIGNATURE    ((uint32_t)0x1ABE11EE)
+
+// The maximum number of parts part_migrate_block can handle. The migration
+// plan is kept on the stack.
+#define MAX_MIGRATE_PARTS 16
+
+// The size of the stack buffer used to move data within a block
+#define MOVE_CHUNK 32
 
 #define EMPTY 0xffffffff
 
 #define MAX_PARTS(t) (((t)->size - FIXED_PART_TABLE_SIZE) / sizeof(part_dsc_t))
 
+// The number of part descriptors that can be safely accessed. The number of
+// parts of a table left behind by an interrupted migration may be torn.
+#define NUM_PARTS(t) ((t)->num_parts < MAX_PARTS(t) ? (t)->num_parts : MAX_PARTS(t))
+
 #define BLOCK_CLOSED(b) ((b) == NULL || (b)->table == NULL || (b)->parts == NULL)
 
 
@@ -23,7 +39,7 @@ int part_erase_block(part_block_t *block)
 
     int rv = 1;
     part_t p;
-    for (unsigned int i = 0; i < block->table->num_parts; i++) {
+    for (unsigned int i = 0; i < NUM_PARTS(block->table); i++) {
         p.block = block;
         p.dsc = block->parts + i;
         rv &= part_erase(&p);
@@ -34,7 +50,7 @@ int part_erase_block(part_block_t *block)
 }
 
 
-int part_format_block(part_block_t *block, unsigned int max_parts)
+int part_format_block(part_block_t *block, unsigned int max_parts, uint8_t version)
 {
     if (!BLOCK_CLOSED(block)) return -1;
 
@@ -43,17 +59,17 @@ int part_format_block(part_block_t *block, unsigned int max_parts)
     const part_table_t *t = block->mmap(block->start, sizeof(*t));
     if (t == NULL) return -3;
 
-    if (t->signature == PART_BLOCK_SIGNATURE)
+    if (t->signature == PART_BLOCK_SIGNATURE || t->signature == PART_BLOCK_SIGNATURE_V0)
         return -4; // The memory segment appears to contain a partition table already
 
-    part_table_t nt = {
-        .signature = PART_BLOCK_SIGNATURE,
-        .size = FIXED_PART_TABLE_SIZE + sizeof(part_dsc_t) * max_parts,
-        .num_parts = 0
-    };
+    part_table_t nt;
+    memset(&nt, 0, sizeof(nt));
+    nt.signature = PART_BLOCK_SIGNATURE;
+    nt.size = FIXED_PART_TABLE_SIZE + sizeof(part_dsc_t) * max_parts;
+    nt.version = version;
 
-    log_debug("part: Formatting block %p (%d B), max parts: %d",
-        (void *)block, block->size, MAX_PARTS(&nt));
+    log_debug("part: Formatting block %p (%d B), max parts: %d, version: %d",
+        (void *)block, block->size, MAX_PARTS(&nt), version);
 
     if (!block->write(block->start, &nt, sizeof(nt))) return -5;
     return 0;
@@ -70,7 +86,7 @@ int part_open_block(part_block_t *block)
     if (t == NULL) return -3;
 
     // The partition table must have a known signature
-    if (t->signature != PART_BLOCK_SIGNATURE)
+    if (t->signature != PART_BLOCK_SIGNATURE && t->signature != PART_BLOCK_SIGNATURE_V0)
         return -4; // Unrecognized partition table
 
     // Make sure the block is large enough to fit at least the fixed portion of
@@ -83,7 +99,7 @@ int part_open_block(part_block_t *block)
     t = block->mmap(block->start, t->size);
     if (t == NULL) return -6;
 
-    if (t->num_parts > MAX_PARTS(t))
+    if (t->num_parts > MAX_PARTS(t) && t->version != PART_VERSION_MIGRATING)
         return -6; // The partition table appears to be corrupted
 
     block->table = (part_table_t *)t;
@@ -105,6 +121,15 @@ void part_close_block(part_block_t *block)
 }
 
 
+int part_block_version(const part_block_t *block)
+{
+    if (BLOCK_CLOSED(block)) return -1;
+    if (block->table->version == PART_VERSION_MIGRATING) return PART_VERSION_MIGRATING;
+    if (block->table->signature == PART_BLOCK_SIGNATURE_V0) return 0;
+    return block->table->version;
+}
+
+
 int part_find(part_t *part, const part_block_t *block, const char *label)
 {
     if (BLOCK_CLOSED(block)) return -1;
@@ -114,7 +139,7 @@ int part_find(part_t *part, const part_block_t *block, const char *label)
     size_t len = strlen(label);
     if (len >= MAX_LABEL_SIZE) return -3;
 
-    for (int i = 0; i < block->table->num_parts; i++) {
+    for (unsigned int i = 0; i < NUM_PARTS(block->table); i++) {
         if (memcmp(block->parts[i].label, label, len)) continue;
         part->block = block;
         part->dsc = block->parts + i;
@@ -189,7 +214,7 @@ int part_dump_block(part_block_t *block)
     log_debug("part: Block %p (%d B), %d parts of %d", (void *)block, block->size,
         block->table->num_parts, MAX_PARTS(block->table));
 
-    for (int i = 0; i < block->table->num_parts; i++) {
+    for (unsigned int i = 0; i < NUM_PARTS(block->table); i++) {
         log_debug("part:   Part '%s' at offset %ld (%ld B)", block->parts[i].label,
             block->parts[i].start, block->parts[i].size);
     }
@@ -207,6 +232,270 @@ bool part_write(const part_t *part, uint32_t address, const void *buffer, size_t
 }
 
 
+// Write only the aligned words of buffer that differ from the data found at
+// the given absolute address in the block. Returns the number of bytes written,
+// or -1 on error.
+static int sync_range(const part_block_t *block, uint32_t address, const void *buffer, size_t length)
+{
+    const uint8_t *src = buffer, *dst;
+    size_t i, start, end, written = 0;
+
+    dst = block->mmap(address, length);
+    if (dst == NULL) return -1;
+
+    // Scan the persisted image in aligned words and write only runs of words
+    // that differ from the buffer. Partitions are word-aligned, so word
+    // boundaries here match the EEPROM word boundaries as long as the caller
+    // passes an aligned address.
+    i = 0;
+    while (i < length) {
+        size_t n = length - i < PART_ALIGNMENT ? length - i : PART_ALIGNMENT;
+        if (!memcmp(src + i, dst + i, n)) {
+            i += n;
+            continue;
+        }
+
+        start = i;
+        end = i + n;
+        i = end;
+
+        // Extend the run over all following words that differ too
+        while (i < length) {
+            n = length - i < PART_ALIGNMENT ? length - i : PART_ALIGNMENT;
+            if (!memcmp(src + i, dst + i, n)) break;
+            i += n;
+            end = i;
+        }
+
+        if (!block->write(address + start, src + start, end - start))
+            return -1;
+        written += end - start;
+    }
+
+    return written;
+}
+
+
+bool part_sync(const part_t *part, uint32_t address, const void *buffer, size_t length)
+{
+    if (part == NULL || BLOCK_CLOSED(part->block)) return false;
+
+    if (address + length > part->dsc->size) return false;
+
+    int written = sync_range(part->block, part->dsc->start + address, buffer, length);
+    if (written < 0) return false;
+
+    if (written)
+        log_debug("part: Synced %d of %d B in part %s", written, length, part->dsc->label);
+    return true;
+}
+
+
+// Find the newest valid copy in a mirrored partition. Returns the index of the
+// copy (0 or 1), or -1 if there is none. The size of a single copy including
+// its trailer is returned in half.
+static int newest_copy(const part_t *part, size_t *half, uint32_t *seq)
+{
+    const uint8_t *p;
+    const part_trailer_t *t[2];
+    bool valid[2];
+
+    *half = part->dsc->size / 2;
+    if (*half <= sizeof(part_trailer_t)) return -1;
+
+    p = part->block->mmap(part->dsc->start, part->dsc->size);
+    if (p == NULL) return -1;
+
+    for (int i = 0; i < 2; i++) {
+        t[i] = (const part_trailer_t *)(p + (i + 1) * *half - sizeof(part_trailer_t));
+        valid[i] = check_block_crc(p + i * *half, *half);
+    }
+
+    if (!valid[0] && !valid[1]) return -1;
+
+    // Compare sequence numbers using serial number arithmetic so that the
+    // counter can safely wrap around.
+    int i;
+    if (valid[0] && valid[1])
+        i = (int32_t)(t[1]->seq - t[0]->seq) > 0 ? 1 : 0;
+    else
+        i = valid[0] ? 0 : 1;
+
+    if (seq) *seq = t[i]->seq;
+    return i;
+}
+
+
+bool part_mirror_write(const part_t *part, const void *buffer, size_t length)
+{
+    const uint8_t *copy;
+    part_trailer_t trailer;
+    size_t half;
+    uint32_t seq = 0, start;
+
+    if (part == NULL || BLOCK_CLOSED(part->block)) return false;
+
+    int active = newest_copy(part, &half, &seq);
+    if (length > half - sizeof(part_trailer_t)) return false;
+
+    // Always write into the copy that is not active
+    start = part->dsc->start + (active == 0 ? half : 0);
+
+    // The inactive copy holds the data from two writes back, which still tends
+    // to share most of its words with the new data. Only write the difference.
+    int written = sync_range(part->block, start, buffer, length);
+    if (written < 0) return false;
+
+    copy = part->block->mmap(start, half);
+    if (copy == NULL) return false;
+
+    trailer.seq = seq + 1;
+    uint32_t s = Crc32Init();
+    s = Crc32Update(s, (uint8_t *)copy, half - sizeof(trailer));
+    s = Crc32Update(s, (uint8_t *)&trailer.seq, sizeof(trailer.seq));
+    trailer.crc32 = Crc32Finalize(s);
+
+    // Writing the trailer makes the new copy active
+    if (!part->block->write(start + half - sizeof(trailer), &trailer, sizeof(trailer)))
+        return false;
+
+    log_debug("part: Wrote copy %d of part %s (seq %ld, %d of %d B)",
+        active == 0 ? 1 : 0, part->dsc->label, trailer.seq, written, length);
+    return true;
+}
+
+
+static struct {
+    volatile bool busy;
+    const part_block_t *block;
+    uint32_t start;
+    size_t size;
+    part_trailer_t trailer;
+    void (*callback)(bool ok);
+} async;
+
+
+static void async_done(bool ok)
+{
+    async.busy = false;
+    if (async.callback) async.callback(ok);
+}
+
+
+static void async_data_written(bool ok)
+{
+    const uint8_t *copy;
+    uint32_t s;
+
+    // Only make the new copy active if all of its data made it into the
+    // block intact.
+    if (!ok) goto error;
+
+    // Calculate the checksum over the copy as written rather than over the
+    // caller's buffer. The buffer may have changed before some of its words
+    // were written, the trailer must match what the block actually holds.
+    copy = async.block->mmap(async.start, async.size);
+    if (copy == NULL) goto error;
+
+    s = Crc32Init();
+    s = Crc32Update(s, (uint8_t *)copy, async.size);
+    s = Crc32Update(s, (uint8_t *)&async.trailer.seq, sizeof(async.trailer.seq));
+    async.trailer.crc32 = Crc32Finalize(s);
+
+    if (async.block->write_async(async.start + async.size, &async.trailer,
+        sizeof(async.trailer), async_done))
+        return;
+
+error:
+
+    async_done(false);
+}
+
+
+bool part_mirror_write_async(const part_t *part, const void *buffer, size_t length, void (*callback)(bool ok))
+{
+    size_t half;
+    uint32_t seq = 0, start;
+
+    if (part == NULL || BLOCK_CLOSED(part->block)) return false;
+
+    if (part->block->write_async == NULL) {
+        bool ok = part_mirror_write(part, buffer, length);
+        if (callback) callback(ok);
+        return ok;
+    }
+
+    if (async.busy) return false;
+
+    int active = newest_copy(part, &half, &seq);
+    if (length > half - sizeof(part_trailer_t)) return false;
+
+    start = part->dsc->start + (active == 0 ? half : 0);
+
+    async.trailer.seq = seq + 1;
+    async.block = part->block;
+    async.start = start;
+    async.size = half - sizeof(part_trailer_t);
+    async.callback = callback;
+    async.busy = true;
+
+    if (!part->block->write_async(start, buffer, length, async_data_written)) {
+        async.busy = false;
+        return false;
+    }
+
+    log_debug("part: Writing copy %d of part %s (seq %ld) in background",
+        active == 0 ? 1 : 0, part->dsc->label, async.trailer.seq);
+    return true;
+}
+
+
+bool part_sync_async(const part_t *part, uint32_t address, const void *buffer, size_t length, void (*callback)(bool ok))
+{
+    if (part == NULL || BLOCK_CLOSED(part->block)) return false;
+    if (address + length > part->dsc->size) return false;
+
+    if (part->block->write_async == NULL) {
+        bool ok = part_sync(part, address, buffer, length);
+        if (callback) callback(ok);
+        return ok;
+    }
+
+    if (async.busy) return false;
+
+    async.callback = callback;
+    async.busy = true;
+
+    if (!part->block->write_async(part->dsc->start + address, buffer, length, async_done)) {
+        async.busy = false;
+        return false;
+    }
+
+    log_debug("part: Syncing part %s in background", part->dsc->label);
+    return true;
+}
+
+
+bool part_busy(void)
+{
+    return async.busy;
+}
+
+
+const void *part_mirror_mmap(size_t *size, const part_t *part)
+{
+    size_t half;
+
+    if (part == NULL || BLOCK_CLOSED(part->block)) return NULL;
+
+    int active = newest_copy(part, &half, NULL);
+    if (active < 0) return NULL;
+
+    *size = half - sizeof(part_trailer_t);
+    return part->block->mmap(part->dsc->start + active * half, *size);
+}
+
+
 bool part_erase(const part_t *part)
 {
     int rv = 1;
@@ -231,3 +520,217 @@ const void *part_mmap(size_t *size, const part_t *part)
     *size = part->dsc->size;
     return part->block->mmap(part->dsc->start, part->dsc->size);
 }
+
+
+typedef struct move {
+    uint32_t src;    // Offset of the data in the old layout
+    uint32_t dst;    // Offset of the part in the new layout
+    uint32_t len;    // Number of bytes to preserve
+    uint32_t size;   // Size of the part in the new layout
+    bool done;
+} move_t;
+
+
+static bool overlaps(uint32_t a, uint32_t alen, uint32_t b, uint32_t blen)
+{
+    return alen && blen && a < b + blen && b < a + alen;
+}
+
+
+// Like memmove, but within a block. The source and destination ranges may
+// overlap. Words that already have the right value are not written.
+static bool move_range(const part_block_t *block, uint32_t dst, uint32_t src, uint32_t len)
+{
+    uint8_t buf[MOVE_CHUNK];
+    const uint8_t *p;
+    uint32_t off, n;
+
+    if (dst == src || len == 0) return true;
+
+    for (uint32_t done = 0; done < len; done += n) {
+        n = len - done > sizeof(buf) ? sizeof(buf) : len - done;
+
+        // Copy towards the destination starting from the end of the range that
+        // is closer to it so that no source byte is overwritten before it has
+        // been copied.
+        off = dst < src ? done : len - done - n;
+
+        p = block->mmap(block->start + src + off, n);
+        if (p == NULL) return false;
+        memcpy(buf, p, n);
+        if (sync_range(block, block->start + dst + off, buf, n) < 0) return false;
+    }
+    return true;
+}
+
+
+static bool erase_range(const part_block_t *block, uint32_t address, uint32_t len)
+{
+    uint32_t v = EMPTY;
+    uint32_t n;
+
+    for (uint32_t i = 0; i < len; i += n) {
+        n = len - i >= sizeof(v) ? sizeof(v) : len - i;
+        if (sync_range(block, block->start + address + i, &v, n) < 0) return false;
+    }
+    return true;
+}
+
+
+static const part_dsc_t *find_dsc(const part_dsc_t *parts, unsigned int n, const char *label)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        if (!strncmp(parts[i].label, label, MAX_LABEL_SIZE)) return parts + i;
+    }
+    return NULL;
+}
+
+
+// Write a single field of the part table header. Fields are written one by one
+// so that a power loss can only tear the field being written.
+static bool write_header(const part_block_t *block, size_t offset, const void *value, size_t length)
+{
+    return block->write(block->start + offset, value, length);
+}
+
+
+int part_migrate_block(part_block_t *block, const part_layout_t *layout,
+    unsigned int num_parts, unsigned int max_parts, uint8_t version)
+{
+    part_dsc_t old[MAX_MIGRATE_PARTS];
+    move_t move[MAX_MIGRATE_PARTS];
+    const part_dsc_t *d;
+    unsigned int old_parts, i, j;
+    uint32_t start;
+    bool progress;
+
+    if (BLOCK_CLOSED(block)) return -1;
+    if (block->write == NULL || layout == NULL) return -2;
+    if (num_parts > max_parts || max_parts > MAX_MIGRATE_PARTS) return -3;
+    if (version == PART_VERSION_MIGRATING) return -3;
+
+    // A previous migration was interrupted after all the data had been moved.
+    // The data is in place already, only the part table remains to be
+    // rewritten.
+    bool resume = part_block_version(block) == PART_VERSION_MIGRATING;
+
+    old_parts = resume ? 0 : block->table->num_parts;
+    if (old_parts > MAX_MIGRATE_PARTS) return -3;
+
+    // Make a copy of the old part descriptors. The part table may get
+    // overwritten by part data if the new table is smaller.
+    memcpy(old, block->parts, old_parts * sizeof(part_dsc_t));
+
+    // Plan the new layout. Parts are placed one after another in the order
+    // given, just like part_create would have done.
+    start = PART_ALIGN(FIXED_PART_TABLE_SIZE + sizeof(part_dsc_t) * max_parts);
+    bool same = !resume && part_block_version(block) == version &&
+        MAX_PARTS(block->table) == max_parts && old_parts == num_parts;
+
+    for (i = 0; i < num_parts; i++) {
+        if (strlen(layout[i].label) >= MAX_LABEL_SIZE) return -4;
+
+        move[i].dst = start;
+        move[i].size = layout[i].size;
+        move[i].done = resume;
+
+        d = find_dsc(old, old_parts, layout[i].label);
+        if (resume) {
+            move[i].src = start;
+            move[i].len = layout[i].size;
+        } else if (d) {
+            move[i].src = d->start;
+            move[i].len = d->size < layout[i].size ? d->size : layout[i].size;
+        } else {
+            move[i].src = move[i].len = 0;
+        }
+
+        if (d != old + i || d->start != start || d->size != layout[i].size)
+            same = false;
+
+        start = PART_ALIGN(start + layout[i].size);
+    }
+
+    if (same) return 0;
+    if (start > block->size) return -5;
+
+    log_debug("part: Migrating block %p to version %d (%d parts)",
+        (void *)block, version, num_parts);
+
+    // Move the data of all parts. A part can only be moved once its
+    // destination no longer overlaps the source of any other part still
+    // waiting to be moved. Since parts keep their relative order, there always
+    // is at least one such part. The old part table remains in effect until
+    // all data has been moved. If the migration gets interrupted, it starts
+    // over on the next boot. That only works if no data is copied over the
+    // data of a part in the old layout, the part itself included, which is up
+    // to the layouts chosen by the application.
+    do {
+        progress = false;
+        for (i = 0; i < num_parts; i++) {
+            if (move[i].done) continue;
+
+            for (j = 0; j < num_parts; j++) {
+                if (j == i || move[j].done) continue;
+                if (overlaps(move[i].dst, move[i].len, move[j].src, move[j].len)) break;
+            }
+            if (j < num_parts) continue;
+
+            if (!move_range(block, move[i].dst, move[i].src, move[i].len)) return -6;
+            move[i].done = true;
+            progress = true;
+        }
+    } while (progress);
+
+    for (i = 0; i < num_parts; i++)
+        if (!move[i].done) return -7;
+
+    // Mark the migration as committed. The version is written on its own, so a
+    // power loss leaves either the old version, which restarts the migration,
+    // or a value that differs from it. With any value but
+    // PART_VERSION_MIGRATING, the old part table is still complete and the
+    // migration starts over as well.
+    uint8_t v = PART_VERSION_MIGRATING;
+    if (!resume && !write_header(block, offsetof(part_table_t, version), &v, sizeof(v)))
+        return -6;
+
+    // Rewrite the partition table, descriptors first. A power loss from here on
+    // leaves the version at PART_VERSION_MIGRATING and the table is rewritten
+    // on the next boot.
+    for (i = 0; i < num_parts; i++) {
+        part_dsc_t p;
+        memset(&p, 0, sizeof(p));
+        p.start = move[i].dst;
+        p.size = move[i].size;
+        memcpy(p.label, layout[i].label, strlen(layout[i].label) + 1);
+        if (!block->write(block->start + FIXED_PART_TABLE_SIZE + i * sizeof(part_dsc_t), &p, sizeof(p)))
+            return -6;
+    }
+
+    uint32_t signature = PART_BLOCK_SIGNATURE;
+    size_t size = FIXED_PART_TABLE_SIZE + sizeof(part_dsc_t) * max_parts;
+    uint8_t n = num_parts;
+    if (!write_header(block, offsetof(part_table_t, signature), &signature, sizeof(signature)) ||
+        !write_header(block, offsetof(part_table_t, size), &size, sizeof(size)) ||
+        !write_header(block, offsetof(part_table_t, num_parts), &n, sizeof(n)))
+        return -6;
+
+    // Erase the remainder of each part so that it does not contain leftovers of
+    // other parts that used to be stored there. This has to wait until the old
+    // part table is no longer needed, as the remainder may hold the old data of
+    // another part. A migration resumed on the next boot skips this step.
+    for (i = 0; i < num_parts; i++) {
+        if (!erase_range(block, move[i].dst + move[i].len, move[i].size - move[i].len))
+            return -6;
+    }
+
+    if (!write_header(block, offsetof(part_table_t, version), &version, sizeof(version)))
+        return -6;
+
+    // Re-open the block so that the mmaped table pointers reflect the new
+    // table size.
+    part_close_block(block);
+    if (part_open_block(block) != 0) return -8;
+
+    return 1;
+}
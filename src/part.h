@@ -14,6 +14,14 @@
 #define VARIABLE_PART_TABLE_SIZE(n) ((n) * PART_ALIGN(sizeof(part_dsc_t)))
 #define PART_TABLE_SIZE(n) (FIXED_PART_TABLE_SIZE + VARIABLE_PART_TABLE_SIZE((n)))
 
+// The layout version of a block whose migration has been interrupted after all
+// data had been moved (see part_migrate_block). Applications cannot use it.
+#define PART_VERSION_MIGRATING 0xff
+
+// The size of a mirrored partition that can hold data of n bytes. See
+// part_mirror_write below.
+#define PART_MIRROR_SIZE(n) (2 * (PART_ALIGN(n) + sizeof(part_trailer_t)))
+
 
 typedef struct part_dsc {
     uint32_t start;
@@ -32,9 +40,26 @@ typedef struct part_table {
     uint32_t signature;  // Well known signature of the partition table
     size_t size;         // Size of the partition table including signature and the parts array that follows the partition table
     uint8_t num_parts;   // Number of partitions in the parts array
+    uint8_t version;     // Layout version chosen by the application (see part_migrate_block)
 } part_table_t;
 
 
+// An entry in the list of partitions passed to part_migrate_block
+typedef struct part_layout {
+    const char *label;
+    size_t size;
+} part_layout_t;
+
+
+// Each copy of the data in a mirrored partition is followed by a trailer. The
+// sequence number identifies the most recently written copy. The CRC32
+// checksum is calculated over the copy and the sequence number.
+typedef struct part_trailer {
+    uint32_t seq;
+    uint32_t crc32;
+} part_trailer_t;
+
+
 typedef struct part_block {
     const uint32_t start;       // The first memory address of the partitioned memory block
     const size_t size;          // The size of the partitioned memory block in bytes
@@ -42,21 +67,87 @@ typedef struct part_block {
     const part_dsc_t *parts;    // A mmaped pointer to the partition array
     bool (*write)(uint32_t address, const void *buffer, size_t length);
     const void *(*mmap)(uint32_t address, size_t length);
+    // Optional, starts a write in the background and invokes the callback
+    // (possibly from an interrupt handler) upon completion
+    bool (*write_async)(uint32_t address, const void *buffer, size_t length, void (*callback)(bool ok));
 } part_block_t;
 
 
 int part_erase_block(part_block_t *block);
-int part_format_block(part_block_t *block, unsigned int max_parts);
+int part_format_block(part_block_t *block, unsigned int max_parts, uint8_t version);
 int part_open_block(part_block_t *block);
 void part_close_block(part_block_t *block);
 
+// Return the layout version of an open block. Blocks formatted by firmware that
+// predates versioned partition tables have version 0. PART_VERSION_MIGRATING
+// is returned for a block whose migration must be completed with
+// part_migrate_block before any of its parts can be used.
+int part_block_version(const part_block_t *block);
+
+// Bring the partitions in an open block to the given layout (list of labels and
+// sizes) without losing data. Parts are relocated and resized in place as
+// necessary. Each part keeps the first min(old, new) bytes of its data, the
+// rest of the part is erased. Parts not found in the block are created empty
+// and parts not present in the layout are dropped. The partition table is
+// rewritten with room for max_parts parts and the given version.
+//
+// Returns 0 if the block already had the requested layout, 1 if it has been
+// migrated, and a negative number on error. If the migration gets interrupted,
+// invoke the function with the same arguments again on the next boot. It either
+// starts over from the old part table, which remains in effect until all data
+// has been moved, or only rewrites the part table. Starting over requires that
+// the kept data of each part does not get moved over the kept data of any part
+// in the old layout, including its own. Applications must choose their
+// layouts accordingly. Leftovers of other parts
+// may remain in the rest of a part if the migration was interrupted after the
+// data had been moved.
+int part_migrate_block(part_block_t *block, const part_layout_t *layout,
+    unsigned int num_parts, unsigned int max_parts, uint8_t version);
+
 int part_find(part_t *part, const part_block_t *block, const char *label);
 int part_create(part_t *part, const part_block_t *block, const char *label, size_t size);
 
 bool part_write(const part_t *part, uint32_t address, const void *buffer, size_t length);
+
+// Like part_write, but only writes the words that differ from the data already
+// stored in the partition. Use this for large structures where only a few
+// fields change between writes.
+bool part_sync(const part_t *part, uint32_t address, const void *buffer, size_t length);
 const void *part_mmap(size_t *size, const part_t *part);
 bool part_erase(const part_t *part);
 
+// Mirrored partitions keep two copies of the data (A/B). Each write goes to the
+// copy that is not currently active and only when the write completes is the
+// trailer with the incremented sequence number written. A power loss in the
+// middle of a write thus leaves the previous copy intact. The partition must
+// have been created with PART_MIRROR_SIZE.
+bool part_mirror_write(const part_t *part, const void *buffer, size_t length);
+
+// Like part_mirror_write, but the data is written in the background if the
+// block supports it. The buffer should remain unchanged until the write
+// completes. If a word changes after it has been written, the new copy fails
+// verification and the previous copy remains active. A word changed before it
+// has been written ends up in the new copy; the trailer checksum is calculated
+// over the data actually written, so the copy always matches its trailer. Only
+// one such write can be in progress at a time. The callback (may be NULL) is
+// invoked with the result from the main loop (see eeprom_process).
+bool part_mirror_write_async(const part_t *part, const void *buffer, size_t length, void (*callback)(bool ok));
+
+// Like part_sync, but the data is written in the background if the block
+// supports it. The block's write_async must skip words that already hold the
+// right value. The write is not atomic: a power loss leaves the partition with
+// a mix of old and new data. Shares the restrictions and the single write in
+// progress with part_mirror_write_async.
+bool part_sync_async(const part_t *part, uint32_t address, const void *buffer, size_t length, void (*callback)(bool ok));
+
+// Return true while a write started with part_mirror_write_async or
+// part_sync_async is in progress
+bool part_busy(void);
+
+// Return a pointer to the newest valid copy in a mirrored partition, or NULL if
+// neither copy is valid. The size of a single copy is returned in size.
+const void *part_mirror_mmap(size_t *size, const part_t *part);
+
 int part_dump_block(part_block_t *block);
 
 #endif // _PART_H_
\ No newline at end of file
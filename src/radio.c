@@ -1,5 +1,12 @@
 #include <loramac-node/src/radio/sx1276/sx1276.h>
+#include <LoRaWAN/Utilities/timeServer.h>
 #include "log.h"
+#include "rtc.h"
+#include "rxlog.h"
+
+#ifndef TOA_TABLES
+#define TOA_TABLES 1
+#endif
 
 
 int16_t radio_rssi;
@@ -7,8 +14,13 @@ int8_t radio_snr;
 
 // Below, we replace the RxDone callback given to us by LoRaMac-node with our
 // own version so that we can save the RSSI and SNR if each received packet.
-// The original callback (the one from LoRaMac-node) is kept here.
+// The original callback (the one from LoRaMac-node) is kept here. The TxDone,
+// RxTimeout, and RxError callbacks are wrapped the same way to feed the RX
+// window log (see rxlog.h).
 static void (*OrigRxDone)(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
+static void (*OrigTxDone)(void);
+static void (*OrigRxTimeout)(void);
+static void (*OrigRxError)(void);
 
 #if defined (DEBUG)
 
@@ -145,12 +157,89 @@ static void SetRxConfig(RadioModems_t modem, uint32_t bandwidth, uint32_t datara
     log_finish();
 #endif
 
+    rxlog_config(modem == MODEM_LORA, datarate, symbTimeout, rxContinuous);
+
     SX1276SetRxConfig(modem, bandwidth, datarate, coderate, bandwidthAfc,
         preambleLen, symbTimeout, fixLen, payloadLen, crcOn, freqHopOn,
         hopPeriod, iqInverted, rxContinuous);
 }
 
 
+#if TOA_TABLES
+
+// LoRaMac-node asks the radio for the time on air of every uplink it considers
+// (duty cycle bookkeeping, dwell time and TX feasibility checks). The driver
+// computes the value with a couple of integer divisions each time, which is
+// slow on the M0+ core without a hardware divider. LoRaWAN uplinks always use
+// the same modulation parameters (CR 4/5, 8 symbol preamble, explicit header,
+// CRC on), so we precompute the time on air in milliseconds for each payload
+// length and each SF/BW combination used by the enabled regions. The tables are
+// generated by the compiler from the formula below and live in flash.
+//
+// The formula mirrors SX1276GetTimeOnAir. Bandwidth is the SX1276 LoRa
+// bandwidth index (0: 125 kHz, 1: 250 kHz, 2: 500 kHz).
+
+#define TOA_BW_HZ(bw) ((bw) == 0 ? 125000UL : (bw) == 1 ? 250000UL : 500000UL)
+#define TOA_LDRO(sf, bw) (((bw) == 0 && (sf) >= 11) || ((bw) == 1 && (sf) == 12))
+#define TOA_CEIL_NUM(sf, pl) ((8 * (pl) + 44 - 4 * (sf)) < 0 ? 0 : (8 * (pl) + 44 - 4 * (sf)))
+#define TOA_CEIL_DEN(sf, bw) (4 * ((sf) - (TOA_LDRO(sf, bw) ? 2 : 0)))
+#define TOA_SYMBOLS(sf, bw, pl) \
+    ((TOA_CEIL_NUM(sf, pl) + TOA_CEIL_DEN(sf, bw) - 1) / TOA_CEIL_DEN(sf, bw) * 5 + 8 + 12)
+#define TOA_NUMERATOR(sf, bw, pl) ((4UL * TOA_SYMBOLS(sf, bw, pl) + 1) * (1UL << ((sf) - 2)))
+#define TOA_MS(sf, bw, pl) \
+    ((1000UL * TOA_NUMERATOR(sf, bw, pl) + TOA_BW_HZ(bw) - 1) / TOA_BW_HZ(bw))
+
+#define TOA_4(sf, bw, n)   TOA_MS(sf, bw, n), TOA_MS(sf, bw, n + 1), TOA_MS(sf, bw, n + 2), TOA_MS(sf, bw, n + 3)
+#define TOA_16(sf, bw, n)  TOA_4(sf, bw, n), TOA_4(sf, bw, n + 4), TOA_4(sf, bw, n + 8), TOA_4(sf, bw, n + 12)
+#define TOA_64(sf, bw, n)  TOA_16(sf, bw, n), TOA_16(sf, bw, n + 16), TOA_16(sf, bw, n + 32), TOA_16(sf, bw, n + 48)
+#define TOA_256(sf, bw)    { TOA_64(sf, bw, 0), TOA_64(sf, bw, 64), TOA_64(sf, bw, 128), TOA_64(sf, bw, 192) }
+
+#define TOA_SF7_TO_SF12(bw) { \
+    TOA_256(7, bw), TOA_256(8, bw), TOA_256(9, bw), \
+    TOA_256(10, bw), TOA_256(11, bw), TOA_256(12, bw) }
+
+// SF7-SF12 at 125 kHz are used by all supported regions
+static const uint16_t toa_125khz[6][256] = TOA_SF7_TO_SF12(0);
+
+#if defined(REGION_EU868) || defined(REGION_AS923) || defined(REGION_RU864) || \
+    defined(REGION_CN779) || defined(REGION_EU433)
+#define TOA_HAVE_250KHZ
+static const uint16_t toa_250khz_sf7[256] = TOA_256(7, 1);
+#endif
+
+#if defined(REGION_US915) || defined(REGION_AU915)
+#define TOA_HAVE_500KHZ
+static const uint16_t toa_500khz[6][256] = TOA_SF7_TO_SF12(2);
+#endif
+
+
+static uint32_t TimeOnAir(RadioModems_t modem, uint32_t bandwidth,
+    uint32_t datarate, uint8_t coderate, uint16_t preambleLen, bool fixLen,
+    uint8_t payloadLen, bool crcOn)
+{
+    if (modem == MODEM_LORA && coderate == 1 && preambleLen == 8 && !fixLen
+        && crcOn && datarate >= 7 && datarate <= 12) {
+        switch (bandwidth) {
+            case 0: return toa_125khz[datarate - 7][payloadLen];
+#if defined(TOA_HAVE_250KHZ)
+            case 1: if (datarate == 7) return toa_250khz_sf7[payloadLen]; break;
+#endif
+#if defined(TOA_HAVE_500KHZ)
+            case 2: return toa_500khz[datarate - 7][payloadLen];
+#endif
+            default: break;
+        }
+    }
+
+    // Anything not covered by the tables (FSK, non-standard parameters) is
+    // computed by the driver.
+    return SX1276GetTimeOnAir(modem, bandwidth, datarate, coderate,
+        preambleLen, fixLen, payloadLen, crcOn);
+}
+
+#endif // TOA_TABLES
+
+
 // This is our custom RxDone callback. We save the RSSI and SNR in global static
 // variables so that they could be accessed from the application and delegate to
 // the original callback.
@@ -158,15 +247,58 @@ static void RxDone(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 {
     radio_rssi = rssi;
     radio_snr = snr;
+    rxlog_rx_done(true);
     if (OrigRxDone != NULL) OrigRxDone(payload, size, rssi, snr);
 }
 
 
+static void TxDone(void)
+{
+    rxlog_tx_done();
+    if (OrigTxDone != NULL) OrigTxDone();
+}
+
+
+static void RxTimeout(void)
+{
+    rxlog_rx_done(false);
+    if (OrigRxTimeout != NULL) OrigRxTimeout();
+}
+
+
+// The radio reports a CRC or header error, i.e., a preamble has been received
+static void RxError(void)
+{
+    rxlog_rx_done(true);
+    if (OrigRxError != NULL) OrigRxError();
+}
+
+
+// LoRaMac opens the RX1 and RX2 windows from timer callbacks. The time at which
+// the timer was scheduled to expire is when the window should have been opened.
+// Anything else opens the window right away.
+static void Rx(uint32_t timeout)
+{
+    TimerEvent_t *timer = TimerGetRunning();
+
+    SX1276SetRx(timeout);
+
+    uint32_t now = rtc_get_timer_value();
+    rxlog_rx_start(timer != NULL ? timer->Timestamp : now, now);
+}
+
+
 static void Init(RadioEvents_t *events)
 {
-    // Save the original RxDone callback and replace it with our own version
+    // Save the original callbacks and replace them with our own versions
     OrigRxDone = events->RxDone;
     events->RxDone = RxDone;
+    OrigTxDone = events->TxDone;
+    events->TxDone = TxDone;
+    OrigRxTimeout = events->RxTimeout;
+    events->RxTimeout = RxTimeout;
+    OrigRxError = events->RxError;
+    events->RxError = RxError;
     SX1276Init(events);
 }
 
@@ -182,11 +314,15 @@ const struct Radio_s Radio = {
     .SetRxConfig = SetRxConfig,
     .SetTxConfig = SetTxConfig,
     .CheckRfFrequency = SX1276CheckRfFrequency,
+#if TOA_TABLES
+    .TimeOnAir = TimeOnAir,
+#else
     .TimeOnAir = SX1276GetTimeOnAir,
+#endif
     .Send = SX1276Send,
     .Sleep = SX1276SetSleep,
     .Standby = SX1276SetStby,
-    .Rx = SX1276SetRx,
+    .Rx = Rx,
     .StartCad = SX1276StartCad,
     .SetTxContinuousWave = SX1276SetTxContinuousWave,
     .Rssi = SX1276ReadRssi,
@@ -0,0 +1,103 @@
+#include "rfstats.h"
+#include <string.h>
+#include <loramac-node/src/mac/region/Region.h>
+#include "utils.h"
+
+// The maximum number of data rates across all LoRaWAN regions
+#define MAX_DATARATES 16
+
+// All counters are kept in RAM only and restart from zero after reboot. The
+// 16-bit counters saturate rather than wrap around so that long-running
+// installations do not report misleading small values.
+
+static struct {
+    rfstats_counters_t channel[REGION_NVM_MAX_NB_CHANNELS];
+    rfstats_counters_t datarate[MAX_DATARATES];
+    uint16_t rssi[RFSTATS_HIST_BINS];
+    uint16_t snr[RFSTATS_HIST_BINS];
+} stats;
+
+
+static inline void inc(uint16_t *counter, unsigned int value)
+{
+    uint32_t v = *counter + value;
+    *counter = v > UINT16_MAX ? UINT16_MAX : v;
+}
+
+
+static void update(rfstats_counters_t *c, unsigned int transmissions,
+    uint32_t time_on_air, bool confirmed, bool acked)
+{
+    inc(&c->uplinks, 1);
+    inc(&c->retransmissions, transmissions - 1);
+
+    if (confirmed) {
+        if (acked) inc(&c->acked, 1);
+        else inc(&c->unacked, 1);
+    }
+
+    c->airtime += time_on_air * transmissions;
+}
+
+
+static unsigned int hist_bin(int value, int min, int step)
+{
+    if (value < min) return 0;
+    unsigned int bin = (value - min) / step;
+    return bin >= RFSTATS_HIST_BINS ? RFSTATS_HIST_BINS - 1 : bin;
+}
+
+
+void rfstats_uplink(unsigned int channel, unsigned int datarate,
+    unsigned int transmissions, uint32_t time_on_air, bool confirmed, bool acked)
+{
+    if (transmissions == 0) return;
+
+    // LoRaMac only reports the channel and data rate of the last transmission.
+    // Retransmissions of the same message are accounted to that channel and
+    // data rate too.
+    if (channel < ARRAY_LEN(stats.channel))
+        update(&stats.channel[channel], transmissions, time_on_air, confirmed, acked);
+
+    if (datarate < ARRAY_LEN(stats.datarate))
+        update(&stats.datarate[datarate], transmissions, time_on_air, confirmed, acked);
+}
+
+
+void rfstats_downlink(int16_t rssi, int8_t snr)
+{
+    inc(&stats.rssi[hist_bin(rssi, RFSTATS_RSSI_MIN, RFSTATS_RSSI_STEP)], 1);
+    inc(&stats.snr[hist_bin(snr, RFSTATS_SNR_MIN, RFSTATS_SNR_STEP)], 1);
+}
+
+
+const rfstats_counters_t *rfstats_channel(unsigned int channel)
+{
+    if (channel >= ARRAY_LEN(stats.channel)) return NULL;
+    return &stats.channel[channel];
+}
+
+
+const rfstats_counters_t *rfstats_datarate(unsigned int datarate)
+{
+    if (datarate >= ARRAY_LEN(stats.datarate)) return NULL;
+    return &stats.datarate[datarate];
+}
+
+
+const uint16_t *rfstats_rssi_histogram(void)
+{
+    return stats.rssi;
+}
+
+
+const uint16_t *rfstats_snr_histogram(void)
+{
+    return stats.snr;
+}
+
+
+void rfstats_reset(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
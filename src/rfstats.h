@@ -0,0 +1,61 @@
+#ifndef _RFSTATS_H
+#define _RFSTATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RFSTATS_HIST_BINS 16
+
+// The RSSI histogram covers -140 dBm to -12 dBm in 8 dB bins, the SNR
+// histogram covers -20 dB to +12 dB in 2 dB bins. Values outside of the range
+// are counted in the first or last bin.
+#define RFSTATS_RSSI_MIN  -140
+#define RFSTATS_RSSI_STEP 8
+#define RFSTATS_SNR_MIN   -20
+#define RFSTATS_SNR_STEP  2
+
+typedef struct rfstats_counters {
+    uint16_t uplinks;         // Number of uplink messages
+    uint16_t retransmissions; // Number of transmissions beyond the first one
+    uint16_t acked;           // Confirmed uplinks acknowledged by the network
+    uint16_t unacked;         // Confirmed uplinks that were not acknowledged
+    uint32_t airtime;         // Cumulative time on air in milliseconds
+} rfstats_counters_t;
+
+
+//! @brief Account a completed uplink (all transmissions of one message)
+//! @param[in] channel Index of the channel used by the last transmission
+//! @param[in] datarate Data rate used by the last transmission
+//! @param[in] transmissions Total number of transmissions of the message
+//! @param[in] time_on_air Time on air of a single transmission in milliseconds
+//! @param[in] confirmed True if the message was a confirmed uplink
+//! @param[in] acked True if the network acknowledged a confirmed uplink
+
+void rfstats_uplink(unsigned int channel, unsigned int datarate,
+    unsigned int transmissions, uint32_t time_on_air, bool confirmed, bool acked);
+
+//! @brief Account a received downlink in the RSSI and SNR histograms
+
+void rfstats_downlink(int16_t rssi, int8_t snr);
+
+//! @brief Return counters for the given channel or NULL if out of range
+
+const rfstats_counters_t *rfstats_channel(unsigned int channel);
+
+//! @brief Return counters for the given data rate or NULL if out of range
+
+const rfstats_counters_t *rfstats_datarate(unsigned int datarate);
+
+//! @brief Return the RSSI histogram (RFSTATS_HIST_BINS entries)
+
+const uint16_t *rfstats_rssi_histogram(void);
+
+//! @brief Return the SNR histogram (RFSTATS_HIST_BINS entries)
+
+const uint16_t *rfstats_snr_histogram(void);
+
+//! @brief Reset all counters and histograms to zero
+
+void rfstats_reset(void);
+
+#endif // _RFSTATS_H
@@ -1,11 +1,15 @@
 #include "rtc.h"
 #include <math.h>
 #include <time.h>
+#include <string.h>
 #include <LoRaWAN/Utilities/systime.h>
 #include <LoRaWAN/Utilities/utilities.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_rtc.h>
 #include "system.h"
 #include "irq.h"
+#include "log.h"
+#include "sched.h"
+#include "adc.h"
 
 typedef struct
 {
@@ -20,6 +24,28 @@ typedef struct
 /* MCU Wake Up Time */
 #define MIN_ALARM_DELAY 3 /* in ticks */
 
+/* The Stop mode wake-up latency is tracked as an exponentially weighted moving
+ * average (EWMA) in fixed point with WAKEUP_FRAC_BITS fractional bits. Each new
+ * sample has the weight 1/WAKEUP_EWMA_WEIGHT. The mean absolute deviation of
+ * the samples is tracked the same way. Samples longer than WAKEUP_MAX_SAMPLE
+ * ticks cannot be wake-up latency and are ignored.
+ */
+#define WAKEUP_FRAC_BITS 4
+#define WAKEUP_EWMA_WEIGHT 8
+#define WAKEUP_MAX_SAMPLE 64
+#define WAKEUP_MIN_SAMPLES 8 /* before the calibration is considered valid */
+
+/* Shorter delays are busy-waited, the timer server cannot schedule them */
+#define MIN_SLEEP_DELAY (MIN_ALARM_DELAY + 1) /* in ticks */
+
+/* The MCU temperature is sampled in the background every RTC_TEMP_PERIOD ms
+ * while class B is active, zero disables the sampling (see
+ * rtc_get_temperature).
+ */
+#ifndef RTC_TEMP_PERIOD
+#define RTC_TEMP_PERIOD 60000
+#endif
+
 /* subsecond number of bits */
 #define N_PREDIV_S 10
 
@@ -55,8 +81,8 @@ typedef struct
 #define DIVC(X, N) (((X) + (N)-1) / (N))
 
 static bool rtc_initalized = false;           // Indicates if the RTC is already Initalized or not
-static bool McuWakeUpTimeInitialized = false; // compensates MCU wakeup time
 static int16_t McuWakeUpTimeCal = 0;          // compensates MCU wakeup time
+
 // Number of days in each month on a normal year
 static const uint8_t DaysInMonth[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 // Number of days in each month on a leap year
@@ -66,10 +92,23 @@ static RTC_HandleTypeDef RtcHandle = {0};
 static RTC_AlarmTypeDef RTC_AlarmStructure;
 static RtcTimerContext_t RtcTimerContext;
 
+static uint32_t AlarmTime;       // RTC tick value at which the alarm fires
+static int32_t WakeUpAvg;        // Average wake-up latency (fixed point)
+static int32_t WakeUpDev;        // Mean absolute deviation (fixed point)
+static uint16_t WakeUpSamples;   // Number of latency samples taken
+
+static rtc_delay_stats_t DelayStats;
+
+static TimerEvent_t temp_timer;
+static bool temp_sampling;
+static volatile bool temp_due;
+static float temperature = RTC_TEMP_TURNOVER;  // Most recent sample
+
 static void HW_RTC_SetConfig(void);
 static void rtc_set_alarmConfig(void);
 static void HW_RTC_StartWakeUpAlarm(uint32_t timeoutValue);
 static uint64_t HW_RTC_GetCalendarValue(RTC_DateTypeDef *RTC_DateStruct, RTC_TimeTypeDef *RTC_TimeStruct);
+static void on_temp_timer(void *ctx);
 
 void rtc_init(void)
 {
@@ -78,6 +117,7 @@ void rtc_init(void)
         HW_RTC_SetConfig();
         rtc_set_alarmConfig();
         rtc_set_timer_context();
+        TimerInit(&temp_timer, on_temp_timer);
         rtc_initalized = true;
     }
 }
@@ -125,28 +165,29 @@ void rtc_set_mcu_wake_up_time(void)
 {
     RTC_TimeTypeDef RTC_TimeStruct;
     RTC_DateTypeDef RTC_DateStruct;
+    int32_t sample, err;
 
-    TimerTime_t now, hit;
-    int16_t McuWakeUpTime;
+    // Only wake-ups caused by the alarm can be measured. The alarm interrupt is
+    // still pending since this is invoked with interrupts disabled.
+    if (HAL_NVIC_GetPendingIRQ(RTC_IRQn) != 1) return;
+    if (__HAL_RTC_ALARM_GET_FLAG(&RtcHandle, RTC_FLAG_ALRAF) == RESET) return;
 
-    if ((McuWakeUpTimeInitialized == false) &&
-        (HAL_NVIC_GetPendingIRQ(RTC_IRQn) == 1))
-    {
-        /* warning: works ok if now is below 30 days
-       it is ok since it's done once at first alarm wake-up*/
-        McuWakeUpTimeInitialized = true;
-        now = (uint32_t)HW_RTC_GetCalendarValue(&RTC_DateStruct, &RTC_TimeStruct);
-
-        HAL_RTC_GetAlarm(&RtcHandle, &RTC_AlarmStructure, RTC_ALARM_A, RTC_FORMAT_BIN);
-        hit = RTC_AlarmStructure.AlarmTime.Seconds +
-              60 * (RTC_AlarmStructure.AlarmTime.Minutes +
-                    60 * (RTC_AlarmStructure.AlarmTime.Hours +
-                          24 * (RTC_AlarmStructure.AlarmDateWeekDay)));
-        hit = (hit << N_PREDIV_S) + (PREDIV_S - RTC_AlarmStructure.AlarmTime.SubSeconds);
-
-        McuWakeUpTime = (int16_t)((now - hit));
-        McuWakeUpTimeCal += McuWakeUpTime;
+    uint32_t now = (uint32_t)HW_RTC_GetCalendarValue(&RTC_DateStruct, &RTC_TimeStruct);
+    sample = (int32_t)(now - AlarmTime);
+    if (sample < 0 || sample > WAKEUP_MAX_SAMPLE) return;
+    sample <<= WAKEUP_FRAC_BITS;
+
+    if (WakeUpSamples == 0) {
+        WakeUpAvg = sample;
+        WakeUpDev = sample / 2;
+    } else {
+        err = sample - WakeUpAvg;
+        WakeUpAvg += err / WAKEUP_EWMA_WEIGHT;
+        WakeUpDev += ((err < 0 ? -err : err) - WakeUpDev) / WAKEUP_EWMA_WEIGHT;
     }
+    if (WakeUpSamples < UINT16_MAX) WakeUpSamples++;
+
+    McuWakeUpTimeCal = (WakeUpAvg + (1 << (WAKEUP_FRAC_BITS - 1))) >> WAKEUP_FRAC_BITS;
 }
 
 int16_t rtc_get_mcu_wake_up_time(void)
@@ -154,6 +195,14 @@ int16_t rtc_get_mcu_wake_up_time(void)
     return McuWakeUpTimeCal;
 }
 
+int32_t rtc_get_mcu_wake_up_jitter(void)
+{
+    if (WakeUpSamples < WAKEUP_MIN_SAMPLES) return -1;
+
+    // Round up, a margin derived from this must not be too short
+    return (WakeUpDev + (1 << WAKEUP_FRAC_BITS) - 1) >> WAKEUP_FRAC_BITS;
+}
+
 uint32_t rtc_get_min_timeout(void)
 {
     return (MIN_ALARM_DELAY);
@@ -179,16 +228,21 @@ void rtc_set_alarm(uint32_t timeout)
     uint32_t mask = disable_irq();
 
     /* we don't go in Low Power mode for timeout below MIN_ALARM_DELAY */
-    if ((MIN_ALARM_DELAY + (uint32_t) McuWakeUpTimeCal) < t) {
+    uint32_t jitter = (WakeUpDev + (1 << WAKEUP_FRAC_BITS) - 1) >> WAKEUP_FRAC_BITS;
+    if ((MIN_ALARM_DELAY + (uint32_t) McuWakeUpTimeCal + jitter) < t) {
         system_stop_lock &= ~ SYSTEM_MODULE_RTC;
     } else {
         system_stop_lock |= SYSTEM_MODULE_RTC;
     }
 
+    // Set the alarm early by the time it takes to wake up from Stop. Should a
+    // Stop lock be taken before the MCU goes to sleep, it wakes up too early
+    // and TimerIrqHandler waits for the timer or sets the alarm again.
     if (!system_stop_lock) {
         timeout = timeout - McuWakeUpTimeCal;
     }
 
+    AlarmTime = RtcTimerContext.Rtc_Time + timeout;
     reenable_irq(mask);
     HW_RTC_StartWakeUpAlarm(timeout);
 }
@@ -223,19 +277,79 @@ void rtc_stop_alarm(void)
     __HAL_RTC_ALARM_EXTI_CLEAR_FLAG();
 }
 
+static void on_delay_timer(void *ctx)
+{
+    *(volatile bool *)ctx = true;
+}
+
+/* The delay can only sleep if the RTC interrupt can fire and end it, i.e., not
+ * from an interrupt handler (e.g., a timer callback turning the TCXO on) and
+ * not with interrupts disabled.
+ */
+static bool delay_can_sleep(void)
+{
+    return __get_IPSR() == 0 && __get_PRIMASK() == 0;
+}
+
 void rtc_delay_ms(uint32_t delay)
 {
     TimerTime_t delayValue = 0;
     TimerTime_t timeout = 0;
+    uint32_t asleep = 0;
 
     delayValue = rtc_ms2tick(delay);
-
-    /* Wait delay ms */
     timeout = rtc_get_timer_value();
+
+    if (delayValue >= MIN_SLEEP_DELAY && delay_can_sleep())
+    {
+        /* Let the timer server arm the RTC alarm and idle like the main loop
+         * does. system_idle honors the Sleep and Stop locks and enters Stop
+         * mode only if the alarm is far enough in the future.
+         */
+        volatile bool expired = false;
+        TimerEvent_t timer;
+
+        TimerInit(&timer, on_delay_timer);
+        TimerSetContext(&timer, (void *)&expired);
+        TimerSetValue(&timer, delay);
+        TimerStart(&timer);
+
+        while (!expired)
+        {
+            disable_irq();
+            if (!expired) system_idle();
+            enable_irq();
+        }
+
+        TimerStop(&timer);
+        asleep = rtc_get_timer_value() - timeout;
+        if (asleep > delayValue) asleep = delayValue;
+    }
+
+    /* Wait delay ms, or what remains of it if the alarm was set early to
+     * compensate for the wake-up time */
     while (((rtc_get_timer_value() - timeout)) < delayValue)
     {
         __NOP();
     }
+
+    DelayStats.count++;
+    DelayStats.total += delayValue;
+    DelayStats.asleep += asleep;
+}
+
+void rtc_get_delay_stats(rtc_delay_stats_t *stats)
+{
+    uint32_t mask = disable_irq();
+    *stats = DelayStats;
+    reenable_irq(mask);
+}
+
+void rtc_reset_delay_stats(void)
+{
+    uint32_t mask = disable_irq();
+    memset(&DelayStats, 0, sizeof(DelayStats));
+    reenable_irq(mask);
 }
 
 uint32_t rtc_set_timer_context(void)
@@ -462,10 +576,61 @@ TimerTime_t rtc_temperature_compensation(TimerTime_t period, float temperature)
 }
 
 
+static void on_temp_timer(void *ctx)
+{
+    (void)ctx;
+    temp_due = true;
+    sched_post(SCHED_EVENT_TIMER);
+}
+
+
+void rtc_set_temperature_sampling(bool enabled)
+{
+    if (RTC_TEMP_PERIOD == 0 || enabled == temp_sampling) return;
+    temp_sampling = enabled;
+
+    if (enabled) {
+        // Take the first sample right away
+        temp_due = true;
+        rtc_temperature_process();
+    } else {
+        TimerStop(&temp_timer);
+        temp_due = false;
+    }
+}
+
+
+void rtc_temperature_process(void)
+{
+    if (!temp_sampling || !temp_due) return;
+    temp_due = false;
+
+    TimerSetValue(&temp_timer, RTC_TEMP_PERIOD);
+    TimerStart(&temp_timer);
+
+    float t = adc_get_temperature_celsius();
+    if (t < -40.0f || t > 105.0f) {
+        log_warning("Ignoring implausible temperature sample: %f", t);
+        return;
+    }
+
+    temperature = t;
+    log_debug("rtc: Temperature %f", t);
+}
+
+
+float rtc_get_temperature(void)
+{
+    if (!temp_sampling) return adc_get_temperature_celsius();
+    return temperature;
+}
+
+
 void RTC_IRQHandler(void)
 {
     RTC_HandleTypeDef *hrtc = &RtcHandle;
     system_stop_lock &= ~SYSTEM_MODULE_RTC;
+    sched_post(SCHED_EVENT_TIMER);
 
     /* Clear the EXTI's line Flag for RTC Alarm */
     __HAL_RTC_ALARM_EXTI_CLEAR_FLAG();
@@ -59,21 +59,49 @@ uint32_t rtc_set_timer_context(void);
 
 uint32_t rtc_get_timer_context(void);
 
-//! @brief a delay of delay ms by polling RTC
+//! @brief Cumulative statistics of rtc_delay_ms, all times in ticks
+
+typedef struct rtc_delay_stats {
+    uint32_t count;   // Number of delays
+    uint32_t total;   // Total time spent in delays
+    uint32_t asleep;  // Time spent in Sleep or Stop mode instead of polling
+} rtc_delay_stats_t;
+
+//! @brief a delay of delay ms
+//! @note Delays of a few ticks or more invoked from thread mode with
+//! interrupts enabled sleep until an RTC alarm, in Stop mode unless prevented
+//! by system_stop_lock. Interrupts are serviced during such delays. Shorter
+//! delays and delays invoked from interrupt handlers poll the RTC.
 //! @param delay in ms
 
 void rtc_delay_ms(uint32_t delay);
 
-//! @brief calculates the wake up time between wake up and mcu start
-//! @note resolution in RTC_ALARM_TIME_BASE
+//! @brief Return the cumulative statistics of rtc_delay_ms
+
+void rtc_get_delay_stats(rtc_delay_stats_t *stats);
+
+//! @brief Restart the statistics of rtc_delay_ms from zero
+
+void rtc_reset_delay_stats(void);
+
+//! @brief Measure the time between the RTC alarm and the MCU running again
+//! @note Invoke with interrupts disabled right after waking up from Stop. The
+//! measurement is folded into a running average which is used to set alarms
+//! early, so that the MCU is ready when the timer expires.
 
 void rtc_set_mcu_wake_up_time(void);
 
-//! @brief returns the wake up time in us
+//! @brief returns the average wake up time
 //! @retval wake up time in ticks
 
 int16_t rtc_get_mcu_wake_up_time(void);
 
+//! @brief Return the mean absolute deviation of the wake up time
+//! @retval deviation in ticks (rounded up), -1 until enough wake ups have been
+//! measured
+
+int32_t rtc_get_mcu_wake_up_jitter(void);
+
 //! @brief converts time in ms to time in ticks
 //! @param [IN] time in milliseconds
 //! @retval returns time in timer ticks
@@ -93,6 +121,33 @@ TimerTime_t rtc_tick2ms(uint32_t tick);
 
 TimerTime_t rtc_temperature_compensation(TimerTime_t period, float temperature);
 
+//! @brief Start or stop sampling the MCU temperature in the background
+//!
+//! Only class B needs the temperature, the sampling is enabled while class B
+//! is active. Has no effect if RTC_TEMP_PERIOD is zero. Enabling the sampling
+//! takes the first sample right away, so invoke from the main loop.
+
+void rtc_set_temperature_sampling(bool enabled);
+
+//! @brief Sample the MCU temperature if due
+//!
+//! Invoked from the main loop. While the sampling is enabled, the temperature
+//! is sampled once every RTC_TEMP_PERIOD milliseconds, a timer posts
+//! SCHED_EVENT_TIMER when a new sample is due.
+
+void rtc_temperature_process(void);
+
+//! @brief Return the most recent temperature sample
+//!
+//! LoRaMac uses the temperature to compensate class B beacon and ping slot
+//! timing for the LSE drift (TimerTempCompensation). The background sample
+//! keeps the ADC conversion off that path. While the sampling is disabled,
+//! i.e., outside of class B, the temperature is measured on each call.
+//!
+//! @retval Temperature in degrees Celsius
+
+float rtc_get_temperature(void);
+
 //! @brief Get system time
 //! @param [IN] subSeconds in ms
 //! @retval
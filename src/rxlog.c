@@ -0,0 +1,99 @@
+#include "rxlog.h"
+#include <string.h>
+#include "irq.h"
+
+// The log is updated from the radio interrupt handlers and read from the main
+// loop, hence the reader copies entries out with interrupts disabled.
+
+static struct {
+    rxlog_entry_t entry[RXLOG_SIZE];
+    unsigned int next;   // Index of the slot for the next window
+    unsigned int count;  // Number of valid entries
+    bool open;           // The most recent entry has no result yet
+} rx;
+
+// Configuration received in SetRxConfig, applied to the next window
+static struct {
+    uint8_t datarate;
+    uint16_t symb_timeout;
+    bool continuous;
+} cfg;
+
+// The number of non-continuous windows opened since the last uplink
+static unsigned int windows;
+
+
+void rxlog_config(bool lora, uint32_t datarate, uint16_t symb_timeout, bool continuous)
+{
+    cfg.datarate = lora ? datarate : 0;
+    cfg.symb_timeout = symb_timeout;
+    cfg.continuous = continuous;
+}
+
+
+void rxlog_tx_done(void)
+{
+    windows = 0;
+}
+
+
+void rxlog_rx_start(uint32_t scheduled, uint32_t started)
+{
+    rxlog_entry_t *e = &rx.entry[rx.next];
+
+    e->scheduled = scheduled;
+    e->started = started;
+    e->symb_timeout = cfg.symb_timeout;
+    e->datarate = cfg.datarate;
+    e->result = RXLOG_PENDING;
+
+    if (cfg.continuous) {
+        e->window = RXLOG_WINDOW_RXC;
+    } else {
+        windows++;
+        e->window = windows <= RXLOG_WINDOW_RX2 ? windows : RXLOG_WINDOW_OTHER;
+    }
+
+    rx.next = (rx.next + 1) % RXLOG_SIZE;
+    if (rx.count < RXLOG_SIZE) rx.count++;
+    rx.open = true;
+}
+
+
+void rxlog_rx_done(bool preamble)
+{
+    if (!rx.open) return;
+    rx.open = false;
+
+    unsigned int i = (rx.next + RXLOG_SIZE - 1) % RXLOG_SIZE;
+    rx.entry[i].result = preamble ? RXLOG_PREAMBLE : RXLOG_TIMEOUT;
+}
+
+
+unsigned int rxlog_count(void)
+{
+    return rx.count;
+}
+
+
+bool rxlog_get(unsigned int index, rxlog_entry_t *entry)
+{
+    bool rv = false;
+    uint32_t mask = disable_irq();
+
+    if (index < rx.count) {
+        *entry = rx.entry[(rx.next + RXLOG_SIZE - 1 - index) % RXLOG_SIZE];
+        rv = true;
+    }
+
+    reenable_irq(mask);
+    return rv;
+}
+
+
+void rxlog_reset(void)
+{
+    uint32_t mask = disable_irq();
+    memset(&rx, 0, sizeof(rx));
+    reenable_irq(mask);
+}
@@ -0,0 +1,72 @@
+#ifndef _RXLOG_H
+#define _RXLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A record of the most recent receive windows opened by the radio, kept in a
+// small ring buffer in RAM. For each window we remember when it was supposed
+// to open and when the SX1276 was actually put into receive mode (both in RTC
+// ticks), the symbol timeout it was configured with, and whether a preamble
+// was detected. The data is meant to help with tuning the RX timing error
+// budget (see update_rx_error in lrw.c).
+
+#define RXLOG_SIZE 16
+
+#define RXLOG_WINDOW_OTHER 0  // Not opened by a timer after an uplink
+#define RXLOG_WINDOW_RX1   1
+#define RXLOG_WINDOW_RX2   2
+#define RXLOG_WINDOW_RXC   3  // Continuous (class C) reception
+
+#define RXLOG_PENDING     0  // The window is still open
+#define RXLOG_TIMEOUT     1  // No preamble was detected
+#define RXLOG_PREAMBLE    2  // A preamble was detected (the frame may be bad)
+
+typedef struct rxlog_entry {
+    uint32_t scheduled;     // RTC ticks at which the window was to open
+    uint32_t started;       // RTC ticks at which the radio entered RX mode
+    uint16_t symb_timeout;  // Symbol timeout in symbols
+    uint8_t datarate;       // Spreading factor (LoRa), zero for FSK
+    uint8_t window   : 4;   // One of RXLOG_WINDOW_*
+    uint8_t result   : 4;   // One of RXLOG_PENDING, RXLOG_TIMEOUT, RXLOG_PREAMBLE
+} rxlog_entry_t;
+
+
+//! @brief Remember the receiver configuration for the next window
+//! @param[in] lora True if the window uses the LoRa modem
+//! @param[in] datarate Spreading factor (LoRa) or bitrate (FSK)
+//! @param[in] symb_timeout Symbol timeout configured in the radio
+//! @param[in] continuous True for continuous reception
+
+void rxlog_config(bool lora, uint32_t datarate, uint16_t symb_timeout, bool continuous);
+
+//! @brief Note the end of an uplink, the next two windows are RX1 and RX2
+
+void rxlog_tx_done(void);
+
+//! @brief Record a window that has just been opened
+//! @param[in] scheduled RTC ticks at which the window was to be opened
+//! @param[in] started RTC ticks at which the radio has entered RX mode
+
+void rxlog_rx_start(uint32_t scheduled, uint32_t started);
+
+//! @brief Record the outcome of the most recently opened window
+
+void rxlog_rx_done(bool preamble);
+
+//! @brief Return the number of windows in the log (up to RXLOG_SIZE)
+
+unsigned int rxlog_count(void);
+
+//! @brief Copy an entry from the log
+//! @param[in] index Zero for the most recent window, one for the one before...
+//! @param[out] entry Destination buffer
+//! @return false if there is no such entry
+
+bool rxlog_get(unsigned int index, rxlog_entry_t *entry);
+
+//! @brief Remove all entries from the log
+
+void rxlog_reset(void);
+
+#endif // _RXLOG_H
@@ -0,0 +1,102 @@
+#include "sched.h"
+#include <string.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
+#include "system.h"
+#include "halt.h"
+#include "irq.h"
+
+// The task table and the profiling data are only accessed from the main loop,
+// the event mask is updated from interrupt handlers as well.
+static const sched_task_t *task;
+static unsigned int task_count;
+static sched_stats_t stats[SCHED_MAX_TASKS];
+static volatile unsigned int events;
+
+
+void sched_init(const sched_task_t *tasks, unsigned int count)
+{
+    if (count > SCHED_MAX_TASKS)
+        halt("Too many scheduler tasks");
+
+    task = tasks;
+    task_count = count;
+    memset(stats, 0, sizeof(stats));
+}
+
+
+void sched_post(unsigned int ev)
+{
+    uint32_t mask = disable_irq();
+    events |= ev;
+    reenable_irq(mask);
+}
+
+
+bool sched_pending(void)
+{
+    unsigned int locks = system_sleep_lock;
+
+    if (events) return true;
+    for (unsigned int i = 0; i < task_count; i++)
+        if (task[i].locks & locks) return true;
+    return false;
+}
+
+
+// Run times are measured in HCLK cycles (see system_cycles). The counter wraps
+// after 2^24 cycles, i.e., runs longer than about half a second at 32 MHz are
+// not measured correctly. That is acceptable since no task should block for
+// that long. The conversion uses the clock frequency at the end of the run.
+static void update_stats(sched_stats_t *s, uint32_t cycles)
+{
+    uint32_t us = cycles / (SystemCoreClock / 1000000);
+
+    s->runs++;
+    if (us > s->max_us) s->max_us = us;
+}
+
+
+void sched_run(void)
+{
+    uint32_t mask = disable_irq();
+    unsigned int ev = events;
+    unsigned int locks = system_sleep_lock;
+    events = 0;
+    reenable_irq(mask);
+
+    for (unsigned int i = 0; i < task_count; i++) {
+        const sched_task_t *t = &task[i];
+        if (!(t->events & ev) && !(t->locks & locks)) continue;
+
+        uint32_t start = system_cycles();
+        t->run();
+        update_stats(&stats[i], (system_cycles() - start) & SysTick_LOAD_RELOAD_Msk);
+    }
+}
+
+
+unsigned int sched_task_count(void)
+{
+    return task_count;
+}
+
+
+const char *sched_task_name(unsigned int index)
+{
+    if (index >= task_count) return NULL;
+    return task[index].name;
+}
+
+
+bool sched_get_stats(unsigned int index, sched_stats_t *s)
+{
+    if (index >= task_count) return false;
+    *s = stats[index];
+    return true;
+}
+
+
+void sched_reset_stats(void)
+{
+    memset(stats, 0, sizeof(stats));
+}
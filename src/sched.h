@@ -0,0 +1,78 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A minimal run-to-completion scheduler for the main loop. Interrupt handlers
+// post events with sched_post and the main loop runs only the tasks that have
+// subscribed to at least one of the posted events. Tasks can also be tied to
+// system sleep lock bits. Subsystems use those to ask for another iteration of
+// the main loop, so a task runs whenever one of its lock bits is set as well.
+
+//! @brief Events posted to the scheduler
+typedef enum
+{
+    SCHED_EVENT_UART   = (1 << 0),  // Data received on LPUART1
+    SCHED_EVENT_MAC    = (1 << 1),  // LoRaMac has pending work (radio DIO, MAC timers)
+    SCHED_EVENT_TIMER  = (1 << 2),  // An RTC alarm has fired
+    SCHED_EVENT_NVM    = (1 << 3),  // An NVM write is ready to complete or a commit is due
+    SCHED_EVENT_WAKEUP = (1 << 4)   // The MCU has returned from system_idle
+} sched_event_t;
+
+#define SCHED_MAX_TASKS 8
+
+typedef struct sched_task
+{
+    const char *name;
+    unsigned int events;  // Mask of sched_event_t bits that make the task run
+    unsigned int locks;   // Mask of system_module_t sleep lock bits ditto
+    void (*run)(void);
+} sched_task_t;
+
+//! @brief Per-task profiling data, see sched_get_stats
+typedef struct sched_stats
+{
+    uint32_t runs;    // Number of times the task has been run
+    uint32_t max_us;  // Longest run time in microseconds, Stop mode excluded
+} sched_stats_t;
+
+//! @brief Initialize the scheduler
+//! @param[in] tasks Task table, in the order in which the tasks are run
+//! @param[in] count Number of tasks in the table (up to SCHED_MAX_TASKS)
+
+void sched_init(const sched_task_t *tasks, unsigned int count);
+
+//! @brief Post events, safe to call from interrupt handlers
+//! @param[in] events Mask of sched_event_t bits
+
+void sched_post(unsigned int events);
+
+//! @brief Return true if a subsequent sched_run would run at least one task
+//!
+//! Invoke with interrupts disabled before putting the MCU to sleep.
+
+bool sched_pending(void);
+
+//! @brief Run all tasks with pending events or sleep locks, once each
+
+void sched_run(void);
+
+//! @brief Return the number of tasks in the task table
+
+unsigned int sched_task_count(void);
+
+//! @brief Return the name of a task, or NULL if there is no such task
+
+const char *sched_task_name(unsigned int index);
+
+//! @brief Copy the profiling data of a task
+//! @return false if there is no such task
+
+bool sched_get_stats(unsigned int index, sched_stats_t *stats);
+
+//! @brief Reset the profiling data of all tasks
+
+void sched_reset_stats(void);
+
+#endif // _SCHED_H
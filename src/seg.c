@@ -0,0 +1,251 @@
+#include "seg.h"
+#include <assert.h>
+#include <string.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include <loramac-node/src/mac/LoRaMac.h>
+#include "cmd.h"
+#include "irq.h"
+#include "log.h"
+#include "lrw.h"
+#include "rtc.h"
+#include "system.h"
+
+// The total length is carried in 12 bits of the fragment header
+static_assert(SEGMENT_BUFFER_SIZE <= 4095, "SEGMENT_BUFFER_SIZE too large");
+
+// The largest number of data fragments addressable by the index field
+#define MAX_FRAGMENTS 256
+
+// How long to wait before retrying if LoRaMac refuses the fragment for a
+// transient reason (in milliseconds)
+#define RETRY_DELAY 1000
+
+// Give up if a fragment cannot be sent this many times in a row
+#define MAX_FAILURES 3
+
+
+static struct {
+    uint8_t data[SEGMENT_BUFFER_SIZE];
+    uint16_t length;
+
+    bool active;
+    volatile bool waiting;
+    uint8_t id;
+    uint8_t port;
+    bool confirmed;
+    uint8_t group;
+    uint8_t fragment_size;
+    uint16_t count;
+    uint16_t next;
+    bool parity_due;
+    uint8_t failures;
+} seg;
+
+static TimerEvent_t retry_timer;
+static uint8_t frame[SEG_HEADER_SIZE + UINT8_MAX];
+
+
+static void on_retry_timer(void *ctx)
+{
+    // Invoked in the ISR context. Keep the main loop running so that the next
+    // fragment gets sent from seg_process.
+    (void)ctx;
+    seg.waiting = false;
+    system_sleep_lock |= SYSTEM_MODULE_LORA;
+}
+
+
+static void retry_in(uint32_t delay)
+{
+    seg.waiting = true;
+    TimerSetValue(&retry_timer, delay ? delay : 1);
+    TimerStart(&retry_timer);
+}
+
+
+static void finish(unsigned int status)
+{
+    TimerStop(&retry_timer);
+    seg.active = false;
+    seg.waiting = false;
+    cmd_event(CMD_EVENT_SEGMENT, status);
+}
+
+
+static size_t fragment_length(unsigned int index)
+{
+    size_t offset = index * seg.fragment_size;
+    size_t left = seg.length - offset;
+    return left < seg.fragment_size ? left : seg.fragment_size;
+}
+
+
+static size_t build_fragment(void)
+{
+    unsigned int index;
+    size_t len;
+
+    frame[0] = (seg.id << 4) | seg.group;
+    frame[2] = (seg.length >> 8) & 0x0f;
+    frame[3] = seg.length & 0xff;
+
+    if (seg.parity_due) {
+        // The group that has just been completed
+        index = (seg.next - 1) / seg.group;
+        frame[1] = index;
+        frame[2] |= SEG_FLAG_PARITY;
+
+        memset(frame + SEG_HEADER_SIZE, 0, seg.fragment_size);
+        unsigned int last = (index + 1) * seg.group;
+        if (last > seg.count) last = seg.count;
+
+        for (unsigned int i = index * seg.group; i < last; i++) {
+            const uint8_t *p = seg.data + i * seg.fragment_size;
+            len = fragment_length(i);
+            for (size_t j = 0; j < len; j++)
+                frame[SEG_HEADER_SIZE + j] ^= p[j];
+        }
+        return SEG_HEADER_SIZE + seg.fragment_size;
+    }
+
+    frame[1] = seg.next;
+    len = fragment_length(seg.next);
+    memcpy(frame + SEG_HEADER_SIZE, seg.data + seg.next * seg.fragment_size, len);
+    return SEG_HEADER_SIZE + len;
+}
+
+
+int seg_append(const void *data, size_t length)
+{
+    if (seg.active) return -1;
+    if (length > sizeof(seg.data) - seg.length) return -1;
+
+    memcpy(seg.data + seg.length, data, length);
+    seg.length += length;
+    return 0;
+}
+
+
+void seg_clear(void)
+{
+    if (seg.active) {
+        log_debug("seg: Transfer aborted");
+        finish(CMD_SEGMENT_FAILED);
+    }
+    seg.length = 0;
+}
+
+
+size_t seg_length(void)
+{
+    return seg.length;
+}
+
+
+int seg_start(uint8_t port, bool confirmed, unsigned int group)
+{
+    LoRaMacTxInfo_t txi;
+    LoRaMacStatus_t rc;
+    unsigned int count;
+
+    if (seg.active) return LORAMAC_STATUS_BUSY;
+    if (seg.length == 0) return -1;
+    if (group > SEG_MAX_GROUP) return -1;
+
+    rc = LoRaMacQueryTxPossible(0, &txi);
+    if (rc != LORAMAC_STATUS_OK) return rc;
+
+    if (txi.MaxPossibleApplicationDataSize <= SEG_HEADER_SIZE)
+        return LORAMAC_STATUS_LENGTH_ERROR;
+
+    // Derive the fragment size from the maximum payload size at the current
+    // data rate. If the data rate drops during the transfer, LoRaMac will
+    // refuse the fragments and the transfer fails.
+    size_t size = txi.MaxPossibleApplicationDataSize - SEG_HEADER_SIZE;
+    count = (seg.length + size - 1) / size;
+    if (count > MAX_FRAGMENTS) return LORAMAC_STATUS_LENGTH_ERROR;
+
+    TimerInit(&retry_timer, on_retry_timer);
+
+    seg.id = (seg.id + 1) & 0x0f;
+    seg.port = port;
+    seg.confirmed = confirmed;
+    seg.group = group;
+    seg.fragment_size = size;
+    seg.count = count;
+    seg.next = 0;
+    seg.parity_due = false;
+    seg.failures = 0;
+    seg.waiting = false;
+    seg.active = true;
+
+    log_debug("seg: Sending %d bytes in %d fragments of %d bytes", seg.length,
+        seg.count, seg.fragment_size);
+
+    uint32_t mask = disable_irq();
+    system_sleep_lock |= SYSTEM_MODULE_LORA;
+    reenable_irq(mask);
+    return 0;
+}
+
+
+bool seg_active(void)
+{
+    return seg.active;
+}
+
+
+void seg_progress(unsigned int *sent, unsigned int *total)
+{
+    *sent = seg.next;
+    *total = seg.count;
+}
+
+
+void seg_process(void)
+{
+    LoRaMacStatus_t rc;
+    uint32_t now;
+
+    if (!seg.active || seg.waiting || LoRaMacIsBusy()) return;
+
+    rc = lrw_send(seg.port, frame, build_fragment(), seg.confirmed);
+    switch (rc) {
+        case LORAMAC_STATUS_OK:
+            seg.failures = 0;
+            if (seg.parity_due) {
+                seg.parity_due = false;
+            } else {
+                seg.next++;
+                if (seg.group && (seg.next % seg.group == 0 || seg.next == seg.count))
+                    seg.parity_due = true;
+            }
+
+            if (seg.next == seg.count && !seg.parity_due) {
+                log_debug("seg: All fragments submitted");
+                finish(CMD_SEGMENT_DONE);
+            }
+            break;
+
+        case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+            now = rtc_tick2ms(rtc_get_timer_value());
+            retry_in(lrw_dutycycle_deadline > now ? lrw_dutycycle_deadline - now : 0);
+            break;
+
+        case LORAMAC_STATUS_BUSY:
+            retry_in(RETRY_DELAY);
+            break;
+
+        default:
+            // LORAMAC_STATUS_LENGTH_ERROR is returned when pending MAC commands
+            // did not leave enough space for the fragment. lrw_send flushes the
+            // MAC commands in that case, so it makes sense to try again.
+            if (++seg.failures < MAX_FAILURES) {
+                retry_in(RETRY_DELAY);
+            } else {
+                log_error("seg: Could not send fragment (%d)", rc);
+                finish(CMD_SEGMENT_FAILED);
+            }
+            break;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef _SEG_H
+#define _SEG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef SEGMENT_BUFFER_SIZE
+#define SEGMENT_BUFFER_SIZE 2048
+#endif
+
+// Each fragment starts with a four-byte header:
+//
+//   byte 0: transfer id (bits 7-4), parity group size (bits 3-0, 0 = no parity)
+//   byte 1: data fragment index, or parity group index for parity fragments
+//   byte 2: parity fragment flag (bit 7), total length bits 11-8 (bits 3-0)
+//   byte 3: total length bits 7-0
+//
+// All data fragments except for the last one carry the same number of bytes.
+// A parity fragment carries the XOR of the data fragments in its group, with
+// shorter fragments padded with zeroes, and is sent right after the group.
+#define SEG_HEADER_SIZE  4
+#define SEG_FLAG_PARITY  0x80
+#define SEG_MAX_GROUP    15
+
+//! @brief Append data to the transfer buffer
+//! @retval 0 on success, -1 if the data does not fit or a transfer is active
+
+int seg_append(const void *data, size_t length);
+
+//! @brief Discard the contents of the transfer buffer and stop any transfer
+
+void seg_clear(void);
+
+//! @brief Return the number of bytes in the transfer buffer
+
+size_t seg_length(void);
+
+//! @brief Start sending the transfer buffer in fragments
+//!
+//! The fragment size is fixed for the entire transfer and is derived from the
+//! maximum payload size at the current data rate. The fragments are sent one
+//! by one from seg_process as soon as LoRaMac becomes idle and the duty cycle
+//! allows.
+//!
+//! @param[in] port LoRaWAN port number (1-223)
+//! @param[in] confirmed Send fragments as confirmed uplinks
+//! @param[in] group Add a parity fragment after each group of this many data
+//!                  fragments (0 to disable parity fragments)
+//! @retval 0 on success, a negative value or a @c LoRaMacStatus_t on error
+
+int seg_start(uint8_t port, bool confirmed, unsigned int group);
+
+//! @brief Return true if a transfer is in progress
+
+bool seg_active(void);
+
+//! @brief Return the number of data fragments sent and the total
+
+void seg_progress(unsigned int *sent, unsigned int *total);
+
+//! @brief Send the next fragment if possible. Invoke from the main loop.
+
+void seg_process(void);
+
+#endif // _SEG_H
@@ -1,4 +1,5 @@
 #include "system.h"
+#include <string.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_pwr.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_rcc.h>
@@ -19,6 +20,56 @@
 volatile unsigned system_stop_lock;
 volatile unsigned system_sleep_lock;
 
+#ifndef POWER_RUN_UA
+#define POWER_RUN_UA 5000
+#endif
+
+#ifndef POWER_SLEEP_UA
+#define POWER_SLEEP_UA 1500
+#endif
+
+#ifndef POWER_SLEEP_DIV_UA
+#define POWER_SLEEP_DIV_UA 400
+#endif
+
+#ifndef POWER_SLEEP_HSI_UA
+#define POWER_SLEEP_HSI_UA 250
+#endif
+
+#ifndef POWER_STOP_UA
+#define POWER_STOP_UA 2
+#endif
+
+static const uint32_t power_model[SYSTEM_POWER_MODES] = {
+    [SYSTEM_POWER_RUN]   = POWER_RUN_UA,
+    [SYSTEM_POWER_SLEEP] = POWER_SLEEP_UA,
+    [SYSTEM_POWER_STOP]  = POWER_STOP_UA
+};
+
+// The Sleep mode current with each clock scaling policy
+static const uint32_t sleep_model[SYSTEM_CLOCK_SCALING_POLICIES] = {
+    [SYSTEM_CLOCK_SCALING_OFF] = POWER_SLEEP_UA,
+    [SYSTEM_CLOCK_SCALING_DIV] = POWER_SLEEP_DIV_UA,
+    [SYSTEM_CLOCK_SCALING_HSI] = POWER_SLEEP_HSI_UA
+};
+
+static const char *module_names[SYSTEM_MODULE_COUNT] = {
+    "RTC", "LPUART_RX", "LPUART_TX", "USART", "RADIO", "ATCI", "NVM", "LORA"
+};
+
+static system_power_stats_t power;
+static system_wake_stats_t wake;
+
+// True if SYSCLK runs from HSI16 after a fast wake-up from Stop
+static bool sysclk_hsi;
+
+// The time and the state of the locks at the end of the previous interval
+static struct {
+    uint32_t time;
+    unsigned stop_lock;
+    unsigned sleep_lock;
+} power_mark;
+
 
 uint32_t system_get_random_seed(void)
 {
@@ -45,10 +96,206 @@ void system_wait_hsi(void)
 }
 
 
+// Account the time since the previous invocation to the given power mode and to
+// the locks held at the time of the previous invocation. Sub-tick intervals
+// are accounted as zero or one tick, which averages out since consecutive
+// intervals always add up to the elapsed time. Interrupts must be disabled.
+static uint32_t account_power(system_power_mode_t mode)
+{
+    uint32_t now = rtc_get_timer_value();
+    uint32_t dt = now - power_mark.time;
+
+    power.mode[mode] += dt;
+    for (unsigned int i = 0; i < SYSTEM_MODULE_COUNT; i++) {
+        if (power_mark.stop_lock & (1 << i)) power.stop_lock[i] += dt;
+        if (power_mark.sleep_lock & (1 << i)) power.sleep_lock[i] += dt;
+    }
+
+    power_mark.time = now;
+    power_mark.stop_lock = system_stop_lock;
+    power_mark.sleep_lock = system_sleep_lock;
+    return dt;
+}
+
+
+static void switch_to_pll(void)
+{
+    __HAL_RCC_PLL_ENABLE();
+    while (__HAL_RCC_GET_FLAG(RCC_FLAG_PLLRDY) == RESET) continue;
+
+    __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_PLLCLK);
+    while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_PLLCLK)
+        continue;
+
+    SystemCoreClock = 32000000;
+}
+
+
+// The wake-to-work latency, i.e., the time from leaving Stop mode to having the
+// clocks and peripherals restored, is measured with the SysTick cycle counter
+// (see system_cycles). SysTick counts HCLK cycles, i.e., at 16 MHz until the
+// switch to the PLL and at 32 MHz afterwards. The time needed by the hardware
+// to wake up before the first instruction executes is not included.
+static uint32_t wake_start;
+
+static void start_wake_timer(void)
+{
+    wake_start = system_cycles();
+}
+
+
+static uint32_t wake_timer_cycles(void)
+{
+    return (system_cycles() - wake_start) & SysTick_LOAD_RELOAD_Msk;
+}
+
+
+// hsi_cycles is the number of cycles before the switch to the PLL, or UINT32_MAX
+// if the MCU still runs from HSI16
+static void stop_wake_timer(uint32_t hsi_cycles)
+{
+    uint32_t cycles = wake_timer_cycles();
+
+    wake.wakeups++;
+    if (hsi_cycles == UINT32_MAX) {
+        wake.fast++;
+        wake.latency[1] += (uint64_t)cycles * 125 / 2;
+    } else {
+        wake.latency[0] += (uint64_t)hsi_cycles * 125 / 2 + (uint64_t)(cycles - hsi_cycles) * 125 / 4;
+    }
+}
+
+
+void system_clock_boost(void)
+{
+    if (!sysclk_hsi) return;
+
+    uint32_t mask = disable_irq();
+    if (sysclk_hsi) {
+        switch_to_pll();
+        sysclk_hsi = false;
+        wake.boosts++;
+    }
+    reenable_irq(mask);
+}
+
+
+void system_get_wake_stats(system_wake_stats_t *stats)
+{
+    uint32_t mask = disable_irq();
+    *stats = wake;
+    reenable_irq(mask);
+}
+
+
+void system_get_power_stats(system_power_stats_t *stats)
+{
+    uint32_t mask = disable_irq();
+    account_power(SYSTEM_POWER_RUN);
+    *stats = power;
+    reenable_irq(mask);
+}
+
+
+void system_reset_power_stats(void)
+{
+    uint32_t mask = disable_irq();
+    memset(&power, 0, sizeof(power));
+    memset(&wake, 0, sizeof(wake));
+    power_mark.time = rtc_get_timer_value();
+    reenable_irq(mask);
+}
+
+
+const char *system_module_name(unsigned int index)
+{
+    return index < SYSTEM_MODULE_COUNT ? module_names[index] : NULL;
+}
+
+
+// Compute the average current with the Sleep time charged according to the
+// given policy, or according to the policies actually used if policy is -1
+static uint32_t estimate_current(const system_power_stats_t *stats, int policy)
+{
+    uint64_t total = 0, charge = 0;
+
+    for (int i = 0; i < SYSTEM_POWER_MODES; i++) {
+        total += stats->mode[i];
+        if (i != SYSTEM_POWER_SLEEP) charge += stats->mode[i] * power_model[i];
+    }
+
+    if (policy < 0) {
+        for (int i = 0; i < SYSTEM_CLOCK_SCALING_POLICIES; i++)
+            charge += stats->sleep[i] * sleep_model[i];
+    } else {
+        charge += stats->mode[SYSTEM_POWER_SLEEP] * sleep_model[policy];
+    }
+
+    if (total == 0) return 0;
+    return (charge * 100 + total / 2) / total;
+}
+
+
+uint32_t system_average_current(const system_power_stats_t *stats)
+{
+    return estimate_current(stats, -1);
+}
+
+
+uint32_t system_policy_current(const system_power_stats_t *stats,
+    system_clock_scaling_t policy)
+{
+    if (policy >= SYSTEM_CLOCK_SCALING_POLICIES) return 0;
+    return estimate_current(stats, policy);
+}
+
+
+uint32_t system_saved_charge(uint64_t ticks)
+{
+    return (ticks * (POWER_RUN_UA - POWER_SLEEP_UA) + 512) / 1024;
+}
+
+
+// Lower the system clock before sleeping according to the clock scaling
+// policy. Nothing runs while the MCU sleeps with interrupts disabled, so the
+// clock only needs to be good enough for the peripherals that keep working.
+// LPUART1 and the debug USART take their kernel clock from HSI16 which stays
+// on, so their baud rates are not affected. DMA transfers merely take a few
+// more cycles. MSI is not used: HSI16 has to stay on for LPUART1 anyway, so
+// switching to MSI would only start another oscillator.
+static void scale_clock_down(system_clock_scaling_t policy)
+{
+    if (policy == SYSTEM_CLOCK_SCALING_HSI && !sysclk_hsi) {
+        __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_HSI);
+        while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_HSI)
+            continue;
+        __HAL_RCC_PLL_DISABLE();
+    }
+
+    if (policy != SYSTEM_CLOCK_SCALING_OFF)
+        MODIFY_REG(RCC->CFGR, RCC_CFGR_HPRE, RCC_SYSCLK_DIV16);
+}
+
+
+// Restore the system clock after waking up, before any interrupt handler runs.
+// SPI, ADC, and timing-sensitive code thus always see the full clock.
+static void scale_clock_up(system_clock_scaling_t policy)
+{
+    if (policy == SYSTEM_CLOCK_SCALING_OFF) return;
+
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_HPRE, RCC_SYSCLK_DIV1);
+    if (policy == SYSTEM_CLOCK_SCALING_HSI && !sysclk_hsi) switch_to_pll();
+}
+
+
 // Note: this function must be called with interrupts disabled
 void system_idle(void)
 {
     int pwr_disabled;
+    uint32_t hsi_cycles = UINT32_MAX;
+
+    // The MCU has been running since the previous invocation
+    account_power(SYSTEM_POWER_RUN);
 
     // Do nothing if low-power operation is disabled entirely
     if (!sysconf.sleep) return;
@@ -58,8 +305,15 @@ void system_idle(void)
 
     if (system_stop_lock) {
         // If Stop mode is prevented by a subsystem, enter the low-power sleep
-        // mode only.
+        // mode only. Slow the clock down while sleeping if so configured.
+        system_clock_scaling_t policy = sysconf.clock_scaling;
+        if (policy >= SYSTEM_CLOCK_SCALING_POLICIES) policy = SYSTEM_CLOCK_SCALING_OFF;
+
+        scale_clock_down(policy);
         HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+        scale_clock_up(policy);
+        irq_profile_restart();
+        power.sleep[policy] += account_power(SYSTEM_POWER_SLEEP);
     } else {
         // Enter the low-power Stop mode
 
@@ -69,6 +323,7 @@ void system_idle(void)
         if (pwr_disabled) __HAL_RCC_PWR_CLK_ENABLE();
         SET_BIT(PWR->CR, PWR_CR_CWUF);
         HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+        start_wake_timer();
         if (pwr_disabled) __HAL_RCC_PWR_CLK_DISABLE();
 
         // We configured the MCU to wake up from Stop with HSI16 enabled, thus
@@ -76,14 +331,30 @@ void system_idle(void)
         // oscillator here.
         while (__HAL_RCC_GET_FLAG(RCC_FLAG_HSIRDY) == RESET) continue;
 
-        __HAL_RCC_PLL_ENABLE();
-        while (__HAL_RCC_GET_FLAG(RCC_FLAG_PLLRDY) == RESET) continue;
-
-        __HAL_RCC_SYSCLK_CONFIG(RCC_SYSCLKSOURCE_PLLCLK);
-        while (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_PLLCLK)
-            continue;
+        // In the fast wake-up mode, keep running from HSI16 and leave the PLL
+        // off until somebody invokes system_clock_boost. All peripherals that
+        // need a fixed clock (LPUART1, debug USART) are clocked from HSI16
+        // directly, the rest merely runs slower.
+        if (sysconf.fast_wake) {
+            SystemCoreClock = 16000000;
+            sysclk_hsi = true;
+        } else {
+            switch_to_pll();
+            sysclk_hsi = false;
+            hsi_cycles = wake_timer_cycles();
+        }
+        irq_profile_restart();
 
         system_after_stop();
+        stop_wake_timer(hsi_cycles);
+
+        // Timer callbacks run once interrupts are reenabled, i.e., only after
+        // the clock and peripherals have been restored. Measure how late that
+        // is relative to the alarm so that future alarms can be set earlier.
+        rtc_set_mcu_wake_up_time();
+
+        // The time needed to restore the clocks is accounted as Stop time
+        account_power(SYSTEM_POWER_STOP);
     }
 }
 
@@ -335,7 +606,21 @@ void system_init(void)
     init_dbgmcu();
 #endif
     init_clock();
+
+    // SysTick does not generate interrupts in this firmware (see HAL_InitTick),
+    // let it run freely as a cycle counter for system_cycles.
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
     rtc_init();
+    power_mark.time = rtc_get_timer_value();
+}
+
+
+uint32_t system_cycles(void)
+{
+    return SysTick_LOAD_RELOAD_Msk - SysTick->VAL;
 }
 
 
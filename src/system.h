@@ -36,12 +36,111 @@ typedef enum
     SYSTEM_MODULE_LORA      = (1 << 7)
 } system_module_t;
 
+#define SYSTEM_MODULE_COUNT 8
+
+//! @brief Power modes distinguished by the power accounting
+typedef enum
+{
+    SYSTEM_POWER_RUN = 0,
+    SYSTEM_POWER_SLEEP,
+    SYSTEM_POWER_STOP,
+    SYSTEM_POWER_MODES
+} system_power_mode_t;
+
+//! @brief Clock scaling policies applied while the MCU sleeps because Stop
+//! mode is prevented (see sysconf.clock_scaling)
+typedef enum
+{
+    SYSTEM_CLOCK_SCALING_OFF = 0,  // Sleep with the system clock unchanged
+    SYSTEM_CLOCK_SCALING_DIV,      // Divide HCLK by 16, keep the PLL running
+    SYSTEM_CLOCK_SCALING_HSI,      // Run from HSI16 divided by 16, PLL off
+    SYSTEM_CLOCK_SCALING_POLICIES
+} system_clock_scaling_t;
+
+//! @brief Cumulative power accounting, all times in RTC ticks
+//!
+//! The time spent in each power mode is measured in system_idle. The time each
+//! module held a lock is accounted based on the state of the locks at the
+//! beginning of each interval between two system_idle calls, i.e., changes made
+//! while running between two calls are attributed to the next interval.
+typedef struct system_power_stats
+{
+    uint64_t mode[SYSTEM_POWER_MODES];
+    uint64_t sleep[SYSTEM_CLOCK_SCALING_POLICIES];  // Sleep time per policy
+    uint64_t stop_lock[SYSTEM_MODULE_COUNT];
+    uint64_t sleep_lock[SYSTEM_MODULE_COUNT];
+} system_power_stats_t;
+
 
 //! @brief Go to low power, sleep mode or stop mode. The function must be
 //! invoked with interrupts disabled.
 
 void system_idle(void);
 
+//! @brief Wake-up statistics, see system_get_wake_stats
+
+typedef struct system_wake_stats
+{
+    uint32_t wakeups;  // Number of wake-ups from Stop mode
+    uint32_t fast;     // Wake-ups that stayed on HSI16 (sysconf.fast_wake)
+    uint32_t boosts;   // Switches from HSI16 to the PLL after a fast wake-up
+    uint64_t latency[2];  // Total wake-to-work time in ns (normal, fast)
+} system_wake_stats_t;
+
+//! @brief Run the system clock from the PLL (32 MHz)
+//!
+//! After a wake-up from Stop mode with sysconf.fast_wake set, the MCU runs from
+//! HSI16 (16 MHz). Invoke this function before CPU-intensive work. It returns
+//! immediately if the PLL is already in use.
+
+void system_clock_boost(void);
+
+//! @brief Return a copy of the wake-up statistics
+
+void system_get_wake_stats(system_wake_stats_t *stats);
+
+//! @brief Return a copy of the power accounting statistics
+
+void system_get_power_stats(system_power_stats_t *stats);
+
+//! @brief Restart the power accounting and wake-up statistics from zero
+
+void system_reset_power_stats(void);
+
+//! @brief Return the name of the module with the given bit index
+
+const char *system_module_name(unsigned int index);
+
+//! @brief Estimate the average MCU current from the given statistics
+//! @retval Average current in hundredths of microamperes based on the
+//!         POWER_*_UA current model, zero if no time has been accounted
+
+uint32_t system_average_current(const system_power_stats_t *stats);
+
+//! @brief Estimate the average MCU current had all Sleep time in the given
+//! statistics used the given clock scaling policy
+//! @retval Average current in hundredths of microamperes
+
+uint32_t system_policy_current(const system_power_stats_t *stats,
+    system_clock_scaling_t policy);
+
+//! @brief Estimate the charge saved by sleeping instead of running
+//!
+//! Sleep mode without clock scaling is assumed for the whole time since Stop
+//! mode may have been prevented, so the estimate is a lower bound.
+//!
+//! @param[in] ticks Time spent sleeping in RTC ticks
+//! @retval Charge in microcoulombs based on the POWER_*_UA current model
+
+uint32_t system_saved_charge(uint64_t ticks);
+
+//! @brief Return the value of a free-running HCLK cycle counter
+//!
+//! The counter is 24 bits wide, compute differences modulo 2^24. It does not
+//! advance while the MCU is in Stop mode.
+
+uint32_t system_cycles(void);
+
 //! @brief This function call on enter to stop mode (weak)
 
 void system_before_stop(void);
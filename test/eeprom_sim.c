@@ -0,0 +1,148 @@
+#include "eeprom_sim.h"
+#include <string.h>
+#include "eeprom.h"
+
+eeprom_sim_t eeprom_sim = { .cut = -1 };
+
+static struct {
+    bool pending;
+    uint32_t address;
+    const void *buffer;
+    size_t length;
+    eeprom_callback_t callback;
+} async;
+
+static eeprom_counter_t counter;
+static uint32_t garbage = 0x12345678;
+
+
+void eeprom_sim_power_cut(int64_t n)
+{
+    eeprom_sim.cut = n;
+}
+
+
+void eeprom_sim_power_on(void)
+{
+    eeprom_sim.cut = -1;
+    eeprom_sim.off = false;
+    async.pending = false;
+}
+
+
+// Program a byte, half-word, or word at the given address
+static void program_unit(uint32_t address, const uint8_t *value, size_t n)
+{
+    uint8_t *dst = eeprom_sim.data + address;
+    bool torn = false;
+
+    if (!memcmp(dst, value, n) || eeprom_sim.off) return;
+
+    if (eeprom_sim.cut == 0) {
+        // A unit interrupted while being programmed holds neither value
+        garbage = garbage * 1103515245 + 12345;
+        for (size_t i = 0; i < n; i++) dst[i] ^= garbage >> (8 * i) | 1;
+        torn = true;
+    } else {
+        if (eeprom_sim.cut > 0) eeprom_sim.cut--;
+        memcpy(dst, value, n);
+    }
+
+    eeprom_sim.cycles[address / 4]++;
+    eeprom_sim.programmed++;
+    eeprom_sim.bytes += n;
+
+    if (torn) {
+        eeprom_sim.off = true;
+        if (eeprom_sim.power_lost) eeprom_sim.power_lost();
+        return;
+    }
+    if (counter) counter(address);
+}
+
+
+// Split the range into the same units as src/eeprom.c: words where aligned,
+// half-words and bytes at the edges
+static bool program(uint32_t address, const void *buffer, size_t length)
+{
+    const uint8_t *src = buffer;
+    size_t n;
+
+    if (address + length > EEPROM_SIM_SIZE || address + length < address) return false;
+
+    for (size_t i = 0; i < length; i += n) {
+        uint32_t a = address + i;
+        if (a % 4 == 0 && i + 4 <= length) n = 4;
+        else if (a % 2 == 0 && i + 2 <= length) n = 2;
+        else n = 1;
+        program_unit(a, src + i, n);
+    }
+    return true;
+}
+
+
+bool eeprom_write(uint32_t address, const void *buffer, size_t length)
+{
+    while (async.pending) eeprom_process();
+
+    if (!program(address, buffer, length)) return false;
+    return memcmp(eeprom_sim.data + address, buffer, length) == 0;
+}
+
+
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length, eeprom_callback_t callback)
+{
+    if (async.pending) return false;
+    if (!program(address, buffer, length)) return false;
+
+    async.address = address;
+    async.buffer = buffer;
+    async.length = length;
+    async.callback = callback;
+    async.pending = true;
+    return true;
+}
+
+
+bool eeprom_is_writing(void)
+{
+    return async.pending;
+}
+
+
+void eeprom_process(void)
+{
+    if (!async.pending) return;
+
+    bool ok = memcmp(eeprom_sim.data + async.address, async.buffer, async.length) == 0;
+    async.pending = false;
+    if (async.callback) async.callback(ok);
+}
+
+
+bool eeprom_read(uint32_t address, void *buffer, size_t length)
+{
+    const void *p = eeprom_mmap(address, length);
+    if (p == NULL) return false;
+    memcpy(buffer, p, length);
+    return true;
+}
+
+
+const void *eeprom_mmap(uint32_t address, size_t length)
+{
+    if (address + length > EEPROM_SIM_SIZE || address + length < address) return NULL;
+    return eeprom_sim.data + address;
+}
+
+
+size_t eeprom_get_size(void)
+{
+    return EEPROM_SIM_SIZE;
+}
+
+
+void eeprom_set_counter(eeprom_counter_t callback)
+{
+    counter = callback;
+}
@@ -0,0 +1,45 @@
+#ifndef _EEPROM_SIM_H
+#define _EEPROM_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stm/include/stm32l072xx.h>
+
+// A simulated data EEPROM behind the API of src/eeprom.h. Like the firmware's
+// driver, it programs aligned words, or half-words and bytes at the edges of
+// the range, and skips those that already hold the right value. Asynchronous writes are programmed right away, their
+// verification and callback run from eeprom_process, as they do on the MCU.
+
+#define EEPROM_SIM_SIZE (DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1)
+#define EEPROM_SIM_WORDS (EEPROM_SIM_SIZE / 4)
+
+typedef struct eeprom_sim {
+    uint8_t data[EEPROM_SIM_SIZE];
+    uint32_t cycles[EEPROM_SIM_WORDS];  // Program cycles of each word
+    uint64_t programmed;                // Program operations in total
+    uint64_t bytes;                     // Bytes programmed in total
+    int64_t cut;                        // Operations left before the power cut, negative if none
+    bool off;                           // The power has been cut
+    void (*power_lost)(void);           // Invoked at the power cut, if set
+} eeprom_sim_t;
+
+extern eeprom_sim_t eeprom_sim;
+
+//! @brief Cut the power once the given number of program operations completed
+//!
+//! The bytes being programmed at that moment end up with undefined values.
+//! Then eeprom_sim.power_lost is invoked, which is not expected to return
+//! since the MCU has no power to go on. Without it, all programming after the
+//! power cut is dropped and writes fail verification. A negative value
+//! disables the power cut.
+
+void eeprom_sim_power_cut(int64_t n);
+
+//! @brief Power the EEPROM up again after a power cut
+//!
+//! Drops the asynchronous write in progress, if any, without invoking its
+//! callback. The contents and the write cycle counters are kept.
+
+void eeprom_sim_power_on(void);
+
+#endif // _EEPROM_SIM_H
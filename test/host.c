@@ -0,0 +1,14 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "halt.h"
+
+// The simulated PRIMASK (see include/stm/include/cmsis_compiler.h)
+uint32_t host_primask;
+
+
+void halt(const char *msg)
+{
+    fprintf(stderr, "halt: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
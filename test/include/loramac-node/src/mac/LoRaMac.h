@@ -0,0 +1,57 @@
+#ifndef __LORAMAC_H__
+#define __LORAMAC_H__
+
+// Host replacement for LoRaMac-node. Only the NVM data groups are declared.
+// The Crypto and MacGroup1 groups have the fields of LoRaMac-node v4.6.0 that
+// change with each uplink. The other groups are opaque with sizes close to
+// those of a build with all regions enabled, so that writing them programs a
+// realistic number of EEPROM words.
+
+#include "LoRaMacTypes.h"
+
+typedef struct sLoRaMacCryptoNvmData {
+    uint32_t LrWanVersion;
+    uint16_t DevNonce;
+    uint32_t JoinNonce;
+    FCntList_t FCntList;
+    uint32_t LastDownFCnt;
+    uint32_t Crc32;
+} LoRaMacCryptoNvmData_t;
+
+typedef struct sLoRaMacNvmDataGroup1 {
+    uint32_t AdrAckCounter;
+    uint32_t LastTxDoneTime;
+    uint32_t AggregatedTimeOff;
+    uint32_t LastRxMic;
+    int8_t ChannelsTxPower;
+    int8_t ChannelsDatarate;
+    bool SrvAckRequested;
+    uint32_t Crc32;
+} LoRaMacNvmDataGroup1_t;
+
+typedef struct sLoRaMacNvmDataGroup2 {
+    uint8_t Data[380];
+    uint32_t Crc32;
+} LoRaMacNvmDataGroup2_t;
+
+typedef struct sSecureElementNvData {
+    uint8_t Data[420];
+    uint32_t Crc32;
+} SecureElementNvmData_t;
+
+typedef struct sRegionNvmDataGroup1 {
+    uint8_t Data[24];
+    uint32_t Crc32;
+} RegionNvmDataGroup1_t;
+
+typedef struct sRegionNvmDataGroup2 {
+    uint8_t Data[1296];
+    uint32_t Crc32;
+} RegionNvmDataGroup2_t;
+
+typedef struct sLoRaMacClassBNvmData {
+    uint8_t Data[24];
+    uint32_t Crc32;
+} LoRaMacClassBNvmData_t;
+
+#endif // __LORAMAC_H__
@@ -0,0 +1,23 @@
+#ifndef __LORAMAC_TYPES_H__
+#define __LORAMAC_TYPES_H__
+
+// Host replacement for LoRaMac-node, see LoRaMac.h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum eDeviceClass {
+    CLASS_A = 0x00,
+    CLASS_B = 0x01,
+    CLASS_C = 0x02
+} DeviceClass_t;
+
+typedef struct sFCntList {
+    uint32_t FCntUp;
+    uint32_t NFCntDown;
+    uint32_t AFCntDown;
+    uint32_t FCntDown;
+    uint32_t McFCntDown[4];
+} FCntList_t;
+
+#endif // __LORAMAC_TYPES_H__
@@ -0,0 +1,9 @@
+#ifndef __STM32L0xx_HAL_H
+#define __STM32L0xx_HAL_H
+
+// Host replacement for the HAL header, src/rtc.h only needs the CMSIS
+// intrinsics from it.
+
+#include <stm/include/cmsis_compiler.h>
+
+#endif // __STM32L0xx_HAL_H
@@ -0,0 +1,35 @@
+#ifndef __CMSIS_COMPILER_H
+#define __CMSIS_COMPILER_H
+
+// Host replacement for the CMSIS compiler header. There are no interrupts on
+// the host, PRIMASK is a plain variable so that critical sections nest the
+// same way they do on the MCU.
+
+#include <stdint.h>
+
+#define __STATIC_INLINE static inline
+#define __STATIC_FORCEINLINE static inline __attribute__((always_inline))
+
+extern uint32_t host_primask;
+
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void)
+{
+    return host_primask;
+}
+
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t mask)
+{
+    host_primask = mask;
+}
+
+__STATIC_FORCEINLINE void __disable_irq(void)
+{
+    host_primask = 1;
+}
+
+__STATIC_FORCEINLINE void __enable_irq(void)
+{
+    host_primask = 0;
+}
+
+#endif // __CMSIS_COMPILER_H
@@ -0,0 +1,15 @@
+#ifndef __STM32L072xx_H
+#define __STM32L072xx_H
+
+// Host replacement for the device header, only the data EEPROM bounds are
+// needed. The simulated EEPROM (see test/eeprom_sim.c) is 6 kB like the one in
+// the STM32L072, plus 12 bytes on LP64 hosts where part_table_t, which holds a
+// size_t, takes 12 bytes more. The firmware's NVM layout thus fits unchanged.
+
+#include <stddef.h>
+
+#define DATA_EEPROM_BASE      0x08080000UL
+#define DATA_EEPROM_HOST_PAD  (sizeof(size_t) == 8 ? 12 : 0)
+#define DATA_EEPROM_BANK2_END (DATA_EEPROM_BASE + 6 * 1024 + DATA_EEPROM_HOST_PAD - 1)
+
+#endif // __STM32L072xx_H
@@ -0,0 +1,690 @@
+/* Host test of the NVM partitions (src/part.c, src/nvm.c, src/kv.c, and
+ * src/journal.c) on a simulated EEPROM (eeprom_sim.c)
+ *
+ * Every boot of the simulated device runs in a child process forked from the
+ * test process, so the static state of all modules starts out as it does after
+ * reset. Only the EEPROM contents carry over from one boot to the next. The
+ * device saves its state the way lrw.c does: the uplink frame counter goes to
+ * the journal, MacGroup1 is written once AdrAckCounter drifted by 16, and
+ * RegionGroup2 is kept in a single copy.
+ *
+ * First measures how many EEPROM bytes an uplink and each kind of
+ * configuration change program in a long run without reboots, and checks that
+ * the EEPROM wear counters (nvm_get_wear) account for every EEPROM write.
+ *
+ * Then runs a sequence of operations and cuts the power at every EEPROM write
+ * each of them makes. After the power cut, the device boots again and each
+ * data structure must hold either its value from before or from after the
+ * interrupted operation. Only RegionGroup2 may be lost while it is being
+ * written. An operation that completed must be found in full. Finally, the
+ * migration of an EEPROM with layout version 3 is interrupted the same way,
+ * and the next boot must complete it without losing data.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// unistd.h declares a sysconf function, which clashes with the global in nvm.c
+#define sysconf unistd_sysconf
+#include <unistd.h>
+#undef sysconf
+
+#include "eeprom_sim.h"
+#include "rtc_sim.h"
+#include "eeprom.h"
+#include "journal.h"
+#include "kv.h"
+#include "nvm.h"
+#include "part.h"
+#include "utils.h"
+
+#define MEASURE_UPLINKS 10000
+#define MEASURE_CHANGES 1000
+#define UPLINK_PERIOD (5 * 60 * 1024)  // in RTC ticks
+#define SEQUENCE_OPS 1000
+
+// The layout version nvm_init produces (NVM_LAYOUT_VERSION in nvm.c)
+#define LAYOUT_VERSION 4
+
+
+typedef struct state {
+    LoRaMacCryptoNvmData_t crypto;
+    LoRaMacNvmDataGroup1_t mac1;
+    LoRaMacNvmDataGroup2_t mac2;
+    RegionNvmDataGroup2_t region2;
+    sysconf_t sysconf;
+    uint8_t user[USER_NVM_MAX_SIZE];
+} state_t;
+
+
+typedef enum op {
+    OP_UPLINK,
+    OP_USER,     // AT$NVM
+    OP_SYSCONF,  // E.g., AT+PORT
+    OP_MAC2,     // E.g., a new channel from the network
+    OP_REGION2,
+    OP_REJOIN,
+    OPS
+} op_t;
+
+static const char *op_names[OPS] = {
+    [OP_UPLINK]  = "uplink",
+    [OP_USER]    = "AT$NVM",
+    [OP_SYSCONF] = "sysconf",
+    [OP_MAC2]    = "MacGroup2",
+    [OP_REGION2] = "RegionGroup2",
+    [OP_REJOIN]  = "rejoin"
+};
+
+
+typedef struct image {
+    uint8_t data[EEPROM_SIM_SIZE];
+    uint32_t cycles[EEPROM_SIM_WORDS];
+    uint64_t programmed;
+    uint64_t bytes;
+} image_t;
+
+// Shared between the test process and the simulated device
+static struct {
+    image_t image;
+    state_t state;
+    int version;
+} *shared;
+
+
+static void device_fail(const char *msg, const char *label)
+{
+    fprintf(stderr, "%s %s\n", msg, label);
+    exit(EXIT_FAILURE);
+}
+
+
+/* Simulated device (child process)
+ */
+
+static void power_off(void)
+{
+    memcpy(shared->image.data, eeprom_sim.data, sizeof(shared->image.data));
+    memcpy(shared->image.cycles, eeprom_sim.cycles, sizeof(shared->image.cycles));
+    shared->image.programmed = eeprom_sim.programmed;
+    shared->image.bytes = eeprom_sim.bytes;
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+
+static void load(void *dst, size_t size, const void *src, size_t src_size)
+{
+    memset(dst, 0, size);
+    if (src && src_size >= size && check_block_crc(src, size)) memcpy(dst, src, size);
+}
+
+
+// Load the state the way lrw.c restores it. Invalid groups are all zeros.
+static void load_state(state_t *s)
+{
+    size_t size;
+    const void *p;
+
+    memset(s, 0, sizeof(*s));
+
+    p = part_mirror_mmap(&size, &nvm_parts.crypto);
+    load(&s->crypto, sizeof(s->crypto), p, size);
+    journal_restore(&s->crypto);
+
+    p = part_mirror_mmap(&size, &nvm_parts.mac1);
+    load(&s->mac1, sizeof(s->mac1), p, size);
+
+    p = part_mirror_mmap(&size, &nvm_parts.mac2);
+    load(&s->mac2, sizeof(s->mac2), p, size);
+
+    p = part_mmap(&size, &nvm_parts.region2);
+    load(&s->region2, sizeof(s->region2), p, size);
+
+    memcpy(&s->sysconf, &sysconf, sizeof(s->sysconf));
+
+    for (unsigned int i = 0; i < USER_NVM_MAX_SIZE; i++)
+        s->user[i] = nvm_get_user_data(i);
+}
+
+
+static void boot(state_t *s)
+{
+    nvm_init();
+    load_state(s);
+}
+
+
+static void drain(void)
+{
+    while (part_busy() || eeprom_is_writing()) eeprom_process();
+}
+
+
+static bool written;
+
+static void group_written(bool ok)
+{
+    written = ok;
+}
+
+
+static void save_group(const part_t *part, const void *data, size_t size)
+{
+    bool started;
+
+    written = false;
+    if (part == &nvm_parts.region2)
+        started = part_sync_async(part, 0, data, size, group_written);
+    else
+        started = part_mirror_write_async(part, data, size, group_written);
+    drain();
+
+    if (!started || !written) device_fail("Error while writing part", part->dsc->label);
+}
+
+
+// Persist everything that differs between the two states
+static void save_state(const state_t *old, const state_t *new)
+{
+    if (memcmp(&old->crypto, &new->crypto, sizeof(new->crypto))) {
+        if (!journal_append(&new->crypto)) {
+            save_group(&nvm_parts.crypto, &new->crypto, sizeof(new->crypto));
+            journal_checkpoint(&new->crypto);
+        }
+    }
+
+    if (memcmp(&old->mac1, &new->mac1, sizeof(new->mac1)))
+        save_group(&nvm_parts.mac1, &new->mac1, sizeof(new->mac1));
+
+    if (memcmp(&old->mac2, &new->mac2, sizeof(new->mac2)))
+        save_group(&nvm_parts.mac2, &new->mac2, sizeof(new->mac2));
+
+    if (memcmp(&old->region2, &new->region2, sizeof(new->region2)))
+        save_group(&nvm_parts.region2, &new->region2, sizeof(new->region2));
+
+    if (memcmp(&old->sysconf, &new->sysconf, offsetof(sysconf_t, nvm_wear))) {
+        memcpy(&sysconf, &new->sysconf, offsetof(sysconf_t, nvm_wear));
+        sysconf_modified = true;
+    }
+    sysconf_process();
+    drain();
+
+    for (unsigned int i = 0; i < USER_NVM_MAX_SIZE; i++) {
+        if (old->user[i] != new->user[i] && nvm_set_user_data(i, new->user[i]))
+            device_fail("Error while writing part", "kv");
+    }
+}
+
+
+static op_t op_at(unsigned int i)
+{
+    if (i % 97 == 96) return OP_REJOIN;
+    if (i % 50 == 9) return OP_REGION2;
+    if (i % 20 == 3) return OP_SYSCONF;
+    if (i % 10 == 7) return OP_MAC2;
+    if (i % 4 == 1) return OP_USER;
+    return OP_UPLINK;
+}
+
+
+// Apply the i-th operation of the given kind to the state
+static void apply(op_t op, unsigned int i, state_t *s)
+{
+    switch (op) {
+    case OP_UPLINK:
+        s->crypto.FCntList.FCntUp++;
+        update_block_crc(&s->crypto, sizeof(s->crypto));
+        if (s->crypto.FCntList.FCntUp % 16 == 0) {
+            s->mac1.AdrAckCounter += 16;
+            s->mac1.LastTxDoneTime = i;
+            update_block_crc(&s->mac1, sizeof(s->mac1));
+        }
+        break;
+
+    case OP_USER:
+        s->user[i * 7 % USER_NVM_MAX_SIZE] = i % 5 ? i / 4 % 255 + 1 : 0;
+        break;
+
+    case OP_SYSCONF:
+        s->sysconf.default_port = 1 + i % 223;
+        s->sysconf.uart_timeout = 1000 + i % 1000;
+        break;
+
+    case OP_MAC2:
+        s->mac2.Data[0]++;
+        s->mac2.Data[i % sizeof(s->mac2.Data)] ^= 0xa5;
+        update_block_crc(&s->mac2, sizeof(s->mac2));
+        break;
+
+    case OP_REGION2:
+        memset(s->region2.Data + i % 16 * 64, i, 64);
+        update_block_crc(&s->region2, sizeof(s->region2));
+        break;
+
+    case OP_REJOIN:
+        s->crypto.LrWanVersion = 0x01010100;
+        s->crypto.DevNonce++;
+        s->crypto.JoinNonce += 3;
+        memset(&s->crypto.FCntList, 0, sizeof(s->crypto.FCntList));
+        update_block_crc(&s->crypto, sizeof(s->crypto));
+        s->mac1.AdrAckCounter = 0;
+        update_block_crc(&s->mac1, sizeof(s->mac1));
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+static void run_op(int i, int64_t cut)
+{
+    state_t old, new;
+
+    boot(&old);
+    new = old;
+    apply(op_at(i), i, &new);
+
+    eeprom_sim_power_cut(cut);
+    save_state(&old, &new);
+}
+
+
+static void run_boot(int arg, int64_t cut)
+{
+    eeprom_sim_power_cut(cut);
+    boot(&shared->state);
+    shared->version = part_block_version(nvm_parts.sysconf.block);
+}
+
+
+static uint64_t programmed_since(uint64_t start)
+{
+    return eeprom_sim.programmed - start;
+}
+
+
+static uint64_t wear_total(void)
+{
+    nvm_wear_t w;
+    uint64_t sum = 0;
+
+    for (unsigned int i = 0; nvm_get_wear(i, &w); i++) sum += w.words;
+    return sum;
+}
+
+
+// Run n operations of the given kind and report the bytes programmed by each
+static void measure(const char *name, op_t op, unsigned int n, state_t *s)
+{
+    state_t new;
+    uint64_t start = eeprom_sim.bytes;
+
+    for (unsigned int i = 0; i < n; i++) {
+        new = *s;
+        apply(op, i, &new);
+        save_state(s, &new);
+        *s = new;
+
+        if (op == OP_UPLINK) {
+            // Let the wear counters be persisted as they would be on a device
+            // that transmits every five minutes
+            rtc_sim.now += UPLINK_PERIOD;
+            sysconf_process();
+            drain();
+        }
+    }
+
+    printf("%-16s %8.1f B per operation (%u operations)\n", name,
+        (double)(eeprom_sim.bytes - start) / n, n);
+}
+
+
+static void run_measurement(int arg, int64_t cut)
+{
+    state_t s;
+    nvm_wear_t w;
+    uint32_t max = 0, at = 0;
+
+    boot(&s);
+
+    uint64_t start = eeprom_sim.programmed;
+    uint64_t wear_start = wear_total();
+    uint32_t part_start[NVM_WEAR_SLOTS] = { 0 };
+    for (unsigned int i = 0; nvm_get_wear(i, &w); i++) part_start[i] = w.words;
+    memset(eeprom_sim.cycles, 0, sizeof(eeprom_sim.cycles));
+
+    measure("uplink", OP_UPLINK, MEASURE_UPLINKS, &s);
+
+    for (unsigned int i = 0; i < EEPROM_SIM_WORDS; i++) {
+        if (eeprom_sim.cycles[i] > max) {
+            max = eeprom_sim.cycles[i];
+            at = i * 4;
+        }
+    }
+
+    for (unsigned int i = 0; nvm_get_wear(i, &w); i++) {
+        if (w.words == part_start[i]) continue;
+        printf("  %-14s %8.2f writes per uplink\n", w.label,
+            (double)(w.words - part_start[i]) / MEASURE_UPLINKS);
+    }
+    printf("  most worn word   %u cycles at 0x%04x, %.0f uplinks until %u cycles\n",
+        max, at, (double)MEASURE_UPLINKS * EEPROM_ENDURANCE / max, EEPROM_ENDURANCE);
+
+    measure("AT$NVM", OP_USER, MEASURE_CHANGES, &s);
+    measure("sysconf", OP_SYSCONF, MEASURE_CHANGES, &s);
+    measure("MacGroup2", OP_MAC2, MEASURE_CHANGES, &s);
+    measure("RegionGroup2", OP_REGION2, MEASURE_CHANGES, &s);
+    measure("rejoin", OP_REJOIN, MEASURE_CHANGES, &s);
+
+    // Words programmed while the counter callback was registered
+    uint64_t counted = wear_total() - wear_start;
+    if (counted != programmed_since(start)) {
+        printf("Wear counters: %llu writes, programmed: %llu writes\n",
+            (unsigned long long)counted, (unsigned long long)programmed_since(start));
+        exit(EXIT_FAILURE);
+    }
+
+    // The state must survive a reboot
+    memcpy(&shared->state, &s, sizeof(s));
+}
+
+
+/* Layout version 3 (see NVM_LAYOUT_VERSION in nvm.c). RegionGroup2 was
+ * mirrored and the key-value store was smaller.
+ */
+static part_block_t v3_block = {
+    .size = EEPROM_SIM_SIZE,
+    .mmap = eeprom_mmap,
+    .write = eeprom_write
+};
+
+static const part_layout_t v3_layout[] = {
+    { "sysconf", PART_MIRROR_SIZE(128)  },
+    { "crypto",  PART_MIRROR_SIZE(128)  },
+    { "mac1",    PART_MIRROR_SIZE(64)   },
+    { "mac2",    PART_MIRROR_SIZE(512)  },
+    { "se",      PART_MIRROR_SIZE(512)  },
+    { "region1", PART_MIRROR_SIZE(32)   },
+    { "region2", PART_MIRROR_SIZE(1310) },
+    { "classb",  PART_MIRROR_SIZE(32)   },
+    { "kv",      196                    },
+    { "fcnt",    128                    }
+};
+
+#define V3_PARTS (sizeof(v3_layout) / sizeof(v3_layout[0]))
+
+
+static void make_v3(int arg, int64_t cut)
+{
+    part_t part;
+    state_t *s = &shared->state;
+
+    if (part_format_block(&v3_block, V3_PARTS, 3) || part_open_block(&v3_block))
+        device_fail("Could not format", "EEPROM");
+
+    for (unsigned int i = 0; i < V3_PARTS; i++) {
+        if (part_create(&part, &v3_block, v3_layout[i].label, v3_layout[i].size))
+            device_fail("Could not create part", v3_layout[i].label);
+    }
+
+    part_find(&nvm_parts.sysconf, &v3_block, "sysconf");
+    part_find(&nvm_parts.crypto, &v3_block, "crypto");
+    part_find(&nvm_parts.mac1, &v3_block, "mac1");
+    part_find(&nvm_parts.mac2, &v3_block, "mac2");
+    part_find(&part, &v3_block, "region2");
+    part_find(&nvm_parts.kv, &v3_block, "kv");
+    part_find(&nvm_parts.fcnt, &v3_block, "fcnt");
+
+    memset(s, 0, sizeof(*s));
+    memcpy(&s->sysconf, &sysconf, sizeof(s->sysconf));
+    for (unsigned int i = 0; i < 40; i++) apply(op_at(i), i, s);
+    memset(s->user, 0, sizeof(s->user));
+
+    update_block_crc(&s->sysconf, sizeof(s->sysconf));
+    part_mirror_write(&nvm_parts.sysconf, &s->sysconf, sizeof(s->sysconf));
+    part_mirror_write(&nvm_parts.mac1, &s->mac1, sizeof(s->mac1));
+    part_mirror_write(&nvm_parts.mac2, &s->mac2, sizeof(s->mac2));
+
+    // Frame counter in the journal on top of a checkpoint
+    s->crypto.FCntList.FCntUp -= 3;
+    update_block_crc(&s->crypto, sizeof(s->crypto));
+    part_mirror_write(&nvm_parts.crypto, &s->crypto, sizeof(s->crypto));
+    journal_restore(&s->crypto);
+    for (unsigned int i = 0; i < 3; i++) {
+        s->crypto.FCntList.FCntUp++;
+        update_block_crc(&s->crypto, sizeof(s->crypto));
+        if (!journal_append(&s->crypto)) device_fail("Could not append to", "fcnt");
+    }
+
+    // The newest copy of RegionGroup2 in the second half of the part
+    RegionNvmDataGroup2_t r = s->region2;
+    memset(r.Data, 0x11, sizeof(r.Data));
+    update_block_crc(&r, sizeof(r));
+    part_mirror_write(&part, &r, sizeof(r));
+    part_mirror_write(&part, &s->region2, sizeof(s->region2));
+
+    // Enough key-value churn to make the second segment active
+    kv_init();
+    for (unsigned int i = 0; i < 8; i++) {
+        for (unsigned int j = 0; j < 6; j++) {
+            s->user[j] = i * 6 + j + 1;
+            if (kv_set(j, &s->user[j], 1)) device_fail("Could not write", "kv");
+        }
+    }
+
+    shared->version = 3;
+}
+
+
+/* Test process
+ */
+
+// Boot the simulated device in a child process, invoke fn with the argument
+// and the power cut index, and power the device off. Returns false if the
+// device halted or failed otherwise.
+static bool run(void (*fn)(int, int64_t), int arg, int64_t cut)
+{
+    int status;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0) {
+        memcpy(eeprom_sim.data, shared->image.data, sizeof(eeprom_sim.data));
+        memcpy(eeprom_sim.cycles, shared->image.cycles, sizeof(eeprom_sim.cycles));
+        eeprom_sim.programmed = shared->image.programmed;
+        eeprom_sim.bytes = shared->image.bytes;
+        eeprom_sim.power_lost = power_off;
+        fn(arg, cut);
+        power_off();
+    }
+
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+
+static bool same_sysconf(const sysconf_t *a, const sysconf_t *b)
+{
+    // The wear counters lag behind and are not part of the configuration
+    return !memcmp(a, b, offsetof(sysconf_t, nvm_wear));
+}
+
+
+static bool same_state(const state_t *a, const state_t *b)
+{
+    return !memcmp(&a->crypto, &b->crypto, sizeof(a->crypto)) &&
+        !memcmp(&a->mac1, &b->mac1, sizeof(a->mac1)) &&
+        !memcmp(&a->mac2, &b->mac2, sizeof(a->mac2)) &&
+        !memcmp(&a->region2, &b->region2, sizeof(a->region2)) &&
+        same_sysconf(&a->sysconf, &b->sysconf) &&
+        !memcmp(a->user, b->user, sizeof(a->user));
+}
+
+
+#define OLD_OR_NEW(field) \
+    (!memcmp(&s->field, &old->field, sizeof(s->field)) || \
+     !memcmp(&s->field, &new->field, sizeof(s->field)))
+
+// Return the name of the first data structure that holds neither its old nor
+// its new value, NULL if there is none
+static const char *inconsistent(const state_t *s, const state_t *old, const state_t *new, op_t op)
+{
+    static const RegionNvmDataGroup2_t lost;
+
+    if (!OLD_OR_NEW(crypto)) return "Crypto";
+    if (!OLD_OR_NEW(mac1)) return "MacGroup1";
+    if (!OLD_OR_NEW(mac2)) return "MacGroup2";
+    if (!OLD_OR_NEW(region2) && (op != OP_REGION2 || memcmp(&s->region2, &lost, sizeof(lost))))
+        return "RegionGroup2";
+    if (!same_sysconf(&s->sysconf, &old->sysconf) && !same_sysconf(&s->sysconf, &new->sysconf))
+        return "sysconf";
+
+    for (unsigned int i = 0; i < USER_NVM_MAX_SIZE; i++) {
+        if (s->user[i] != old->user[i] && s->user[i] != new->user[i]) return "kv";
+    }
+    return NULL;
+}
+
+
+static struct {
+    uint64_t trials;
+    uint64_t failed;
+    uint64_t region2_lost;
+    uint64_t writes[OPS];
+    unsigned int count[OPS];
+} crash;
+
+static image_t before, after;
+
+
+// Cut the power at each EEPROM write made by the function and check the state
+// on the next boot. Returns the number of writes made without a power cut.
+static uint64_t cut_everywhere(void (*fn)(int, int64_t), int arg, const char *name,
+    const state_t *old, const state_t *new, op_t op)
+{
+    memcpy(&before, &shared->image, sizeof(before));
+    if (!run(fn, arg, -1)) {
+        printf("%s %d failed\n", name, arg);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&after, &shared->image, sizeof(after));
+    uint64_t writes = after.programmed - before.programmed;
+
+    // The completed operation must be found in full and a clean boot does not
+    // program anything
+    if (!run(run_boot, 0, -1) || !same_state(&shared->state, new) ||
+        shared->version != LAYOUT_VERSION || shared->image.programmed != after.programmed) {
+        printf("%s %d: state not persisted\n", name, arg);
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint64_t k = 0; k < writes; k++) {
+        memcpy(&shared->image, &before, sizeof(before));
+        crash.trials++;
+
+        if (!run(fn, arg, k) || !run(run_boot, 0, -1)) {
+            printf("%s %d: power cut at write %llu: boot failed\n", name, arg, (unsigned long long)k);
+            crash.failed++;
+            continue;
+        }
+
+        const char *what = inconsistent(&shared->state, old, new, op);
+        if (what == NULL && shared->version != LAYOUT_VERSION) what = "layout version";
+        if (what) {
+            printf("%s %d: power cut at write %llu: %s lost\n", name, arg, (unsigned long long)k, what);
+            crash.failed++;
+        } else if (memcmp(&shared->state.region2, &old->region2, sizeof(old->region2)) &&
+            memcmp(&shared->state.region2, &new->region2, sizeof(new->region2))) {
+            crash.region2_lost++;
+        }
+    }
+
+    memcpy(&shared->image, &after, sizeof(after));
+    return writes;
+}
+
+
+int main(void)
+{
+    state_t model, next;
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    printf("EEPROM:           %u B, NVM layout version %d\n", (unsigned int)EEPROM_SIM_SIZE, LAYOUT_VERSION);
+
+    // Format the blank EEPROM and join
+    if (!run(run_boot, 0, -1)) return EXIT_FAILURE;
+    model = shared->state;
+    next = model;
+    apply(OP_REJOIN, 96, &next);
+    cut_everywhere(run_op, 96, "join", &model, &next, OP_REJOIN);
+    model = next;
+    image_t joined = shared->image;
+
+    // Wear and bytes per operation
+    if (!run(run_measurement, 0, -1)) {
+        printf("FAILED\n");
+        return EXIT_FAILURE;
+    }
+    next = shared->state;
+    if (!run(run_boot, 0, -1) || !same_state(&shared->state, &next)) {
+        printf("State lost after reboot\nFAILED\n");
+        return EXIT_FAILURE;
+    }
+
+    // Power cuts during normal operation
+    shared->image = joined;
+    for (unsigned int i = 0; i < SEQUENCE_OPS; i++) {
+        op_t op = op_at(i);
+        next = model;
+        apply(op, i, &next);
+        crash.writes[op] += cut_everywhere(run_op, i, op_names[op], &model, &next, op);
+        crash.count[op]++;
+        model = next;
+    }
+
+    printf("Power cuts:       %llu (RegionGroup2 lost %llu times)\n",
+        (unsigned long long)crash.trials, (unsigned long long)crash.region2_lost);
+    for (unsigned int i = 0; i < OPS; i++) {
+        if (crash.count[i] == 0) continue;
+        printf("  %-14s %8.1f writes per operation (%u operations)\n", op_names[i],
+            (double)crash.writes[i] / crash.count[i], crash.count[i]);
+    }
+
+    // Power cuts during the migration from layout version 3
+    memset(&shared->image, 0, sizeof(shared->image));
+    if (!run(make_v3, 0, -1)) {
+        printf("FAILED\n");
+        return EXIT_FAILURE;
+    }
+    model = shared->state;
+    uint64_t before_migration = crash.trials;
+    uint64_t writes = cut_everywhere(run_boot, 0, "migration", &model, &model, OPS);
+    printf("Migration:        %llu writes, %llu power cuts\n", (unsigned long long)writes,
+        (unsigned long long)(crash.trials - before_migration));
+
+    if (crash.failed) {
+        printf("Inconsistent:     %llu\nFAILED\n", (unsigned long long)crash.failed);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+#include "rtc_sim.h"
+#include "rtc.h"
+
+// 1024 ticks per second, the same as the firmware (N_PREDIV_S in src/rtc.c)
+#define TICKS_PER_SECOND 1024
+
+// The same as MIN_ALARM_DELAY in src/rtc.c
+#define MIN_ALARM_DELAY 3
+
+// Reading the same RTC value more often than this is considered polling
+#define POLL_READS 1000
+
+rtc_sim_t rtc_sim;
+
+
+uint32_t rtc_get_timer_value(void)
+{
+    static uint32_t last;
+
+    if (rtc_sim.now != last) {
+        last = rtc_sim.now;
+        rtc_sim.reads = 0;
+    } else if (++rtc_sim.reads > POLL_READS) {
+        last = ++rtc_sim.now;
+        rtc_sim.reads = 0;
+        rtc_sim.polled++;
+    }
+    return rtc_sim.now;
+}
+
+
+uint32_t rtc_set_timer_context(void)
+{
+    rtc_sim.context = rtc_sim.now;
+    return rtc_sim.context;
+}
+
+
+uint32_t rtc_get_timer_context(void)
+{
+    return rtc_sim.context;
+}
+
+
+uint32_t rtc_get_timer_elapsed_time(void)
+{
+    return rtc_sim.now - rtc_sim.context;
+}
+
+
+uint32_t rtc_get_min_timeout(void)
+{
+    return MIN_ALARM_DELAY;
+}
+
+
+void rtc_set_alarm(uint32_t timeout)
+{
+    rtc_sim.alarm = rtc_sim.context + timeout;
+    rtc_sim.armed = true;
+    rtc_sim.alarms++;
+}
+
+
+void rtc_stop_alarm(void)
+{
+    rtc_sim.armed = false;
+}
+
+
+uint32_t rtc_ms2tick(TimerTime_t timeMilliSec)
+{
+    return (uint32_t)(((uint64_t)timeMilliSec * TICKS_PER_SECOND) / 1000);
+}
+
+
+TimerTime_t rtc_tick2ms(uint32_t tick)
+{
+    uint32_t seconds = tick / TICKS_PER_SECOND;
+    tick = tick % TICKS_PER_SECOND;
+    return seconds * 1000 + tick * 1000 / TICKS_PER_SECOND;
+}
+
+
+TimerTime_t rtc_temperature_compensation(TimerTime_t period, float temperature)
+{
+    (void)temperature;
+    return period;
+}
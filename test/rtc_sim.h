@@ -0,0 +1,24 @@
+#ifndef _RTC_SIM_H
+#define _RTC_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A simulated RTC for the timer server. Time only advances when the test moves
+// rtc_sim.now forward, or when the code under test keeps reading the same RTC
+// value, i.e., polls the RTC. The alarm is not delivered by the simulation
+// either, the test checks rtc_sim.alarm and invokes TimerIrqHandler itself.
+
+typedef struct rtc_sim {
+    uint32_t now;       // Current RTC value in ticks
+    uint32_t context;   // Reference set by rtc_set_timer_context
+    bool armed;         // The alarm is set
+    uint32_t alarm;     // Absolute RTC value of the alarm
+    uint32_t alarms;    // Number of rtc_set_alarm calls
+    uint32_t reads;     // Consecutive reads of the same RTC value
+    uint32_t polled;    // Ticks that passed while the RTC was being polled
+} rtc_sim_t;
+
+extern rtc_sim_t rtc_sim;
+
+#endif // _RTC_SIM_H
@@ -0,0 +1,311 @@
+/* Host benchmark of the timer server (lib/LoRaWAN/Utilities/timeServer.c)
+ *
+ * Runs the timers of the firmware, of LoRaMac-node (class A, B, and C), and of
+ * the SX1276 driver together with a dozen periodic application timers against
+ * a simulated RTC for a day of simulated time. The uplink timers follow the
+ * class A sequence: transmission, two receive windows with short radio
+ * timeouts, and the NVM commit. Callbacks take up to a few ticks each, so
+ * deadlines regularly come closer than the minimum alarm timeout. Some alarms
+ * fire a few ticks early, as they do when set early for a Stop mode wake-up
+ * while the MCU ends up in Sleep mode.
+ *
+ * Checks that no timer ever fires before its deadline, that the deadline of a
+ * running timer never changes, and that the alarm is always set for the timer
+ * that expires first. Reports the host time per TimerStart, TimerStop, and
+ * alarm (including callbacks and polling the simulated RTC), and how late
+ * timers fire in ticks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <LoRaWAN/Utilities/timeServer.h>
+#include "rtc_sim.h"
+#include "utils.h"
+
+#define SIMULATED_TIME (24 * 3600 * 1024UL)  // in ticks
+#define MIN_ALARM_DELAY 3                    // see rtc_sim.c
+
+
+typedef enum bench_id {
+    // LoRaMac.c
+    TX_DELAYED, RX_WINDOW1, RX_WINDOW2, RETRANSMIT_TIMEOUT,
+    // LoRaMacClassB.c
+    BEACON, PING_SLOT, MULTICAST_SLOT,
+    // SX1276 driver
+    TX_TIMEOUT, RX_TIMEOUT, RX_TIMEOUT_SYNC_WORD,
+    // Firmware
+    PAYLOAD, JOIN_RETRY, DRAIN, COMMIT, SEG_RETRY, TEMP, DELAY,
+    // Periodic application timers
+    APP_FIRST,
+    APP_LAST = APP_FIRST + 11,
+    TIMERS
+} bench_id_t;
+
+
+typedef struct bench_timer {
+    const char *name;
+    uint32_t period;      // Restart period in milliseconds, 0 if started by others
+    TimerEvent_t timer;
+    uint32_t deadline;    // Timestamp right after TimerStart
+    uint32_t fired;
+} bench_timer_t;
+
+
+static bench_timer_t timers[TIMERS] = {
+    [TX_DELAYED]           = { "TxDelayedTimer",        0      },
+    [RX_WINDOW1]           = { "RxWindowTimer1",        0      },
+    [RX_WINDOW2]           = { "RxWindowTimer2",        0      },
+    [RETRANSMIT_TIMEOUT]   = { "RetransmitTimeoutTimer", 0     },
+    [BEACON]               = { "BeaconTimer",           128000 },
+    [PING_SLOT]            = { "PingSlotTimer",         960    },
+    [MULTICAST_SLOT]       = { "MulticastSlotTimer",    1920   },
+    [TX_TIMEOUT]           = { "TxTimeoutTimer",        0      },
+    [RX_TIMEOUT]           = { "RxTimeoutTimer",        0      },
+    [RX_TIMEOUT_SYNC_WORD] = { "RxTimeoutSyncWord",     0      },
+    [PAYLOAD]              = { "payload_timer",         60000  },
+    [JOIN_RETRY]           = { "join_retry_timer",      0      },
+    [DRAIN]                = { "drain_timer",           0      },
+    [COMMIT]               = { "commit_timer",          0      },
+    [SEG_RETRY]            = { "retry_timer",           0      },
+    [TEMP]                 = { "temp_timer",            60000  },
+    [DELAY]                = { "rtc_delay_ms",          0      }
+};
+
+
+static struct {
+    uint64_t start_ns, start_count;
+    uint64_t stop_ns, stop_count;
+    uint64_t irq_ns, irq_count;
+    uint32_t max_late;
+    uint64_t late_total;
+    uint32_t early;
+    uint32_t moved;
+    uint32_t missed;
+    uint32_t early_alarms;
+    unsigned int running, max_running;
+} stats;
+
+static uint32_t rng = 1;
+
+
+static uint32_t rand_below(uint32_t n)
+{
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 8) % n;
+}
+
+
+static uint64_t ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void start(bench_id_t id, uint32_t ms)
+{
+    bench_timer_t *t = &timers[id];
+
+    if (TimerIsStarted(&t->timer)) stats.running--;
+    TimerSetValue(&t->timer, ms);
+
+    uint64_t begin = ns();
+    TimerStart(&t->timer);
+    stats.start_ns += ns() - begin;
+    stats.start_count++;
+
+    t->deadline = t->timer.Timestamp;
+    if (++stats.running > stats.max_running) stats.max_running = stats.running;
+}
+
+
+static void stop(bench_id_t id)
+{
+    bench_timer_t *t = &timers[id];
+    if (!TimerIsStarted(&t->timer)) return;
+
+    uint64_t begin = ns();
+    TimerStop(&t->timer);
+    stats.stop_ns += ns() - begin;
+    stats.stop_count++;
+    stats.running--;
+}
+
+
+static void on_timer(void *ctx)
+{
+    bench_id_t id = (bench_id_t)(uintptr_t)ctx;
+    bench_timer_t *t = &timers[id];
+    uint32_t now = rtc_sim.now;
+
+    stats.running--;
+    t->fired++;
+
+    if (t->timer.Timestamp != t->deadline) stats.moved++;
+
+    int32_t late = (int32_t)(now - t->deadline);
+    if (late < 0) {
+        stats.early++;
+    } else {
+        stats.late_total += late;
+        if ((uint32_t)late > stats.max_late) stats.max_late = late;
+    }
+
+    switch (id) {
+    case PAYLOAD:
+        // The application submits an uplink, LoRaMac transmits it right away
+        // or after the duty cycle wait
+        start(TX_DELAYED, rand_below(4) ? 1 : 500 + rand_below(5000));
+        break;
+
+    case TX_DELAYED:
+        start(TX_TIMEOUT, 4000);
+        start(RX_WINDOW1, 1000 + 60);
+        start(RX_WINDOW2, 2000 + 60);
+        start(RETRANSMIT_TIMEOUT, 3000);
+        break;
+
+    case RX_WINDOW1:
+        stop(TX_TIMEOUT);
+        start(RX_TIMEOUT_SYNC_WORD, 6 + rand_below(4));
+        start(RX_TIMEOUT, 20);
+        break;
+
+    case RX_WINDOW2:
+        start(RX_TIMEOUT_SYNC_WORD, 6 + rand_below(4));
+        start(RX_TIMEOUT, 20);
+        break;
+
+    case RX_TIMEOUT_SYNC_WORD:
+        // Preamble detected in a quarter of the windows, the payload follows
+        if (rand_below(4) == 0) {
+            stop(RX_TIMEOUT);
+            stop(RX_WINDOW2);
+            stop(RETRANSMIT_TIMEOUT);
+            start(DRAIN, 1000 + rand_below(3000));
+            start(COMMIT, 100);
+        }
+        break;
+
+    case RETRANSMIT_TIMEOUT:
+        start(COMMIT, 100);
+        if (rand_below(8) == 0) start(JOIN_RETRY, 5000 + rand_below(30000));
+        break;
+
+    case COMMIT:
+        // An NVM commit polls the EEPROM with short delays
+        start(DELAY, 3 + rand_below(5));
+        break;
+
+    case DRAIN:
+        start(SEG_RETRY, 200 + rand_below(800));
+        break;
+
+    case PING_SLOT:
+    case MULTICAST_SLOT:
+        // Each slot opens a short receive window
+        start(RX_TIMEOUT, 10 + rand_below(20));
+        break;
+
+    default:
+        break;
+    }
+
+    if (t->period) start(id, t->period - 10 + rand_below(20));
+
+    // Occasionally stop and restart some other timer, which may be at the root
+    if (rand_below(16) == 0) {
+        bench_id_t other = APP_FIRST + rand_below(APP_LAST - APP_FIRST + 1);
+        stop(other);
+        start(other, timers[other].period);
+    }
+
+    // The callback itself takes a while
+    rtc_sim.now += rand_below(MIN_ALARM_DELAY);
+}
+
+
+// The alarm must fire no later than the earliest deadline, or the minimum
+// timeout after it has been set if that deadline is closer
+static void check_alarm(void)
+{
+    bool any = false;
+    uint32_t earliest = 0;
+
+    for (unsigned int i = 0; i < TIMERS; i++) {
+        if (!TimerIsStarted(&timers[i].timer)) continue;
+        if (!any || (int32_t)(timers[i].deadline - earliest) < 0) earliest = timers[i].deadline;
+        any = true;
+    }
+
+    if (!any) return;
+    if (!rtc_sim.armed ||
+        ((int32_t)(rtc_sim.alarm - earliest) > 0 &&
+         (int32_t)(rtc_sim.alarm - rtc_sim.context) > MIN_ALARM_DELAY))
+        stats.missed++;
+}
+
+
+int main(void)
+{
+    // Start close to the RTC wrap around
+    rtc_sim.now = UINT32_MAX - 1024 * 60;
+    uint32_t end = rtc_sim.now + SIMULATED_TIME;
+
+    for (unsigned int i = APP_FIRST; i <= APP_LAST; i++) {
+        timers[i].name = "application";
+        timers[i].period = 250 + i * 997 % 30000;
+    }
+
+    for (unsigned int i = 0; i < TIMERS; i++) {
+        TimerInit(&timers[i].timer, on_timer);
+        TimerSetContext(&timers[i].timer, (void *)(uintptr_t)i);
+        if (timers[i].period) start(i, rand_below(timers[i].period));
+    }
+
+    while ((int32_t)(rtc_sim.now - end) < 0) {
+        check_alarm();
+        if (!rtc_sim.armed) break;
+
+        // Every eighth alarm fires up to eight ticks early, as it does when it
+        // was set early for a Stop mode wake-up but the MCU only slept
+        uint32_t at = rtc_sim.alarm;
+        if (rand_below(8) == 0) {
+            at -= rand_below(9);
+            stats.early_alarms++;
+        }
+
+        if ((int32_t)(at - rtc_sim.now) > 0) rtc_sim.now = at;
+        rtc_sim.armed = false;
+
+        uint64_t begin = ns();
+        TimerIrqHandler();
+        stats.irq_ns += ns() - begin;
+        stats.irq_count++;
+    }
+
+    uint64_t fired = 0;
+    for (unsigned int i = 0; i < TIMERS; i++) fired += timers[i].fired;
+
+    printf("Timers:               %u (at most %u running)\n", TIMERS, stats.max_running);
+    printf("Callbacks:            %llu\n", (unsigned long long)fired);
+    printf("Alarms set:           %u (%u fired early)\n", rtc_sim.alarms, stats.early_alarms);
+    printf("RTC polled:           %u ticks\n", rtc_sim.polled);
+    printf("TimerStart:           %.0f ns\n", (double)stats.start_ns / stats.start_count);
+    printf("TimerStop:            %.0f ns\n", (double)stats.stop_ns / stats.stop_count);
+    printf("TimerIrqHandler:      %.0f ns (including callbacks)\n", (double)stats.irq_ns / stats.irq_count);
+    printf("Late:                 %.2f ticks on average, %u at most\n",
+        (double)stats.late_total / fired, stats.max_late);
+    printf("Fired early:          %u\n", stats.early);
+    printf("Deadline moved:       %u\n", stats.moved);
+    printf("Alarm not for root:   %u\n", stats.missed);
+
+    if (stats.early || stats.moved || stats.missed || (int32_t)(rtc_sim.now - end) < 0) {
+        printf("FAILED\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}